@@ -32,15 +32,378 @@
 #pragma once
 #include <cstdint>
 #include <array>
+#include <algorithm>
+#include <atomic>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 namespace {
 
+/**
+ * Kernels for bulk operations on arrays of bitmap words.  These use AVX2 or
+ * NEON where the target supports them, and fall back to scalar loops
+ * otherwise (and for the tail of each array).
+ */
+namespace bitset_kernels
+{
+/**
+ * `dst[i] &= ~src[i]` for each of the `n` words.
+ */
+inline void and_not(uint64_t *dst, const uint64_t *src, size_t n)
+{
+	size_t i = 0;
+#if defined(__AVX2__)
+	for ( ; i + 4 <= n ; i += 4)
+	{
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+		__m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_andnot_si256(s, d));
+	}
+#elif defined(__ARM_NEON)
+	for ( ; i + 2 <= n ; i += 2)
+	{
+		vst1q_u64(dst + i, vbicq_u64(vld1q_u64(dst + i), vld1q_u64(src + i)));
+	}
+#endif
+	for ( ; i < n ; i++)
+	{
+		dst[i] &= ~src[i];
+	}
+}
+/**
+ * `dst[i] |= src[i]` for each of the `n` words.
+ */
+inline void or_into(uint64_t *dst, const uint64_t *src, size_t n)
+{
+	size_t i = 0;
+#if defined(__AVX2__)
+	for ( ; i + 4 <= n ; i += 4)
+	{
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+		__m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_or_si256(s, d));
+	}
+#elif defined(__ARM_NEON)
+	for ( ; i + 2 <= n ; i += 2)
+	{
+		vst1q_u64(dst + i, vorrq_u64(vld1q_u64(dst + i), vld1q_u64(src + i)));
+	}
+#endif
+	for ( ; i < n ; i++)
+	{
+		dst[i] |= src[i];
+	}
+}
+/**
+ * `dst[i] &= src[i]` for each of the `n` words.
+ */
+inline void and_into(uint64_t *dst, const uint64_t *src, size_t n)
+{
+	size_t i = 0;
+#if defined(__AVX2__)
+	for ( ; i + 4 <= n ; i += 4)
+	{
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+		__m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_and_si256(s, d));
+	}
+#elif defined(__ARM_NEON)
+	for ( ; i + 2 <= n ; i += 2)
+	{
+		vst1q_u64(dst + i, vandq_u64(vld1q_u64(dst + i), vld1q_u64(src + i)));
+	}
+#endif
+	for ( ; i < n ; i++)
+	{
+		dst[i] &= src[i];
+	}
+}
+/**
+ * Returns the number of set bits in the `n` words.
+ */
+inline size_t popcount(const uint64_t *src, size_t n)
+{
+	size_t i = 0;
+	size_t total = 0;
+#if defined(__AVX2__)
+	// Nibble lookup table popcount (Mula et al.), accumulating per-lane
+	// totals with `vpsadbw`.
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+	for ( ; i + 4 <= n ; i += 4)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		__m256i lo = _mm256_and_si256(v, low_mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+		__m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+		                                 _mm256_shuffle_epi8(lookup, hi));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+	}
+	total += _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+	         _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for ( ; i + 2 <= n ; i += 2)
+	{
+		total += vaddvq_u8(vcntq_u8(vreinterpretq_u8_u64(vld1q_u64(src + i))));
+	}
+#endif
+	for ( ; i < n ; i++)
+	{
+		total += __builtin_popcountll(src[i]);
+	}
+	return total;
+}
+/**
+ * Returns the index of the first word at or after `i` (and before `n`) that
+ * is not equal to `skip`, or `n` if there is none.  `skip` is expected to be
+ * all zeroes or all ones, for searching for set or clear bits respectively.
+ */
+inline size_t first_word_not(const uint64_t *src, size_t i, size_t n, uint64_t skip)
+{
+#if defined(__AVX2__)
+	const __m256i s = _mm256_set1_epi64x(skip);
+	for ( ; i + 4 <= n ; i += 4)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, s)) != -1)
+		{
+			break;
+		}
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint64x2_t s = vdupq_n_u64(skip);
+	for ( ; i + 2 <= n ; i += 2)
+	{
+		uint64x2_t diff = veorq_u64(vld1q_u64(src + i), s);
+		if (vmaxvq_u32(vreinterpretq_u32_u64(diff)) != 0)
+		{
+			break;
+		}
+	}
+#endif
+	for ( ; i < n ; i++)
+	{
+		if (src[i] != skip)
+		{
+			return i;
+		}
+	}
+	return n;
+}
+} // namespace bitset_kernels
+
+/**
+ * Summary for a `BitSet`: a second-level bitmap with one bit per word of the
+ * main bitmap, so that searches can skip runs of uninteresting words 64 at a
+ * time.  This is the primary template, used when the summary is disabled.  It
+ * has no storage and its methods compile away.
+ */
+template<size_t Words, bool IsAtomic, bool Enabled>
+struct BitSetSummary
+{
+	/**
+	 * A struct containing no members has size 1, but a struct containing a
+	 * zero-length array has size 0 in the Itanium ABI.
+	 */
+	int unused[0];
+	/**
+	 * Notify the summary that `mask` was ORed into word `i`, which
+	 * previously had the value `old`.
+	 */
+	void after_or(size_t, uint64_t, uint64_t) {}
+	/**
+	 * Notify the summary that word `i`, which previously had the value `old`,
+	 * was ANDed with `mask`.
+	 */
+	void after_and(size_t, uint64_t, uint64_t) {}
+	/**
+	 * Recompute the summary after a bulk update to the words.
+	 */
+	void rebuild(const uint64_t *) {}
+	/**
+	 * Returns the index of the first word at or after `i` that is not equal
+	 * to `skip` (all zeroes or all ones), or `Words` if there is none.
+	 */
+	size_t next_word(const uint64_t *w, size_t i, uint64_t skip) const
+	{
+		return bitset_kernels::first_word_not(w, i, Words, skip);
+	}
+};
+
+/**
+ * Summary for a `BitSet`, when enabled.  This keeps two summary bitmaps: one
+ * recording the words that may contain set bits and one recording the words
+ * that are known to contain no clear bits.
+ *
+ * Both are conservative: searches treat a summary bit as a hint and check the
+ * word itself.  In the atomic variant, `set` and `clear` only ever make the
+ * summaries less precise, because another thread may be updating the same
+ * word, and the bulk operations (which must not run concurrently) restore
+ * precision.  In the non-atomic variant, the summaries are kept exact.
+ *
+ * The initial state of both summaries is all zeroes, which is consistent
+ * with a bitmap that is all zeroes.  This matters because some users (for
+ * example, heaps created with `PageAllocator`) rely on zeroed memory rather
+ * than running constructors.
+ */
+template<size_t Words, bool IsAtomic>
+struct BitSetSummary<Words, IsAtomic, true>
+{
+	/**
+	 * The number of words in each summary.
+	 */
+	static const size_t summary_words = (Words + 63) / 64;
+	/**
+	 * The type of each summary word.
+	 */
+	using word = typename std::conditional<IsAtomic, std::atomic<uint64_t>, uint64_t>::type;
+	/**
+	 * Bit `i` is set if word `i` may have any bits set.
+	 */
+	std::array<word, summary_words> maybe_nonempty;
+	/**
+	 * Bit `i` is set if word `i` definitely has all bits set.
+	 */
+	std::array<word, summary_words> known_full;
+	/**
+	 * Returns the value of a summary word.
+	 */
+	static uint64_t load(const uint64_t &w)
+	{
+		return w;
+	}
+	/**
+	 * Returns the value of a summary word.
+	 */
+	static uint64_t load(const std::atomic<uint64_t> &w)
+	{
+		return w.load(std::memory_order_relaxed);
+	}
+	/**
+	 * Set the bit for word `i` in summary `s`, if it isn't already set.
+	 */
+	static void set_bit(std::array<word, summary_words> &s, size_t i)
+	{
+		uint64_t mask = 1ULL << (i % 64);
+		word &w = s[i / 64];
+		if ((load(w) & mask) == 0)
+		{
+			w |= mask;
+		}
+	}
+	/**
+	 * Clear the bit for word `i` in summary `s`, if it is set.
+	 */
+	static void clear_bit(std::array<word, summary_words> &s, size_t i)
+	{
+		uint64_t mask = 1ULL << (i % 64);
+		word &w = s[i / 64];
+		if ((load(w) & mask) != 0)
+		{
+			w &= ~mask;
+		}
+	}
+	/**
+	 * Notify the summary that `mask` was ORed into word `i`, which previously
+	 * had the value `old`.
+	 */
+	void after_or(size_t i, uint64_t old, uint64_t mask)
+	{
+		set_bit(maybe_nonempty, i);
+		if (!IsAtomic && ((old | mask) == ~0ULL))
+		{
+			set_bit(known_full, i);
+		}
+	}
+	/**
+	 * Notify the summary that word `i`, which previously had the value `old`,
+	 * was ANDed with `mask`.
+	 */
+	void after_and(size_t i, uint64_t old, uint64_t mask)
+	{
+		clear_bit(known_full, i);
+		if (!IsAtomic && ((old & mask) == 0))
+		{
+			clear_bit(maybe_nonempty, i);
+		}
+	}
+	/**
+	 * Recompute both summaries exactly from the words.
+	 */
+	void rebuild(const uint64_t *w)
+	{
+		for (size_t s=0 ; s<summary_words ; s++)
+		{
+			uint64_t nonempty = 0;
+			uint64_t full = 0;
+			for (size_t i=s*64 ; (i<Words) && (i<(s+1)*64) ; i++)
+			{
+				nonempty |= (uint64_t)(w[i] != 0) << (i % 64);
+				full |= (uint64_t)(w[i] == ~0ULL) << (i % 64);
+			}
+			maybe_nonempty[s] = nonempty;
+			known_full[s] = full;
+		}
+	}
+	/**
+	 * Returns the index of the first word at or after `i` that is not equal
+	 * to `skip` (all zeroes or all ones), or `Words` if there is none.  Only
+	 * the words that the summary marks as candidates are inspected.
+	 */
+	size_t next_word(const uint64_t *w, size_t i, uint64_t skip) const
+	{
+		while (i < Words)
+		{
+			size_t s = i / 64;
+			auto candidates = [&](size_t s)
+				{
+					return (skip == 0) ? load(maybe_nonempty[s]) : ~load(known_full[s]);
+				};
+			uint64_t bits = candidates(s) & (~0ULL << (i % 64));
+			while (bits == 0)
+			{
+				if (++s == summary_words)
+				{
+					return Words;
+				}
+				bits = candidates(s);
+			}
+			i = s * 64 + __builtin_ctzll(bits);
+			if (i >= Words)
+			{
+				return Words;
+			}
+			if (w[i] != skip)
+			{
+				return i;
+			}
+			i++;
+		}
+		return Words;
+	}
+};
+
 /**
  * Class representing a fixed-size array of bits.  The atomic flag, if set,
  * ensures that set and clear operations are atomic, but assumes that any of
- * the O(S) operations are not performed concurrently.
+ * the O(S) operations (searches and the bulk operations) are not performed
+ * concurrently.
+ *
+ * Bits are stored most-significant first within each word, so bit `i` is
+ * `1 << (63 - i % 64)` in word `i / 64`.  Bits at or beyond `S` in the last
+ * word are always zero.
+ *
+ * If the summarised flag is set, the bitmap also maintains a summary (see
+ * `BitSetSummary`) that lets searches for set or clear bits skip 64 words at
+ * a time.  This costs an extra bit test on each `set` and `clear`, and is
+ * worthwhile for large, sparse bitmaps.
  */
-template<size_t S, bool IsAtomic=false>
+template<size_t S, bool IsAtomic=false, bool Summarised=false>
 class BitSet
 {
 	/**
@@ -66,36 +429,137 @@ class BitSet
 	 */
 	std::array<bitfield_word, words> bits;
 	/**
-	 * Compare and exchange on an atomic type.  Used so that instantiations
-	 * will call nonatomic or atomic overloads depending on the type of
-	 * `bitfield_word`.
+	 * The summary of `bits`, or an empty structure if this bitmap is not
+	 * summarised.
+	 */
+	BitSetSummary<words, IsAtomic, Summarised> summary;
+	/**
+	 * Atomically OR `mask` into `w`, returning the previous value.  Used so
+	 * that instantiations will call nonatomic or atomic overloads depending
+	 * on the type of `bitfield_word`.
 	 */
-	bool cmpexch(std::atomic<uint64_t> &w, uint64_t &expected, uint64_t desired)
+	static nonatomic_bitfield_word fetch_or(std::atomic<uint64_t> &w,
+	                                        nonatomic_bitfield_word mask,
+	                                        std::memory_order order)
 	{
-		return w.compare_exchange_strong(expected, desired);
+		return w.fetch_or(mask, order);
 	}
 	/**
-	 * Compare and exchange on a non-atomic type.  Used so that instantiations
-	 * will call nonatomic or atomic overloads depending on the type of
-	 * `bitfield_word`.
+	 * OR `mask` into `w`, returning the previous value.  Used so that
+	 * instantiations will call nonatomic or atomic overloads depending on the
+	 * type of `bitfield_word`.
 	 */
-	bool cmpexch(uint64_t &w, uint64_t &expected, uint64_t desired)
+	static nonatomic_bitfield_word fetch_or(nonatomic_bitfield_word &w,
+	                                        nonatomic_bitfield_word mask,
+	                                        std::memory_order)
 	{
-		// After inlining, `w == expected` should always be optimised to true.
-		if (w == expected)
-		{
-			w = desired;
-			return true;
-		}
-		return false;
+		nonatomic_bitfield_word old = w;
+		w = old | mask;
+		return old;
 	}
-	nonatomic_bitfield_word load(nonatomic_bitfield_word &w)
+	/**
+	 * OR `mask` into `w` with a plain load and store, returning the previous
+	 * value.  Only safe if no other thread modifies `w` concurrently.
+	 */
+	static nonatomic_bitfield_word or_unshared(std::atomic<uint64_t> &w,
+	                                           nonatomic_bitfield_word mask)
 	{
-		return w;
+		nonatomic_bitfield_word old = w.load(std::memory_order_relaxed);
+		w.store(old | mask, std::memory_order_relaxed);
+		return old;
 	}
-	nonatomic_bitfield_word load(std::atomic<uint64_t> &w)
+	/**
+	 * OR `mask` into `w`, returning the previous value.
+	 */
+	static nonatomic_bitfield_word or_unshared(nonatomic_bitfield_word &w,
+	                                           nonatomic_bitfield_word mask)
+	{
+		return fetch_or(w, mask, std::memory_order_relaxed);
+	}
+	/**
+	 * Atomically AND `mask` into `w`, returning the previous value.  Used so
+	 * that instantiations will call nonatomic or atomic overloads depending
+	 * on the type of `bitfield_word`.
+	 */
+	static nonatomic_bitfield_word fetch_and(std::atomic<uint64_t> &w,
+	                                         nonatomic_bitfield_word mask,
+	                                         std::memory_order order)
 	{
-		return w.load();
+		return w.fetch_and(mask, order);
+	}
+	/**
+	 * AND `mask` into `w`, returning the previous value.  Used so that
+	 * instantiations will call nonatomic or atomic overloads depending on the
+	 * type of `bitfield_word`.
+	 */
+	static nonatomic_bitfield_word fetch_and(nonatomic_bitfield_word &w,
+	                                         nonatomic_bitfield_word mask,
+	                                         std::memory_order)
+	{
+		nonatomic_bitfield_word old = w;
+		w = old & mask;
+		return old;
+	}
+	/**
+	 * Returns the mask for bit `i` within its word.
+	 */
+	static nonatomic_bitfield_word bit_mask(size_t i)
+	{
+		return 1ULL << ((bits_per_word-1) - (i % bits_per_word));
+	}
+	static_assert(sizeof(bitfield_word) == sizeof(nonatomic_bitfield_word),
+	              "Atomic words must have the same layout as plain words");
+	/**
+	 * Returns the storage as an array of plain words, for the bulk kernels.
+	 */
+	nonatomic_bitfield_word *raw()
+	{
+		return reinterpret_cast<nonatomic_bitfield_word*>(bits.data());
+	}
+	/**
+	 * Returns the storage as an array of plain words, for the bulk kernels.
+	 */
+	const nonatomic_bitfield_word *raw() const
+	{
+		return reinterpret_cast<const nonatomic_bitfield_word*>(bits.data());
+	}
+	/**
+	 * Returns a mask with the bits for indexes `[start, end)` within a word
+	 * set, where `0 <= start < end <= 64`.
+	 */
+	static nonatomic_bitfield_word range_mask(size_t start, size_t end)
+	{
+		nonatomic_bitfield_word mask = ~0ULL >> start;
+		if (end < bits_per_word)
+		{
+			mask &= ~(~0ULL >> end);
+		}
+		return mask;
+	}
+	/**
+	 * Find the first bit at or after `idx` whose value is not the same as the
+	 * corresponding bit in `skip` (all zeroes to find a set bit, all ones to
+	 * find a clear bit).  Returns `S` if there is no such bit.
+	 */
+	size_t find_from(size_t idx, nonatomic_bitfield_word skip) const
+	{
+		if (idx >= S)
+		{
+			return S;
+		}
+		const nonatomic_bitfield_word *w = raw();
+		size_t i = idx / bits_per_word;
+		nonatomic_bitfield_word word = (w[i] ^ skip) & (~0ULL >> (idx % bits_per_word));
+		if (word == 0)
+		{
+			i = summary.next_word(w, i+1, skip);
+			if (i == words)
+			{
+				return S;
+			}
+			word = w[i] ^ skip;
+		}
+		return std::min(i * bits_per_word + __builtin_clzll(word), S);
 	}
 	public:
 	/**
@@ -107,6 +571,7 @@ class BitSet
 		{
 			w = 0;
 		}
+		summary.rebuild(raw());
 	}
 	/**
 	 * Accessor.  Returns the bit at the specified index.
@@ -114,96 +579,300 @@ class BitSet
 	bool operator[](size_t i) const
 	{
 		ASSERT(i < S);
-		size_t word = i / bits_per_word;
-		size_t bit = i % bits_per_word;
-		return bits[word] & (1ULL << ((bits_per_word-1) - bit));
+		return bits[i / bits_per_word] & bit_mask(i);
+	}
+	/**
+	 * Prefetch the word that holds the bit at the specified index, in
+	 * preparation for writing it.
+	 */
+	void prefetch(size_t i) const
+	{
+		ASSERT(i < S);
+		__builtin_prefetch(&bits[i / bits_per_word], 1);
 	}
 	/**
 	 * Set the bit at the specified index to 1.
+	 *
+	 * In the atomic variant, this is a single atomic OR.  By default it does
+	 * not order any other memory accesses: callers that publish data along
+	 * with the bit must pass a stronger order.
 	 */
-	void set(size_t i)
+	void set(size_t i, std::memory_order order=std::memory_order_relaxed)
 	{
 		ASSERT(i < S);
 		size_t word = i / bits_per_word;
-		size_t bit = i % bits_per_word;
-		bitfield_word &w = bits[word];
-		bitfield_word desired;
-		nonatomic_bitfield_word expected = load(w);
-		do {
-			desired = expected | (1ULL << ((bits_per_word-1) - bit));
-		} while (!cmpexch(w, expected, desired));
+		nonatomic_bitfield_word mask = bit_mask(i);
+		summary.after_or(word, fetch_or(bits[word], mask, order), mask);
+	}
+	/**
+	 * Set the bit at the specified index to 1, when the caller knows that no
+	 * other thread is modifying the word that holds it.  In the atomic
+	 * variant, this is a relaxed load and store rather than an atomic OR.
+	 */
+	void set_unshared(size_t i)
+	{
+		ASSERT(i < S);
+		size_t word = i / bits_per_word;
+		nonatomic_bitfield_word mask = bit_mask(i);
+		summary.after_or(word, or_unshared(bits[word], mask), mask);
 	}
 	/**
 	 * Set the bit at the specified index to 0.
+	 *
+	 * In the atomic variant, this is a single atomic AND, with the same
+	 * ordering defaults as `set`.
+	 */
+	void clear(size_t i, std::memory_order order=std::memory_order_relaxed)
+	{
+		ASSERT(i < S);
+		size_t word = i / bits_per_word;
+		nonatomic_bitfield_word mask = ~bit_mask(i);
+		summary.after_and(word, fetch_and(bits[word], mask, order), mask);
+	}
+	/**
+	 * Set the bit at the specified index to 1 and return its previous value.
+	 * In the atomic variant, exactly one of several threads racing to set the
+	 * same bit will see `false`, so this can be used to claim objects.
+	 */
+	bool test_and_set(size_t i, std::memory_order order=std::memory_order_relaxed)
+	{
+		ASSERT(i < S);
+		size_t word = i / bits_per_word;
+		nonatomic_bitfield_word mask = bit_mask(i);
+		nonatomic_bitfield_word old = fetch_or(bits[word], mask, order);
+		summary.after_or(word, old, mask);
+		return (old & mask) != 0;
+	}
+	/**
+	 * Set the bit at the specified index to 0 and return its previous value.
 	 */
-	void clear(size_t i)
+	bool test_and_clear(size_t i, std::memory_order order=std::memory_order_relaxed)
 	{
 		ASSERT(i < S);
 		size_t word = i / bits_per_word;
-		size_t bit = i % bits_per_word;
-		bitfield_word &w = bits[word];
-		nonatomic_bitfield_word desired;
-		nonatomic_bitfield_word expected = w;
-		do {
-			desired = expected & ~(1ULL << ((bits_per_word-1)-bit));
-		} while (!cmpexch(w, expected, desired));
+		nonatomic_bitfield_word mask = bit_mask(i);
+		nonatomic_bitfield_word old = fetch_and(bits[word], ~mask, order);
+		summary.after_and(word, old, ~mask);
+		return (old & mask) != 0;
 	}
 	/**
-	 * Returns the index of the first zero in the set.
+	 * Returns the index of the first zero in the set, or `S` if there are no
+	 * zeroes.
 	 *
 	 * WARNING: This is not atomic.
 	 */
-	size_t first_zero()
+	size_t first_zero() const
 	{
-		size_t idx = 0;
-		for (size_t i=0 ; i<words ; i++, idx+=64)
+		return find_from(0, ~0ULL);
+	}
+	/**
+	 * Returns the index of the first zero at or after `idx`, or `S` if there
+	 * are no zeroes after this index.
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	size_t first_zero(size_t idx) const
+	{
+		return find_from(idx, ~0ULL);
+	}
+	/**
+	 * Returns the index of the first bit that is set at or after the
+	 * specified index, or `S` if no bit is set after the specified index.
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	size_t first_set(size_t idx) const
+	{
+		return find_from(idx, 0);
+	}
+	/**
+	 * Returns the index of the first bit that is set after the specified
+	 * index, or `S` if no bit is set after the specified index..
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	size_t one_after(size_t idx) const
+	{
+		return find_from(idx + 1, 0);
+	}
+	/**
+	 * Returns the index of the last set bit at or before `idx` in the same
+	 * word as `idx`, or `S` if there is none.
+	 */
+	size_t last_set_in_word(size_t idx) const
+	{
+		ASSERT(idx < S);
+		size_t i = idx / bits_per_word;
+		nonatomic_bitfield_word word = raw()[i] & (~0ULL << ((bits_per_word-1) - (idx % bits_per_word)));
+		if (word == 0)
+		{
+			return S;
+		}
+		return i * bits_per_word + (bits_per_word-1) - __builtin_ctzll(word);
+	}
+	/**
+	 * Returns the index of the last set bit at or before `idx`, or `S` if
+	 * there is none.  This scans backwards a word at a time.
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	size_t last_set(size_t idx) const
+	{
+		size_t found = last_set_in_word(idx);
+		for (size_t i=idx/bits_per_word ; (found == S) && (i > 0) ; i--)
+		{
+			found = last_set_in_word((i * bits_per_word) - 1);
+		}
+		return found;
+	}
+	/**
+	 * Call `fn` with the index of each set bit, in increasing order, starting
+	 * from `idx`.  Words with no bits set are skipped in bulk.  Bits may be
+	 * cleared (but not set) by `fn` during iteration.
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	template<typename Fn>
+	void for_each_set_bit(Fn &&fn, size_t idx=0) const
+	{
+		if (idx >= S)
 		{
-			uint64_t word = bits[i];
-			if (word == 0)
+			return;
+		}
+		const nonatomic_bitfield_word *w = raw();
+		size_t i = idx / bits_per_word;
+		nonatomic_bitfield_word word = w[i] & (~0ULL >> (idx % bits_per_word));
+		while (true)
+		{
+			while (word != 0)
 			{
-				return idx;
+				int bit = __builtin_clzll(word);
+				word &= ~(1ULL << ((bits_per_word-1) - bit));
+				fn(i * bits_per_word + bit);
 			}
-			if (word != 0xffffffffffffffffULL)
+			i = summary.next_word(w, i+1, 0);
+			if (i == words)
 			{
-				if (__builtin_clzll(word) > 0)
-				{
-					return idx;
-				}
-				return idx + __builtin_clzll(~word);
+				return;
 			}
+			word = w[i];
 		}
-		return S;
 	}
 	/**
-	 * Returns the index of the first bit that is set after the specified
-	 * index, or `S` if no bit is set after the specified index..
+	 * Returns the number of bits that are set.
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	size_t popcount() const
+	{
+		return bitset_kernels::popcount(raw(), words);
+	}
+	/**
+	 * Returns true if no bits are set.
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	bool empty() const
+	{
+		return summary.next_word(raw(), 0, 0) == words;
+	}
+	/**
+	 * Clear every bit that is set in `other`.
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	template<bool OtherIsAtomic, bool OtherSummarised>
+	BitSet &and_not(const BitSet<S, OtherIsAtomic, OtherSummarised> &other)
+	{
+		bitset_kernels::and_not(raw(), other.raw(), words);
+		summary.rebuild(raw());
+		return *this;
+	}
+	/**
+	 * Set every bit that is set in `other`.
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	template<bool OtherIsAtomic, bool OtherSummarised>
+	BitSet &operator|=(const BitSet<S, OtherIsAtomic, OtherSummarised> &other)
+	{
+		bitset_kernels::or_into(raw(), other.raw(), words);
+		summary.rebuild(raw());
+		return *this;
+	}
+	/**
+	 * Clear every bit that is not set in `other`.
 	 *
 	 * WARNING: This is not atomic.
 	 */
-	size_t one_after(size_t idx)
+	template<bool OtherIsAtomic, bool OtherSummarised>
+	BitSet &operator&=(const BitSet<S, OtherIsAtomic, OtherSummarised> &other)
 	{
-		idx++;
-		size_t bit_idx = (idx % 64);
-		for (size_t i=idx/64 ; i<words ; i++, idx+=64)
+		bitset_kernels::and_into(raw(), other.raw(), words);
+		summary.rebuild(raw());
+		return *this;
+	}
+	/**
+	 * Set all of the bits in the range `[start, end)`.
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	void set_range(size_t start, size_t end)
+	{
+		update_range(start, end, true);
+	}
+	/**
+	 * Clear all of the bits in the range `[start, end)`.
+	 *
+	 * WARNING: This is not atomic.
+	 */
+	void clear_range(size_t start, size_t end)
+	{
+		update_range(start, end, false);
+	}
+	private:
+	/**
+	 * Other instantiations need access to the raw words for bulk operations.
+	 */
+	template<size_t, bool, bool> friend class BitSet;
+	/**
+	 * Set or clear all of the bits in the range `[start, end)`.
+	 */
+	void update_range(size_t start, size_t end, bool value)
+	{
+		ASSERT(end <= S);
+		if (start >= end)
 		{
-			uint64_t word = bits[i];
-			if (word == 0)
-			{
-				bit_idx = 0;
-				continue;
-			}
-			// Skip any words that have no non-zero bits set.
-			// Zero all bits before the index that we're looking for.
-			uint64_t mask = (bit_idx == 0) ? -1ULL : ~((-1ULL) << (64 - bit_idx));
-			word &= mask;
-			if (word == 0)
+			return;
+		}
+		nonatomic_bitfield_word *w = raw();
+		size_t first_word = start / bits_per_word;
+		size_t last_word = (end - 1) / bits_per_word;
+		auto apply = [&](size_t i, nonatomic_bitfield_word mask)
 			{
-				bit_idx = 0;
-				continue;
-			}
-			return (i*64) + __builtin_clzll(word);
+				nonatomic_bitfield_word old = w[i];
+				if (value)
+				{
+					w[i] = old | mask;
+					summary.after_or(i, old, mask);
+				}
+				else
+				{
+					w[i] = old & ~mask;
+					summary.after_and(i, old, ~mask);
+				}
+			};
+		if (first_word == last_word)
+		{
+			apply(first_word, range_mask(start % bits_per_word, end - first_word * bits_per_word));
+			return;
+		}
+		for (size_t i=first_word+1 ; i<last_word ; i++)
+		{
+			apply(i, ~0ULL);
 		}
-		return S;
+		apply(first_word, range_mask(start % bits_per_word, bits_per_word));
+		apply(last_word, range_mask(0, end - last_word * bits_per_word));
 	}
 };
 
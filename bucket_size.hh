@@ -171,13 +171,22 @@ constexpr unsigned SmallBucketSize(size_t i)
 	return ((1<<(((i+12) >> 2))) * ((((i+12) & 0b11) + 4) << (log2<sizeof(void*)>() - 3)));
 }
 
+/**
+ * Returns the number of the first large bucket.  Large buckets are numbered
+ * immediately after the medium buckets.
+ */
+constexpr int first_large_bucket()
+{
+	return largest_medium_bucket() + 1;
+}
+
 constexpr size_t large_bucket_size(int bucket)
 {
-	if (bucket < largest_medium_bucket())
+	if (bucket < first_large_bucket())
 	{
 		return 0;
 	}
-	bucket -= largest_medium_bucket();
+	bucket -= first_large_bucket();
 	return (bucket * page_size) + 32_KiB;
 }
 
@@ -196,7 +205,7 @@ struct BucketSize
 
 static_assert(BucketSize<largest_medium_bucket()>::value < 32_KiB,
 		"Largest medium bucket is too big");
-static_assert(BucketSize<largest_medium_bucket()+1>::value >= 32_KiB,
+static_assert(BucketSize<first_large_bucket()>::value == 32_KiB,
 		"Largest medium bucket is too small");
 
 #if 0
@@ -254,8 +263,10 @@ constexpr int small_bucket_for_size<0>(size_t size)
  */
 constexpr int large_bucket_for_size(size_t sz)
 {
-	ASSERT(sz >= 32_KiB);
 	ASSERT(sz <= chunk_size / 4);
+	// Sizes between the largest medium bucket and 32KiB are rounded up into
+	// the first large bucket.
+	sz = sz < 32_KiB ? 32_KiB : sz;
 	// Round up the requested size to the nearest multiple of the page size,
 	// then subtract a constant such that large bucket 0 is 32KiB.
 	return ((sz + page_size-1) / page_size) - (32_KiB / page_size);
@@ -267,7 +278,7 @@ constexpr int large_bucket_for_size(size_t sz)
  */
 constexpr int largest_large_bucket()
 {
-	return large_bucket_for_size(chunk_size / 4);
+	return large_bucket_for_size((chunk_size / 4) - 1) + first_large_bucket();
 }
 
 static_assert(large_bucket_for_size(32_KiB) == 0,
@@ -284,13 +295,13 @@ constexpr int bucket_for_size(size_t sz)
 {
 	// FIXME: The optimisations for SuperMalloc are not quite right here, so
 	// they're gone for now, but this is a 
-	if (sz < 32_KiB)
+	if (sz <= BucketSize<largest_medium_bucket()>::value)
 	{
 		return small_bucket_for_size<largest_medium_bucket()>(sz);
 	}
 	if (sz < (chunk_size / 4))
 	{
-		return large_bucket_for_size(sz) + largest_medium_bucket();
+		return large_bucket_for_size(sz) + first_large_bucket();
 	}
 	// Not a fixed-sized bucket at all
 	return -1;
@@ -299,7 +310,315 @@ constexpr int bucket_for_size(size_t sz)
 /**
  * The number of fixed-size buckets to use.
  */
-static const int fixed_buckets = largest_medium_bucket() + largest_large_bucket();
+static const int fixed_buckets = largest_large_bucket() + 1;
+
+static_assert(bucket_for_size(BucketSize<largest_medium_bucket()>::value + 1) == first_large_bucket(),
+		"Sizes just above the largest medium bucket must be large");
+static_assert(bucket_for_size((chunk_size / 4) - 1) == largest_large_bucket(),
+		"Largest large bucket is in the wrong place");
+
+/**
+ * Size-class policies.  The slab allocator is parameterised by a policy that
+ * maps from allocation sizes to fixed-size buckets.  A policy is a stateless
+ * class that provides:
+ *
+ *  - `bucket_count()`, the number of fixed-size buckets.
+ *  - `size<Bucket>()`, the size of each allocation in a bucket.
+ *  - `bucket_for_size(size_t)`, the bucket for a given size, or -1 if the
+ *    size is too large for any bucket (and so must be handled by a huge
+ *    allocator).
+ *  - `largest_medium_bucket()`, the last bucket that is split into folios.
+ *    Buckets after this one are managed as runs of pages and so must be a
+ *    multiple of the page size.
+ *  - `chunk_size_for_size(size_t)`, the size of the chunk that the allocator
+ *    for a bucket manages.  This must be a multiple of `chunk_size`.
+ *
+ * Folio sizes, the number of allocations per chunk and the metadata overhead
+ * are all derived from these for each bucket.
+ */
+
+/**
+ * The default size-class policy.  Small buckets are multiples of the pointer
+ * size, medium buckets are cache-line multiples that are either prime or a
+ * power of two, and large buckets are page multiples.
+ */
+struct prime_or_power_of_two_size_classes
+{
+	/**
+	 * The number of buckets.
+	 */
+	static constexpr int bucket_count()
+	{
+		return fixed_buckets;
+	}
+	/**
+	 * The size of the allocations in `Bucket`.
+	 */
+	template<int Bucket>
+	static constexpr size_t size()
+	{
+		return BucketSize<Bucket>::value;
+	}
+	/**
+	 * The last bucket that is managed by a folio-based small allocator.
+	 */
+	static constexpr int largest_medium_bucket()
+	{
+		return ::largest_medium_bucket();
+	}
+	/**
+	 * Map from a size to a bucket.
+	 */
+	__attribute__((always_inline))
+	static constexpr int bucket_for_size(size_t sz)
+	{
+		return ::bucket_for_size(sz);
+	}
+	/**
+	 * All buckets use a single chunk.
+	 */
+	static constexpr size_t chunk_size_for_size(size_t)
+	{
+		return chunk_size;
+	}
+};
+
+/**
+ * Size-class policy in the style of jemalloc.  The first four buckets are
+ * multiples of `Quantum`, then every doubling is split into four evenly spaced
+ * buckets.  This gives a worst-case internal fragmentation of 20% for
+ * allocations that are larger than `4*Quantum`.  Buckets of `MediumLimit` and
+ * above are large buckets and are managed as runs of pages.
+ */
+template<size_t Quantum=sizeof(void*), size_t MediumLimit=32_KiB>
+struct jemalloc_size_classes
+{
+	static_assert((Quantum & (Quantum - 1)) == 0, "Quantum must be a power of two");
+	static_assert((MediumLimit & (MediumLimit - 1)) == 0, "MediumLimit must be a power of two");
+	static_assert(MediumLimit >= 4 * page_size, "Large buckets must be page multiples");
+	/**
+	 * The size of bucket `bucket`.
+	 */
+	static constexpr size_t size_for_bucket(int bucket)
+	{
+		if (bucket < 4)
+		{
+			return (bucket + 1) * Quantum;
+		}
+		// Each group of four buckets covers one doubling, in steps of a
+		// quarter of the size at the start of the doubling.
+		size_t group_base = (4 * Quantum) << ((bucket - 4) / 4);
+		return group_base + (((bucket - 4) % 4) + 1) * (group_base / 4);
+	}
+	/**
+	 * Map from a size to a bucket, or -1 if the size should be handled by a
+	 * huge allocator.
+	 */
+	__attribute__((always_inline))
+	static constexpr int bucket_for_size(size_t sz)
+	{
+		if (sz >= chunk_size / 4)
+		{
+			return -1;
+		}
+		if (sz <= 4 * Quantum)
+		{
+			return sz == 0 ? 0 : ((sz + Quantum - 1) / Quantum) - 1;
+		}
+		// The power of two at the start of the doubling that contains `sz`.
+		int group_bits = log2(sz - 1);
+		size_t group_base = 1ULL << group_bits;
+		size_t step = group_base / 4;
+		int group = group_bits - log2<4 * Quantum>();
+		return 4 + (group * 4) + ((sz - group_base + step - 1) / step) - 1;
+	}
+	/**
+	 * The number of buckets.  Allocations of a quarter of a chunk or more are
+	 * huge.
+	 */
+	static constexpr int bucket_count()
+	{
+		return bucket_for_size((chunk_size / 4) - 1) + 1;
+	}
+	/**
+	 * The size of the allocations in `Bucket`.
+	 */
+	template<int Bucket>
+	static constexpr size_t size()
+	{
+		return size_for_bucket(Bucket);
+	}
+	/**
+	 * The last bucket that is managed by a folio-based small allocator.
+	 */
+	static constexpr int largest_medium_bucket()
+	{
+		return bucket_for_size(MediumLimit) - 1;
+	}
+	/**
+	 * Large buckets use a chunk that is big enough to hold at least eight
+	 * allocations, so that the metadata at the start of the chunk doesn't
+	 * waste most of the space.
+	 */
+	static constexpr size_t chunk_size_for_size(size_t sz)
+	{
+		return (sz * 8 <= chunk_size) ? chunk_size :
+			((sz * 8 + chunk_size - 1) / chunk_size) * chunk_size;
+	}
+};
 
+static_assert(jemalloc_size_classes<16>::size_for_bucket(4) == 80,
+		"jemalloc size classes are broken");
+static_assert(jemalloc_size_classes<16>::bucket_for_size(129) == 8,
+		"jemalloc size classes are broken");
+static_assert(jemalloc_size_classes<16>::bucket_for_size(128) == 7,
+		"jemalloc size classes are broken");
+static_assert(jemalloc_size_classes<16>::size_for_bucket(
+			jemalloc_size_classes<16>::largest_medium_bucket() + 1) == 32_KiB,
+		"jemalloc size classes are broken");
+
+/**
+ * Returns true if the sizes are in strictly ascending order.
+ */
+constexpr bool sizes_are_ascending()
+{
+	return true;
+}
+/**
+ * Returns true if the sizes are in strictly ascending order.
+ */
+constexpr bool sizes_are_ascending(size_t)
+{
+	return true;
+}
+/**
+ * Returns true if the sizes are in strictly ascending order.
+ */
+template<typename... Rest>
+constexpr bool sizes_are_ascending(size_t first, size_t second, Rest... rest)
+{
+	return (first < second) && sizes_are_ascending(second, rest...);
+}
+/**
+ * Returns true if every size is a multiple of `Align`.
+ */
+template<size_t Align>
+constexpr bool sizes_are_aligned()
+{
+	return true;
+}
+/**
+ * Returns true if every size is a multiple of `Align`.
+ */
+template<size_t Align, typename... Rest>
+constexpr bool sizes_are_aligned(size_t first, Rest... rest)
+{
+	return ((first % Align) == 0) && sizes_are_aligned<Align>(rest...);
+}
+/**
+ * Returns true if every size that is at least `Limit` is a multiple of
+ * `Align`.
+ */
+template<size_t Limit, size_t Align>
+constexpr bool sizes_above_are_aligned()
+{
+	return true;
+}
+/**
+ * Returns true if every size that is at least `Limit` is a multiple of
+ * `Align`.
+ */
+template<size_t Limit, size_t Align, typename... Rest>
+constexpr bool sizes_above_are_aligned(size_t first, Rest... rest)
+{
+	return ((first < Limit) || ((first % Align) == 0)) &&
+	       sizes_above_are_aligned<Limit, Align>(rest...);
+}
+
+/**
+ * Size-class policy defined by a user-supplied table of sizes.  The sizes
+ * must be in strictly ascending order, must be multiples of the pointer size,
+ * and must be smaller than a quarter of a chunk, which is where huge
+ * allocations start.  Sizes of `MediumLimit` and above are large buckets and
+ * must be multiples of the page size.  For example:
+ *
+ * ```
+ * using service_size_classes = table_size_classes<32_KiB, 16, 32, 64, 96, 128, 256, 4_KiB, 64_KiB>;
+ * ```
+ */
+template<size_t MediumLimit, size_t... Sizes>
+struct table_size_classes
+{
+	static_assert(sizeof...(Sizes) > 0, "Size class table must not be empty");
+	static_assert(sizes_are_ascending(Sizes...),
+	              "Size classes must be in strictly ascending order");
+	static_assert(sizes_are_aligned<sizeof(void*)>(Sizes...),
+	              "Size classes must be multiples of the pointer size");
+	static_assert(sizes_above_are_aligned<MediumLimit, page_size>(Sizes...),
+	              "Large size classes must be multiples of the page size");
+	static_assert(sizes_are_ascending(Sizes..., size_t(chunk_size / 4)),
+	              "Size classes must be smaller than a quarter of a chunk");
+	/**
+	 * The number of buckets.
+	 */
+	static constexpr int bucket_count()
+	{
+		return sizeof...(Sizes);
+	}
+	/**
+	 * The size of bucket `bucket`.
+	 */
+	static constexpr size_t size_for_bucket(int bucket)
+	{
+		constexpr size_t sizes[] = { Sizes... };
+		return sizes[bucket];
+	}
+	/**
+	 * Map from a size to a bucket, or -1 if the size is bigger than the
+	 * largest entry in the table.  This is a binary search over the table.
+	 */
+	static constexpr int bucket_for_size(size_t sz)
+	{
+		constexpr size_t sizes[] = { Sizes... };
+		int lower = 0;
+		int upper = sizeof...(Sizes);
+		while (lower < upper)
+		{
+			int mid = (lower + upper) / 2;
+			if (sizes[mid] < sz)
+			{
+				lower = mid + 1;
+			}
+			else
+			{
+				upper = mid;
+			}
+		}
+		return lower == sizeof...(Sizes) ? -1 : lower;
+	}
+	/**
+	 * The size of the allocations in `Bucket`.
+	 */
+	template<int Bucket>
+	static constexpr size_t size()
+	{
+		return size_for_bucket(Bucket);
+	}
+	/**
+	 * The last bucket that is managed by a folio-based small allocator.
+	 */
+	static constexpr int largest_medium_bucket()
+	{
+		return bucket_for_size(MediumLimit) == -1 ?
+			bucket_count() - 1 : bucket_for_size(MediumLimit) - 1;
+	}
+	/**
+	 * All buckets use a single chunk.
+	 */
+	static constexpr size_t chunk_size_for_size(size_t sz)
+	{
+		return chunk_size;
+	}
+};
 
 }
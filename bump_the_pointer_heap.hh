@@ -29,15 +29,22 @@
  */
 
 #include "utils.hh"
+#include "config.hh"
 #include "nonstd_function.hh"
 #include "page.hh"
 #include "BitSet.hh"
 #include "cheri.hh"
+#include "heap_profiler.hh"
+#include "gc_thread_pool.hh"
+#include <algorithm>
 #include <cstddef>
 #include <type_traits>
 
 namespace {
 
+template<size_t RegionSize, class Header, size_t MaxRegions>
+class growable_bump_heap;
+
 /**
  * A simple fixed-size bump-the-pointer heap.  Allows an optional object header.
  */
@@ -82,10 +89,80 @@ class bump_the_pointer_heap
 	 *
 	 * Finding the next object also requires a linear scan but this, again,
 	 * typically requires a single 64-bit memory access for objects smaller
-	 * than 1KiB.
+	 * than 1KiB.  The bitmap is summarised, so that scans over sparse
+	 * regions (for example, after a large object) skip 4096 granules at a
+	 * time.
 	 */
-	BitSet<HeapSize / alloc_granularity, true> start_bits;
+	BitSet<HeapSize / alloc_granularity, true, true> start_bits;
 	static_assert(alloc_granularity >= alignof(void*), "max_align_t is insufficiently aligned!");
+	/**
+	 * The number of granules covered by each word of `start_bits`, and so by
+	 * each entry in the crossing map.
+	 */
+	static const size_t granules_per_block = 64;
+	/**
+	 * The number of blocks in the heap.
+	 */
+	static const size_t blocks = (HeapSize / alloc_granularity + granules_per_block - 1) / granules_per_block;
+	/**
+	 * Crossing map (block-offset table).  For each block that starts inside
+	 * an object (rather than at the start of one), this records how many
+	 * blocks back the object starts.  The object is then the last one that
+	 * starts in that block.
+	 *
+	 * Entries are written for each block that an object covers when the
+	 * object is allocated or moved, and for each block of a filler object
+	 * (a new allocation buffer, or the space taken by a failed reservation).
+	 * Entries for blocks beyond the end of the allocated region are zeroed
+	 * when the region shrinks.  An entry may still point further back than
+	 * the object that covers its block, because the tail of an allocation
+	 * buffer is a filler that starts after the buffer's entries were
+	 * written, so `object_start_for_granule` checks the object that an entry
+	 * leads to before using it.
+	 */
+	std::array<uint32_t, blocks> crossing;
+	/**
+	 * Record the crossing map entries for an object (including its header)
+	 * that occupies granules `[first, end)`.
+	 */
+	void record_crossings(size_t first, size_t end)
+	{
+		size_t first_block = first / granules_per_block;
+		for (size_t b=first_block+1 ; b*granules_per_block < end ; b++)
+		{
+			crossing[b] = b - first_block;
+		}
+	}
+	/**
+	 * Returns the granule at which the object containing granule `g` starts.
+	 * This is one word test if an object starts in the same block before
+	 * `g`, and one load from the crossing map plus two word tests otherwise.
+	 */
+	size_t object_start_for_granule(size_t g)
+	{
+		const size_t none = HeapSize / alloc_granularity;
+		size_t found = start_bits.last_set_in_word(g);
+		if (found != none)
+		{
+			return found;
+		}
+		size_t block = g / granules_per_block;
+		uint32_t back = crossing[block];
+		if ((back != 0) && (back <= block))
+		{
+			found = start_bits.last_set_in_word(((block - back + 1) * granules_per_block) - 1);
+			// The entry is only a hint: if another object starts between
+			// the one that it leads to and `g`, the search below finds it.
+			if ((found != none) && (start_bits.one_after(found) > g))
+			{
+				return found;
+			}
+		}
+		// No crossing entry: this is not inside an allocated object.  Fall
+		// back to a word-level backwards scan.
+		found = start_bits.last_set(g);
+		return (found == none) ? 0 : found;
+	}
 	/**
 	 * Pointer to the heap.
 	 */
@@ -103,6 +180,212 @@ class bump_the_pointer_heap
 	 * transaction must retry.
 	 */
 	std::atomic<long long> version;
+	/**
+	 * Returns the header and object for the allocation that starts at
+	 * granule `start` and ends before granule `next`.
+	 */
+	std::pair<Header*, void*> allocation_between(size_t start, size_t next)
+	{
+		return { header_at(start), object_between(start, next) };
+	}
+	/**
+	 * Returns the header for the allocation that starts at granule `start`.
+	 */
+	Header *header_at(size_t start)
+	{
+		size_t start_byte = start * alloc_granularity;
+		capability<Header> header(reinterpret_cast<Header*>(heap.get()));
+		ASSERT(start_byte < heap.length());
+		// FIXME: handle void header types
+		header.set_offset(start_byte);
+		header.set_bounds(1);
+		return header.get();
+	}
+	/**
+	 * Returns the object for the allocation that starts at granule `start`
+	 * and ends before granule `next`.
+	 */
+	void *object_between(size_t start, size_t next)
+	{
+		ASSERT(start < next);
+		size_t start_byte = start * alloc_granularity;
+		size_t next_byte = next * alloc_granularity;
+		capability<void> obj(heap);
+		obj.set_offset(start_byte + header_size);
+		obj.set_bounds(next_byte - (start_byte + header_size));
+		return obj.get();
+	}
+	/**
+	 * The size of each thread-local allocation buffer (TLAB).  Threads reserve
+	 * space from the shared `start` cursor in blocks of this size and then
+	 * allocate small objects from them without touching any shared state
+	 * other than the start bitmap.
+	 */
+	static const size_t tlab_size = 16384;
+	/**
+	 * The largest allocation (including the header) that is satisfied from a
+	 * TLAB.  Larger allocations reserve their space directly from `start`, so
+	 * that they don't waste most of a buffer.
+	 */
+	static const size_t max_tlab_object = tlab_size / 4;
+	/**
+	 * The smallest space (including the header) that any object can occupy.
+	 */
+	static const size_t min_object_size = header_size + alloc_granularity;
+	/**
+	 * Value returned by the `*_reserve` methods if the heap is full.
+	 */
+	static const size_t reservation_failed = static_cast<size_t>(-1);
+	/**
+	 * A thread's allocation buffer.  This is plain data so that it can be
+	 * stored in thread-local storage without a constructor.
+	 *
+	 * A buffer is valid only for the heap that it was reserved from and only
+	 * until the next collection: the collector bumps `version` and a thread
+	 * whose buffer has a stale `epoch` discards it and reserves a new one.
+	 * The unused part of a buffer is always marked as a separate object in
+	 * the start bitmap, with an all-zero (and therefore unmarked) header, so
+	 * heap walks see it as a dead filler object and compaction reclaims it.
+	 */
+	struct tlab
+	{
+		/**
+		 * The heap that this buffer was reserved from.
+		 */
+		ThisType *owner;
+		/**
+		 * The value of the heap's `version` when the buffer was reserved.
+		 */
+		long long epoch;
+		/**
+		 * The offset in the heap of the next allocation.
+		 */
+		size_t cursor;
+		/**
+		 * The offset in the heap of the end of the buffer.
+		 */
+		size_t limit;
+	};
+	/**
+	 * The current thread's allocation buffer.
+	 */
+	static thread_local tlab current_tlab;
+	/**
+	 * Returns the offset of the end of the allocated part of the heap.  This
+	 * is `start`, unless a failed reservation has moved `start` past the end.
+	 */
+	size_t allocated_end()
+	{
+		return std::min(start.load(), static_cast<size_t>(heap.length()));
+	}
+	/**
+	 * Called after a reservation of `size` bytes at `offset` has failed.  If
+	 * the reservation
+	 * started inside the heap then the space that it would have used is
+	 * marked as a filler object, so that it is not mistaken for part of the
+	 * previous object.
+	 */
+	void mark_unusable(size_t offset, size_t size)
+	{
+		if (offset < heap.length())
+		{
+			size_t end = std::min(offset + size, static_cast<size_t>(heap.length()));
+			start_bits.set(offset / alloc_granularity);
+			record_crossings(offset / alloc_granularity, end / alloc_granularity);
+		}
+	}
+	/**
+	 * Reserve a new allocation buffer for this thread.  Returns false if
+	 * there is not enough space left in the heap.
+	 */
+	bool refill_tlab(tlab &t, long long v)
+	{
+		size_t offset = start.fetch_add(tlab_size);
+		if (offset + tlab_size > heap.length())
+		{
+			mark_unusable(offset, tlab_size);
+			return false;
+		}
+		// The whole buffer is a single filler object until we allocate from it.
+		start_bits.set(offset / alloc_granularity);
+		record_crossings(offset / alloc_granularity, (offset + tlab_size) / alloc_granularity);
+		t = { this, v, offset, offset + tlab_size };
+		return true;
+	}
+	/**
+	 * Reserve `size` bytes from the current thread's allocation buffer,
+	 * refilling it if necessary.  Returns the offset of the reservation in
+	 * the heap, or `reservation_failed`.  If the space remaining in the buffer
+	 * would be too small to hold another object then the reservation absorbs
+	 * it, and `size` is updated.
+	 */
+	size_t tlab_reserve(size_t &size, long long v)
+	{
+		tlab &t = current_tlab;
+		if ((t.owner != this) || (t.epoch != v) || (t.limit - t.cursor < size))
+		{
+			if (!refill_tlab(t, v))
+			{
+				return reservation_failed;
+			}
+		}
+		size_t offset = t.cursor;
+		t.cursor += size;
+		if (t.limit - t.cursor < min_object_size)
+		{
+			size += t.limit - t.cursor;
+			t.cursor = t.limit;
+		}
+		else
+		{
+			set_tlab_start(t, t.cursor / alloc_granularity);
+		}
+		return offset;
+	}
+	/**
+	 * Set the start bit for granule `g`, inside the buffer `t`.  The start
+	 * bit for the next allocation from a buffer is always set by the
+	 * previous one (or by the refill), so this is the only bitmap update on
+	 * the buffer allocation path.  Words of the bitmap that lie entirely
+	 * inside the buffer are only modified by the thread that owns it (or by
+	 * the collector while that thread is stopped), so they are updated
+	 * without an atomic read-modify-write.  The words at the ends of the
+	 * buffer may be shared with a neighbouring reservation.
+	 */
+	void set_tlab_start(const tlab &t, size_t g)
+	{
+		size_t word_start = (g - g % granules_per_block) * alloc_granularity;
+		size_t word_end = word_start + granules_per_block * alloc_granularity;
+		if ((word_start >= t.limit - tlab_size) && (word_end <= t.limit))
+		{
+			start_bits.set_unshared(g);
+		}
+		else
+		{
+			start_bits.set(g);
+		}
+	}
+	/**
+	 * Reserve `size` bytes directly from the shared cursor.  Returns the
+	 * offset of the reservation in the heap, or `reservation_failed`.
+	 */
+	size_t shared_reserve(size_t size)
+	{
+		size_t offset = start.fetch_add(size);
+		if (offset + size > heap.length())
+		{
+			mark_unusable(offset, size);
+			return reservation_failed;
+		}
+		start_bits.set(offset / alloc_granularity);
+		return offset;
+	}
+	/**
+	 * Heaps built from multiple instances of this class may inspect their
+	 * internal state.
+	 */
+	template<size_t, class, size_t>
+	friend class growable_bump_heap;
 	/**
 	 * Callback for invoking the GC.  This is called when allocation fails.
 	 */
@@ -146,7 +429,7 @@ class bump_the_pointer_heap
 		iterator(ThisType &heap) : start(0), heap(heap)
 		{
 			next = heap.start_bits.one_after(0);
-			end = heap.start / alloc_granularity;
+			end = heap.allocated_end() / alloc_granularity;
 		}
 		public:
 		/**
@@ -155,18 +438,7 @@ class bump_the_pointer_heap
 		 */
 		std::pair<Header*, void*> operator*()
 		{
-			ASSERT(start < next);
-			size_t start_byte = start * alloc_granularity;
-			size_t next_byte = next * alloc_granularity;
-			capability<Header> header(reinterpret_cast<Header*>(heap.heap.get()));
-			ASSERT(start_byte < heap.heap.length());
-			// FIXME: handle void header types
-			header.set_offset(start_byte);
-			header.set_bounds(1);
-			capability<void> obj(heap.heap);
-			obj.set_offset(start_byte + header_size);
-			obj.set_bounds(next_byte - (start_byte + header_size));
-			return { header.get(), obj.get() };
+			return heap.allocation_between(start, next);
 		}
 		/**
 		 * Increment the current iterator.
@@ -211,9 +483,129 @@ class bump_the_pointer_heap
 	iterator end()
 	{
 		iterator i(*this);
-		i.start = start / alloc_granularity;
+		i.start = allocated_end() / alloc_granularity;
 		return i;
 	}
+	/**
+	 * A reference to an object in this heap, passed to the visitors used for
+	 * internal iteration (`for_each_allocation`).  This provides the same
+	 * interface as the slab allocator's `allocation_handle`, except that
+	 * objects in this heap can't be freed individually.  Capabilities are
+	 * only constructed when the visitor asks for the header or the object.
+	 */
+	class object_handle
+	{
+		/**
+		 * The heap that contains the object.
+		 */
+		ThisType &heap;
+		/**
+		 * The granule at which the allocation (including the header) starts.
+		 */
+		size_t start;
+		/**
+		 * The granule at which the next allocation starts.
+		 */
+		size_t next;
+		public:
+		/**
+		 * The type of the object header.
+		 */
+		using header_type = Header;
+		/**
+		 * Constructor.
+		 */
+		object_handle(ThisType &h, size_t s, size_t n) : heap(h), start(s), next(n) {}
+		/**
+		 * Returns the address of the start of the object.
+		 */
+		vaddr_t address() const
+		{
+			return heap.heap.base() + (start * alloc_granularity) + header_size;
+		}
+		/**
+		 * Returns the size of the object.
+		 */
+		size_t size() const
+		{
+			return ((next - start) * alloc_granularity) - header_size;
+		}
+		/**
+		 * Returns the header for the object.
+		 */
+		Header *header() const
+		{
+			return heap.header_at(start);
+		}
+		/**
+		 * Returns a capability to the object.
+		 */
+		void *object() const
+		{
+			return heap.object_between(start, next);
+		}
+	};
+	/**
+	 * Call `v` with an `object_handle` for every object in the heap, in
+	 * address order.  This walks the start bitmap directly, with the visitor
+	 * inlined into the loop.
+	 */
+	template<typename Visitor>
+	void for_each_allocation(Visitor &&v)
+	{
+		size_t end = allocated_end() / alloc_granularity;
+		for (size_t obj=0 ; obj<end ; )
+		{
+			size_t next = std::min(start_bits.one_after(obj), end);
+			v(object_handle(*this, obj, next));
+			obj = next;
+		}
+	}
+	/**
+	 * The size of the work units for parallel heap walks.  Each unit visits
+	 * the objects that start within one `work_unit_size` range of the heap.
+	 */
+	static const size_t work_unit_size = chunk_size;
+	/**
+	 * Returns the number of work units that cover the allocated part of the
+	 * heap.
+	 */
+	size_t work_unit_count()
+	{
+		return roundUp<work_unit_size>(allocated_end()) / work_unit_size;
+	}
+	/**
+	 * Call `fn` with the (header, object) pair for each object that starts in
+	 * the work unit with index `unit`.
+	 */
+	template<typename Fn>
+	void for_each_in_work_unit(size_t unit, Fn &&fn)
+	{
+		const size_t unit_granules = work_unit_size / alloc_granularity;
+		size_t end = allocated_end() / alloc_granularity;
+		size_t first = unit * unit_granules;
+		size_t last = std::min(first + unit_granules, end);
+		size_t obj = start_bits[first] ? first : start_bits.one_after(first);
+		while (obj < last)
+		{
+			size_t next = std::min(start_bits.one_after(obj), end);
+			fn(allocation_between(obj, next));
+			obj = next;
+		}
+	}
+	/**
+	 * Call `fn` with every object in the heap, visiting work units in
+	 * parallel on the threads in `pool`.  `fn` may be called concurrently
+	 * from multiple threads.
+	 */
+	template<typename Fn>
+	void parallel_for_each(Fn &&fn, gc_thread_pool &pool=gc_workers)
+	{
+		pool.parallel_for(work_unit_count(), [&](size_t i)
+			{
+				for_each_in_work_unit(i, fn);
+			});
+	}
 	/**
 	 * Update a pointer to an object in this heap to point to a new location.
 	 */
@@ -243,16 +635,69 @@ class bump_the_pointer_heap
 		}
 		start_bits.clear(offset / alloc_granularity);
 		start_bits.set((offset + disp) / alloc_granularity);
+		record_crossings((offset + disp) / alloc_granularity,
+		                 (offset + disp + header_size + obj.length()) / alloc_granularity);
 		void *dest = move_reference(obj_start, disp);
 		return memmove(dest, obj, obj.length());
 	}
 	/**
-	 * Notify the allocator that all objects after this are no longer needed.
+	 * Returns true if `addr` is inside this heap.
+	 */
+	bool contains(vaddr_t addr)
+	{
+		return (addr >= heap.base()) && (addr < heap.base() + heap.length());
+	}
+	/**
+	 * Returns the compaction region that contains `obj`, identified by the
+	 * address of its start, or 0 if `obj` is not in this heap.  Compaction
+	 * never moves objects between regions.  This heap is a single region.
 	 */
-	void set_last_object(capability<void> obj)
+	vaddr_t compaction_region(void *obj)
 	{
-		// FIXME: This should zero the memory.
-		start = obj.base() + obj.length();
+		return contains(cheri::base(obj)) ? heap.base() : 0;
+	}
+	/**
+	 * Notify the allocator that all objects in the compaction region
+	 * `region` that end after `end` are no longer needed, so that it can
+	 * reuse the space.
+	 */
+	void set_region_end(vaddr_t region, vaddr_t end)
+	{
+		ASSERT(region == heap.base());
+		size_t new_end = end - heap.base();
+		size_t old_end = allocated_end();
+		ASSERT(new_end <= old_end);
+		// Forget the objects that used to be here and zero their memory, so
+		// that neither stale starts nor stale capabilities are found later.
+		start_bits.clear_range(new_end / alloc_granularity, old_end / alloc_granularity);
+		size_t first_block = (new_end / alloc_granularity + granules_per_block - 1) / granules_per_block;
+		size_t end_block = (old_end / alloc_granularity + granules_per_block - 1) / granules_per_block;
+		if (end_block > blocks)
+		{
+			end_block = blocks;
+		}
+		if (first_block < end_block)
+		{
+			std::fill(crossing.begin() + first_block, crossing.begin() + end_block, 0);
+		}
+		memset(heap.get() + new_end, 0, old_end - new_end);
+		start = new_end;
+	}
+	/**
+	 * Discard every object in the heap, so that allocation starts again from
+	 * the beginning.  This must be called between `start_gc` and `end_gc`.
+	 */
+	void reset()
+	{
+		set_region_end(heap.base(), heap.base());
+	}
+	/**
+	 * Returns the number of bytes of the heap that are in use, including
+	 * objects that may be dead and unused space in allocation buffers.
+	 */
+	size_t used_bytes()
+	{
+		return allocated_end();
 	}
 	/**
 	 * Returns the object that contains the start of `ptr`, or `nullptr` if the
@@ -266,11 +711,7 @@ class bump_the_pointer_heap
 		{
 			return nullptr;
 		}
-		offset /= alloc_granularity;
-		while ((offset > 0) && !start_bits[offset])
-		{
-			offset--;
-		}
+		offset = object_start_for_granule(offset / alloc_granularity);
 		offset *= alloc_granularity;
 		capability<void> header(heap);
 		header.set_offset(offset);
@@ -280,7 +721,7 @@ class bump_the_pointer_heap
 		size_t end = (cap.base() + cap.length()) / alloc_granularity;
 		end = start_bits.one_after(end-1);
 		end *= alloc_granularity;
-		end = std::min(end, start.load());
+		end = std::min(end, allocated_end());
 		capability<void> obj(heap);
 		obj.set_offset(offset);
 		obj.set_bounds(end - offset);
@@ -347,33 +788,53 @@ class bump_the_pointer_heap
 		return true;
 	}
 	/**
-	 * Allocate an object of the given size.
+	 * Allocate an object of the given size, running the garbage collector if
+	 * the heap is full.
 	 */
 	void *alloc(size_t size)
+	{
+		void *a;
+		while ((a = try_alloc(size)) == nullptr)
+		{
+			(*gc)();
+		}
+		return a;
+	}
+	/**
+	 * Allocate an object of the given size.  Returns `nullptr` if there is not
+	 * enough space in the heap.
+	 */
+	void *try_alloc(size_t size)
 	{
 		ASSERT(this);
-		size += header_size;
-		long long v;
-		capability<void> a;
-		do
+		size_t requested_size = size;
+		// FIXME: Round the size so that CHERI 128 bounds will be exact
+		size_t object_size = roundUp<alloc_granularity>(size + header_size);
+		while (true)
 		{
+			long long v;
 			// If the GC has started then we're about to get a signal.  Spin until we do.
 			while ((v = version) % 2 == 1) {}
-			size = roundUp<alloc_granularity>(size);
-			// FIXME: Round the size so that CHERI 128 bounds will be exact
-			size_t offset = start.fetch_add(size);
-			if (offset > heap.length())
+			size = object_size;
+			size_t offset = (size <= max_tlab_object) ? tlab_reserve(size, v)
+			                                          : shared_reserve(size);
+			if (offset == reservation_failed)
+			{
+				return nullptr;
+			}
+			record_crossings(offset / alloc_granularity, (offset + size) / alloc_granularity);
+			// If the GC ran while we were allocating, then the space that we
+			// reserved may have been reused.
+			if (v != version)
 			{
-				(*gc)();
 				continue;
 			}
-			start_bits.set((offset) / alloc_granularity);
-			offset += header_size;
-			a = static_cast<char*>(heap.get());
-			a.set_offset(offset);
-			a.set_bounds(size - header_size);
-		} while (v != version);
-		return a;
+			capability<void> a = static_cast<char*>(heap.get());
+			a.set_offset(offset + header_size);
+			a.set_bounds(object_size - header_size);
+			sampling_heap_profiler.sample(a, requested_size);
+			return a;
+		}
 	}
 	/**
 	 * Invoke the garbage collector.
@@ -391,4 +852,8 @@ class bump_the_pointer_heap
 	}
 };
 
+template<size_t HeapSize, class Header>
+thread_local typename bump_the_pointer_heap<HeapSize, Header>::tlab
+bump_the_pointer_heap<HeapSize, Header>::current_tlab;
+
 } // Anonymous namespace
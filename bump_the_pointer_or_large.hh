@@ -33,7 +33,9 @@
 #include "BitSet.hh"
 #include "cheri.hh"
 #include "lock.hh"
-#include "bump_the_pointer_heap.hh"
+#include "growable_bump_heap.hh"
+#include "gc_layout.hh"
+#include <algorithm>
 #include <cstddef>
 #include <type_traits>
 
@@ -43,9 +45,10 @@ template<size_t HeapSize, class Header=void>
 class bump_the_pointer_or_large_heap 
 {
 	/**
-	 * Bump-the-pointer heap used for objects smaller than a page.
+	 * Bump-the-pointer heap used for objects smaller than a page.  This grows
+	 * in `HeapSize` regions.
 	 */
-	bump_the_pointer_heap<HeapSize, Header> small_heap;
+	growable_bump_heap<HeapSize, Header> small_heap;
 	/**
 	 * Import the `cheri::capability` template.
 	 */
@@ -66,13 +69,37 @@ class bump_the_pointer_or_large_heap
 	 */
 	using LargeAllocsVector = std::vector<LargeAlloc, PageAllocator<LargeAlloc>>;
 	/**
-	 * List of all large allocations.
-	 * 
-	 * FIXME: We currently have to do a linear scan of these to find the object
-	 * corresponding to a pointer.  We could improve this in several ways, and
-	 * should if we see more than a small number of large allocs.
+	 * List of all large allocations, sorted by base address so that the
+	 * allocation containing a pointer can be found with a binary search.
+	 * Page allocations are usually returned in increasing address order, so
+	 * new entries are typically appended.
 	 */
 	LargeAllocsVector large_allocs;
+	/**
+	 * Returns the first large allocation whose base is above `addr`.
+	 */
+	typename LargeAllocsVector::iterator large_alloc_after(vaddr_t addr)
+	{
+		return std::upper_bound(large_allocs.begin(), large_allocs.end(), addr,
+			[](vaddr_t a, const LargeAlloc &l)
+			{
+				return a < l.second.base();
+			});
+	}
+	/**
+	 * Returns the large allocation that contains `ptr`, or `nullptr` if there
+	 * isn't one.
+	 */
+	LargeAlloc *large_alloc_containing(void *ptr)
+	{
+		auto i = large_alloc_after(cheri::base(ptr));
+		if (i == large_allocs.begin())
+		{
+			return nullptr;
+		}
+		--i;
+		return i->second.contains(ptr) ? &*i : nullptr;
+	}
 	/**
 	 * Spinlock protecting large allocations.  We expect that large allocations
 	 * will be sufficiently infrequent that it will be rare for them to happen
@@ -100,7 +127,7 @@ class bump_the_pointer_or_large_heap
 		 */
 		std::pair<Header*,void*> operator*()
 		{
-			auto v = parent::operator*();
+			auto &v = parent::operator*();
 			return std::make_pair(&v.first, v.second.get());
 		}
 	};
@@ -127,6 +154,88 @@ class bump_the_pointer_or_large_heap
 	{
 		return make_spliced_forward_iterator(small_heap.end(), small_heap.end(), wrap_iterator(large_allocs.end()));
 	}
+	/**
+	 * A reference to a large object, passed to the visitors used for internal
+	 * iteration.  This provides the same interface as the small heap's
+	 * `object_handle`.
+	 */
+	class large_object_handle
+	{
+		/**
+		 * The large allocation record.
+		 */
+		LargeAlloc &alloc;
+		public:
+		/**
+		 * The type of the object header.
+		 */
+		using header_type = Header;
+		/**
+		 * Constructor.
+		 */
+		large_object_handle(LargeAlloc &a) : alloc(a) {}
+		/**
+		 * Returns the address of the start of the object.
+		 */
+		vaddr_t address() const
+		{
+			return alloc.second.base();
+		}
+		/**
+		 * Returns the size of the object.
+		 */
+		size_t size() const
+		{
+			return alloc.second.length();
+		}
+		/**
+		 * Returns the header for the object.
+		 */
+		Header *header() const
+		{
+			return &alloc.first;
+		}
+		/**
+		 * Returns a capability to the object.
+		 */
+		void *object() const
+		{
+			return alloc.second.get();
+		}
+	};
+	/**
+	 * Call `v` with a handle for every object in the heap: the small objects
+	 * in address order, followed by the large objects.
+	 */
+	template<typename Visitor>
+	void for_each_allocation(Visitor &&v)
+	{
+		small_heap.for_each_allocation(v);
+		for (auto &o : large_allocs)
+		{
+			v(large_object_handle(o));
+		}
+	}
+	/**
+	 * Call `fn` with every object in the heap, visiting work units in
+	 * parallel on the threads in `pool`.  Each work unit is either a range of
+	 * the small-object heap or a single large object.
+	 */
+	template<typename Fn>
+	void parallel_for_each(Fn &&fn, gc_thread_pool &pool=gc_workers)
+	{
+		size_t small_units = small_heap.work_unit_count();
+		pool.parallel_for(small_units + large_allocs.size(), [&](size_t i)
+			{
+				if (i < small_units)
+				{
+					small_heap.for_each_in_work_unit(i, fn);
+					return;
+				}
+				auto &o = large_allocs[i - small_units];
+				fn(std::make_pair(&o.first, static_cast<void*>(o.second.get())));
+			});
+	}
 	// FIXME: These three won't actually work if large objects are allocated
 	/**
 	 * Update a reference with the given displacement.
@@ -145,11 +254,20 @@ class bump_the_pointer_or_large_heap
 		return small_heap.move_object(start, disp);
 	}
 	/**
-	 * Sets the object at the end of the relocatable section.
+	 * Returns the compaction region that contains `obj`, or 0 if the object
+	 * can't be moved.  Large objects are never moved.
 	 */
-	void set_last_object(capability<void> obj)
+	vaddr_t compaction_region(void *obj)
 	{
-		return small_heap.set_last_object(obj);
+		return small_heap.compaction_region(obj);
+	}
+	/**
+	 * Notify the heap that the objects in a compaction region that end after
+	 * `end` are no longer needed.
+	 */
+	void set_region_end(vaddr_t region, vaddr_t end)
+	{
+		small_heap.set_region_end(region, end);
 	}
 	/**
 	 * Returns a pointer to the complete object for a given allocation.
@@ -161,16 +279,13 @@ class bump_the_pointer_or_large_heap
 		{
 			return obj;
 		}
-		for (auto &o : large_allocs)
+		LargeAlloc *large = large_alloc_containing(ptr);
+		if (large == nullptr)
 		{
-			capability<void> cap(o.second);
-			if (cap.contains(ptr))
-			{
-				h = &o.first;
-				return o.second;
-			}
+			return nullptr;
 		}
-		return nullptr;
+		h = &large->first;
+		return large->second;
 	}
 	/**
 	 * Sets the callback used to invoke the GC.
@@ -188,6 +303,28 @@ class bump_the_pointer_or_large_heap
 		small_heap.start_gc();
 		large_alloc_lock.lock();
 	}
+	/**
+	 * Release the memory for all large objects for which `is_live` returns
+	 * false when passed the object's header.  Called by the collector after
+	 * marking and before any objects are moved.  Small objects are reclaimed
+	 * by compaction.
+	 */
+	template<typename IsLive>
+	void release_unreachable(IsLive &&is_live)
+	{
+		small_heap.release_unreachable(is_live);
+		auto out = large_allocs.begin();
+		for (auto &o : large_allocs)
+		{
+			if (!is_live(&o.first))
+			{
+				PageAllocator<char>().deallocate(static_cast<char*>(o.second.get()), o.second.length());
+				continue;
+			}
+			*out++ = o;
+		}
+		large_allocs.erase(out, large_allocs.end());
+	}
 	/**
 	 * Notify the allocator that GC has finished.
 	 */
@@ -215,6 +352,30 @@ class bump_the_pointer_or_large_heap
 		// object headers somewhere else)
 		return true;
 	}
+	private:
+	/**
+	 * Allocate a large object of `size` bytes, storing `header` as its
+	 * header.  The header is set before the allocation is published in
+	 * `large_allocs`, so callers never need to look it up again.
+	 */
+	void *alloc_large(size_t size, const Header &header)
+	{
+		// Large objects count towards the collection trigger, so that
+		// programs that allocate only large objects still collect them.
+		if (gc_pacing.record_allocation(size))
+		{
+			small_heap.collect();
+		}
+		PageAllocator<char> alloc;
+		void *a = alloc.allocate(size);
+		run_locked(large_alloc_lock, [&]
+			{
+				large_allocs.emplace(large_alloc_after(cheri::base(a)), header, a);
+			});
+		sampling_heap_profiler.sample(a, size);
+		return a;
+	}
+	public:
 	/**
 	 * Allocate an object of the specified size.
 	 */
@@ -225,12 +386,31 @@ class bump_the_pointer_or_large_heap
 		{
 			return small_heap.alloc(size);
 		}
-		// FIXME: We never trigger GC from large object allocations - we
-		// probably should count these towards the total heap size.
-		PageAllocator<char> alloc;
-		void *a = alloc.allocate(size);
-		run_locked(large_alloc_lock, [&] { large_allocs.emplace_back(Header(), a); });
-		return a;
+		return alloc_large(size, Header());
+	}
+	/**
+	 * Allocate `size` bytes for an object whose pointer fields are described
+	 * by `layout` (see `gc_layout_of`).  The collector scans only those
+	 * fields of the object.
+	 */
+	void *alloc_typed(size_t size, gc_layout layout)
+	{
+		ASSERT(this);
+		if (size >= page_size)
+		{
+			// Don't look the header up in `large_allocs`: another thread may
+			// be inserting into it concurrently.
+			Header header;
+			header.set_layout(layout);
+			return alloc_large(size, header);
+		}
+		void *obj = small_heap.alloc(size);
+		Header *header;
+		if (obj && small_heap.object_for_allocation(obj, header))
+		{
+			header->set_layout(layout);
+		}
+		return obj;
 	}
 	/**
 	 * Start the garbage collector running.
@@ -0,0 +1,189 @@
+/*-
+ * Copyright (c) 2017 David T Chisnall
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include "utils.hh"
+#include "config.hh"
+#include "page.hh"
+
+namespace {
+
+/**
+ * A card table, recording which parts of memory may hold pointers from the
+ * old generation into the young generation.  Memory is divided into cards of
+ * `1 << CardBits` bytes.  The write barrier dirties the card containing a
+ * slot when it stores a pointer to a young object in it, so that a minor
+ * collection needs to scan only the dirty cards, rather than the whole of
+ * the old generation, to find its roots there.
+ *
+ * The cards for each chunk of the address space are stored in a page
+ * allocated block that is created the first time that one of its cards is
+ * dirtied.  The blocks are found through a table indexed by chunk, in the same
+ * way as `PageMetadata` finds allocators, and are never freed.
+ */
+template<size_t CardBits=9>
+class card_table
+{
+	/**
+	 * The number of bytes covered by each card.
+	 */
+	static const size_t card_size = 1ULL << CardBits;
+	/**
+	 * The number of cards in each chunk.
+	 */
+	static const size_t cards_per_chunk = chunk_size / card_size;
+	static_assert(chunk_size % card_size == 0,
+	              "Cards must not span chunks");
+	/**
+	 * The cards for a single chunk.
+	 */
+	struct chunk_cards
+	{
+		/**
+		 * The address of the start of the chunk.
+		 */
+		vaddr_t base;
+		/**
+		 * The next block in the list of all blocks.
+		 */
+		chunk_cards *next;
+		/**
+		 * One byte for each card, non-zero if the card is dirty.  Bytes are
+		 * used rather than bits so that the barrier can dirty a card with a
+		 * plain store.
+		 */
+		std::array<uint8_t, cards_per_chunk> dirty;
+	};
+	/**
+	 * The number of chunks in the address space.
+	 */
+	static const size_t chunk_count = 1ULL << (address_space_size_bits - chunk_size_bits);
+	/**
+	 * The map from chunk index to the cards for the chunk.  This is page
+	 * allocated and relies on the VM subsystem to provide zeroed pages
+	 * lazily, as it is large and sparse.
+	 */
+	std::array<std::atomic<chunk_cards*>, chunk_count> *chunks;
+	/**
+	 * List of every block of cards that has been created.
+	 */
+	std::atomic<chunk_cards*> all_chunks;
+	/**
+	 * Returns the index in `chunks` for the address `a`, ignoring any high
+	 * bits that are outside of the address space.
+	 */
+	static size_t index_for_vaddr(vaddr_t a)
+	{
+		const int address_bits = sizeof(size_t) * 8;
+		a <<= address_bits - address_space_size_bits;
+		a >>= address_bits - address_space_size_bits;
+		return a >> chunk_size_bits;
+	}
+	/**
+	 * Returns the cards for the chunk containing `addr`, creating them if
+	 * they do not yet exist.
+	 */
+	chunk_cards *cards_for_address(vaddr_t addr)
+	{
+		std::atomic<chunk_cards*> &entry = chunks->at(index_for_vaddr(addr));
+		chunk_cards *c = entry.load(std::memory_order_acquire);
+		if (c != nullptr)
+		{
+			return c;
+		}
+		chunk_cards *created = PageAllocator<chunk_cards>().allocate_aligned(1, log2<page_size>());
+		ASSERT(created);
+		created->base = addr & ~(vaddr_t)(chunk_size - 1);
+		// If we lost a race to create the cards for this chunk, use the
+		// winner's.
+		if (!entry.compare_exchange_strong(c, created, std::memory_order_acq_rel))
+		{
+			PageAllocator<chunk_cards>().deallocate(created, 1);
+			return c;
+		}
+		chunk_cards *old = all_chunks.load(std::memory_order_relaxed);
+		do
+		{
+			created->next = old;
+		} while (!all_chunks.compare_exchange_weak(old, created, std::memory_order_release));
+		return created;
+	}
+	public:
+	/**
+	 * Constructor.
+	 */
+	card_table() : all_chunks(nullptr)
+	{
+		chunks = PageAllocator<std::array<std::atomic<chunk_cards*>, chunk_count>>().allocate(1);
+		ASSERT(chunks);
+	}
+	/**
+	 * Dirty the card containing `slot`.
+	 */
+	void dirty(void *slot)
+	{
+		vaddr_t addr = (vaddr_t)slot;
+		cards_for_address(addr)->dirty[(addr & (chunk_size - 1)) >> CardBits] = 1;
+	}
+	/**
+	 * Call `fn(start, end)` with the address range of each dirty card and
+	 * clean the card.  Adjacent dirty cards are reported as a single range.
+	 * This must be called with the world stopped.
+	 */
+	template<typename Fn>
+	void for_each_dirty_range(Fn &&fn)
+	{
+		for (chunk_cards *c = all_chunks.load(std::memory_order_acquire) ;
+		     c != nullptr ;
+		     c = c->next)
+		{
+			for (size_t i=0 ; i<cards_per_chunk ; i++)
+			{
+				if (c->dirty[i] == 0)
+				{
+					continue;
+				}
+				size_t first = i;
+				while ((i < cards_per_chunk) && (c->dirty[i] != 0))
+				{
+					i++;
+				}
+				memset(&c->dirty[first], 0, i - first);
+				fn(c->base + first * card_size, c->base + i * card_size);
+			}
+		}
+	}
+};
+
+} // Anonymous namespace
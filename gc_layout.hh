@@ -0,0 +1,317 @@
+/*-
+ * Copyright (c) 2017 David T Chisnall
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+#include "utils.hh"
+#include "config.hh"
+#include "lock.hh"
+
+namespace {
+
+/**
+ * Description of the layout of a type: which of its pointer-sized words may
+ * hold pointers.  The collector scans only those words of an object that was
+ * allocated with a layout, rather than testing every word for a valid tag.
+ */
+struct gc_descriptor
+{
+	/**
+	 * The largest type, in pointer-sized words, that a descriptor can
+	 * describe.
+	 */
+	static const size_t max_words = 64;
+	/**
+	 * Bit `i` is set if word `i` of the type may hold a pointer.
+	 */
+	uint64_t bitmap;
+	/**
+	 * The size of the type in pointer-sized words.  An object that is larger
+	 * than this is treated as an array and the bitmap is applied to each
+	 * element in turn.
+	 */
+	size_t words;
+	/**
+	 * Call `fn` with a reference to each word in the `length` bytes at `obj`
+	 * that may hold a pointer.
+	 */
+	template<typename Fn>
+	void for_each_slot(void **obj, size_t length, Fn &&fn) const
+	{
+		for_each_slot_in_range(obj, 0, length, fn);
+	}
+	/**
+	 * Call `fn` with a reference to each word of the object at `obj` that may
+	 * hold a pointer and that lies in the byte range `[begin, end)` of the
+	 * object.  The walk starts at the repetition of the bitmap that contains
+	 * `begin`, so visiting a small part of a large array is cheap.
+	 */
+	template<typename Fn>
+	void for_each_slot_in_range(void **obj, size_t begin, size_t end, Fn &&fn) const
+	{
+		if (bitmap == 0)
+		{
+			return;
+		}
+		size_t first = begin / sizeof(void*);
+		size_t count = end / sizeof(void*);
+		for (size_t base=(first / words) * words ; base<count ; base+=words)
+		{
+			for (uint64_t bits=bitmap ; bits != 0 ; bits &= bits - 1)
+			{
+				size_t i = base + __builtin_ctzll(bits);
+				if (i >= count)
+				{
+					return;
+				}
+				if (i >= first)
+				{
+					fn(obj[i]);
+				}
+			}
+		}
+	}
+	/**
+	 * Compare two descriptors.
+	 */
+	bool operator==(const gc_descriptor &other) const
+	{
+		return (bitmap == other.bitmap) && (words == other.words);
+	}
+};
+
+/**
+ * Base case for `gc_pointer_bitmap`: no offsets.
+ */
+constexpr uint64_t gc_pointer_bitmap()
+{
+	return 0;
+}
+
+/**
+ * Returns the descriptor bitmap with a bit set for the word at each of the
+ * byte offsets given as arguments.
+ */
+template<typename... Rest>
+constexpr uint64_t gc_pointer_bitmap(size_t offset, Rest... rest)
+{
+	return (1ULL << (offset / sizeof(void*))) | gc_pointer_bitmap(rest...);
+}
+
+/**
+ * Base case for `gc_pointer_offsets_valid`: no offsets.
+ */
+template<typename T>
+constexpr bool gc_pointer_offsets_valid()
+{
+	return true;
+}
+
+/**
+ * Returns true if each of the byte offsets given as arguments is the offset
+ * of an aligned pointer-sized word within `T`.
+ */
+template<typename T, typename... Rest>
+constexpr bool gc_pointer_offsets_valid(size_t offset, Rest... rest)
+{
+	return (offset % sizeof(void*) == 0) &&
+	       (offset + sizeof(void*) <= sizeof(T)) &&
+	       gc_pointer_offsets_valid<T>(rest...);
+}
+
+/**
+ * Trait describing the fields of `T` that may hold pointers.  The default is
+ * conservative: every word may hold a pointer.  Specialise this (in an
+ * anonymous namespace, where it is declared) to inherit from
+ * `gc_pointers_at`, for example:
+ *
+ *     namespace {
+ *     template<> struct gc_pointer_fields<list>
+ *         : gc_pointers_at<list, offsetof(list, next)> {};
+ *     }
+ */
+template<typename T>
+struct gc_pointer_fields
+{
+	/**
+	 * Returns the descriptor for `T`.
+	 */
+	static constexpr gc_descriptor descriptor()
+	{
+		return { 1, 1 };
+	}
+};
+
+/**
+ * Helper for specialising `gc_pointer_fields`.  The template arguments after
+ * `T` are the byte offsets (from `offsetof`) of the fields that may hold
+ * pointers.  With no offsets, `T` holds no pointers.
+ */
+template<typename T, size_t... Offsets>
+struct gc_pointers_at
+{
+	static_assert(sizeof(T) <= gc_descriptor::max_words * sizeof(void*),
+	              "Type is too large for a layout descriptor");
+	static_assert(gc_pointer_offsets_valid<T>(Offsets...),
+	              "Pointer fields must be aligned words within the type");
+	/**
+	 * Returns the descriptor for `T`.
+	 */
+	static constexpr gc_descriptor descriptor()
+	{
+		return { gc_pointer_bitmap(Offsets...),
+		         (sizeof(T) + sizeof(void*) - 1) / sizeof(void*) };
+	}
+};
+
+/**
+ * A layout that has been registered with `gc_layouts`.  Object headers store
+ * one of these, rather than the descriptor itself, so they must fit in seven
+ * bits.
+ */
+using gc_layout = uint8_t;
+
+/**
+ * The table of registered layouts.  Each distinct descriptor is registered
+ * once and is identified by its index.  Entry 0 is the conservative layout,
+ * so zeroed headers describe untyped objects.
+ */
+class gc_layout_table
+{
+	/**
+	 * The number of layouts that can be registered, including the
+	 * conservative layout.
+	 */
+	static const int max_layouts = 128;
+	/**
+	 * The registered descriptors.  Entry 0 is unused.
+	 */
+	gc_descriptor layouts[max_layouts];
+	/**
+	 * The number of entries in `layouts` that are in use, including entry 0.
+	 * Zero until the first registration.
+	 */
+	std::atomic<int> count;
+	/**
+	 * Lock protecting registration.
+	 */
+	UncontendedSpinlock<long> lock;
+	public:
+	/**
+	 * The layout for objects whose pointer fields are not known.
+	 */
+	static const gc_layout conservative = 0;
+	/**
+	 * Returns the layout for `d`, registering it if it has not been seen
+	 * before.  If the table is full, this returns the conservative layout,
+	 * which is always safe.
+	 */
+	gc_layout intern(const gc_descriptor &d)
+	{
+		if (d == (*this)[conservative])
+		{
+			return conservative;
+		}
+		gc_layout found = conservative;
+		run_locked(lock, [&]()
+			{
+				int n = std::max(count.load(std::memory_order_relaxed), 1);
+				for (int i=1 ; i<n ; i++)
+				{
+					if (layouts[i] == d)
+					{
+						found = i;
+						return;
+					}
+				}
+				if (n == max_layouts)
+				{
+					return;
+				}
+				layouts[n] = d;
+				found = n;
+				count.store(n + 1, std::memory_order_release);
+			});
+		return found;
+	}
+	/**
+	 * Returns the descriptor for a layout.
+	 */
+	gc_descriptor operator[](gc_layout l) const
+	{
+		if (l == conservative)
+		{
+			return { 1, 1 };
+		}
+		ASSERT(l < count.load(std::memory_order_relaxed));
+		return layouts[l];
+	}
+};
+
+/**
+ * The layouts shared by all heaps.
+ */
+gc_layout_table gc_layouts;
+
+/**
+ * Cache of the registered layout for `T`.  This is a template static member,
+ * rather than a function-local static, to avoid the need for guards.
+ */
+template<typename T>
+struct gc_layout_cache
+{
+	/**
+	 * One more than the layout of `T`, or zero if it has not been registered
+	 * yet.
+	 */
+	static std::atomic<int> id;
+};
+template<typename T>
+std::atomic<int> gc_layout_cache<T>::id;
+
+/**
+ * Returns the layout of `T`, as described by `gc_pointer_fields<T>`, for
+ * passing to a heap's `alloc_typed` method.
+ */
+template<typename T>
+gc_layout gc_layout_of()
+{
+	int id = gc_layout_cache<T>::id.load(std::memory_order_relaxed);
+	if (id == 0)
+	{
+		id = gc_layouts.intern(gc_pointer_fields<T>::descriptor()) + 1;
+		gc_layout_cache<T>::id.store(id, std::memory_order_relaxed);
+	}
+	return id - 1;
+}
+
+} // Anonymous namespace
@@ -0,0 +1,281 @@
+/*-
+ * Copyright (c) 2017 David T Chisnall
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <sched.h>
+#include <stdlib.h>
+#include "utils.hh"
+
+namespace {
+
+/**
+ * Per-thread state for the collection pacer.  This is plain data so that it
+ * can live in thread-local storage without any C++ runtime support for
+ * thread-local constructors or destructors.
+ */
+struct gc_pacer_thread_state
+{
+	/**
+	 * Bytes allocated by this thread that have not yet been added to the
+	 * shared count.
+	 */
+	size_t unflushed;
+};
+
+/**
+ * The pacer state for the current thread.
+ */
+thread_local gc_pacer_thread_state gc_pacer_thread;
+
+/**
+ * Decides when to collect, based on allocation volume.  Allocators report
+ * every allocation with `record_allocation`, and collectors report the number
+ * of bytes found live by each mark with `cycle_complete`.  The next collection
+ * is triggered once the bytes allocated since the last one reach `percent`
+ * percent of the live bytes, clamped between a floor and a ceiling.  This is
+ * the same policy as Go's `GOGC`: with the default of 100, the heap may grow
+ * to twice the live size between collections.
+ *
+ * Allocations are accumulated per thread and added to the shared count every
+ * `flush_bytes`, so the common case costs an addition and a branch and does
+ * not touch shared state.
+ *
+ * The initial values are read from the environment: `GC_PERCENT` (a negative
+ * value disables pacing), `GC_MIN_TRIGGER` and `GC_MAX_TRIGGER` (in bytes, 0
+ * for no ceiling).  All three can be changed at run time.
+ */
+class gc_pacer
+{
+	/**
+	 * The number of bytes that a thread may allocate before adding them to
+	 * the shared count.
+	 */
+	static const size_t flush_bytes = 64 * 1024;
+	/**
+	 * The default `percent`.
+	 */
+	static const int default_percent = 100;
+	/**
+	 * The default floor on the number of bytes allocated between
+	 * collections.
+	 */
+	static const size_t default_min_trigger = 4 * 1024 * 1024;
+	/**
+	 * Bytes allocated (and flushed) since the last collection.
+	 */
+	std::atomic<size_t> allocated;
+	/**
+	 * The value of `allocated` at which the next collection is triggered.
+	 */
+	std::atomic<size_t> trigger;
+	/**
+	 * Set when a thread has been told to collect, so that other threads
+	 * that cross the trigger at the same time don't also collect.
+	 */
+	std::atomic<bool> collection_requested;
+	/**
+	 * The initialisation state of the pacer.
+	 */
+	enum
+	{
+		/// The environment has not yet been read.
+		uninitialised = 0,
+		/// A thread is reading the environment.
+		initialising,
+		/// The configuration and the trigger have been set.
+		ready
+	};
+	/**
+	 * The current state, one of the values from the enumeration above.
+	 */
+	std::atomic<int> state;
+	/**
+	 * The number of bytes found live by the last mark.
+	 */
+	size_t live_bytes;
+	/**
+	 * Percentage of the live bytes that may be allocated before the next
+	 * collection, or negative if pacing is disabled.
+	 */
+	int percent;
+	/**
+	 * The smallest number of bytes allocated between collections.
+	 */
+	size_t min_trigger;
+	/**
+	 * The largest number of bytes allocated between collections, or 0 for no
+	 * limit.
+	 */
+	size_t max_trigger;
+	/**
+	 * Read the configuration from the environment, if no thread has done so
+	 * yet.  Exactly one thread reads it, and any others that arrive meanwhile
+	 * wait until the trigger has been computed from it.  As with the heap
+	 * profiler, this avoids `std::call_once` so that it does not need any C++
+	 * runtime support.
+	 */
+	void initialise()
+	{
+		int expected = uninitialised;
+		if (!state.compare_exchange_strong(expected, initialising))
+		{
+			while (state.load() != ready)
+			{
+				sched_yield();
+			}
+			return;
+		}
+		const char *env = getenv("GC_PERCENT");
+		percent = env ? strtol(env, nullptr, 0) : default_percent;
+		env = getenv("GC_MIN_TRIGGER");
+		min_trigger = env ? strtoull(env, nullptr, 0) : default_min_trigger;
+		env = getenv("GC_MAX_TRIGGER");
+		max_trigger = env ? strtoull(env, nullptr, 0) : 0;
+		update_trigger();
+		state = ready;
+	}
+	/**
+	 * Recompute the trigger from the live size and the limits.
+	 */
+	void update_trigger()
+	{
+		if (percent < 0)
+		{
+			trigger = std::numeric_limits<size_t>::max();
+			return;
+		}
+		size_t t = live_bytes / 100 * percent;
+		t = std::max(t, min_trigger);
+		if (max_trigger != 0)
+		{
+			t = std::min(t, max_trigger);
+		}
+		trigger = t;
+	}
+	/**
+	 * Add the current thread's unflushed bytes to the shared count and
+	 * return whether this thread should collect.
+	 */
+	bool flush(gc_pacer_thread_state &t)
+	{
+		if (state.load() != ready)
+		{
+			initialise();
+		}
+		size_t total = allocated.fetch_add(t.unflushed, std::memory_order_relaxed) + t.unflushed;
+		t.unflushed = 0;
+		if (total < trigger.load(std::memory_order_relaxed))
+		{
+			return false;
+		}
+		return !collection_requested.exchange(true, std::memory_order_acquire);
+	}
+	public:
+	/**
+	 * Record an allocation of `bytes`.  Returns true if the caller should
+	 * run the collector.  Only one thread is told to collect for each cycle.
+	 */
+	__attribute__((always_inline))
+	bool record_allocation(size_t bytes)
+	{
+		gc_pacer_thread_state &t = gc_pacer_thread;
+		t.unflushed += bytes;
+		if (__builtin_expect(t.unflushed < flush_bytes, true))
+		{
+			return false;
+		}
+		return flush(t);
+	}
+	/**
+	 * Notify the pacer that a collection has finished marking and found
+	 * `live` bytes of reachable objects.  This resets the allocation count,
+	 * however the collection was triggered.
+	 */
+	void cycle_complete(size_t live)
+	{
+		if (state.load() != ready)
+		{
+			initialise();
+		}
+		live_bytes = live;
+		update_trigger();
+		allocated = 0;
+		collection_requested.store(false, std::memory_order_release);
+	}
+	/**
+	 * Set the percentage of the live size that may be allocated between
+	 * collections.  A negative value disables pacing.
+	 */
+	void set_percent(int p)
+	{
+		if (state.load() != ready)
+		{
+			initialise();
+		}
+		percent = p;
+		update_trigger();
+	}
+	/**
+	 * Set the floor and ceiling on the number of bytes allocated between
+	 * collections.  A ceiling of 0 means no limit.
+	 */
+	void set_trigger_limits(size_t floor, size_t ceiling)
+	{
+		if (state.load() != ready)
+		{
+			initialise();
+		}
+		min_trigger = floor;
+		max_trigger = ceiling;
+		update_trigger();
+	}
+	/**
+	 * Returns the number of bytes that may be allocated between the last
+	 * collection and the next one.
+	 */
+	size_t current_trigger()
+	{
+		if (state.load() != ready)
+		{
+			initialise();
+		}
+		return trigger;
+	}
+};
+
+/**
+ * The pacer shared by all of the allocators.
+ */
+gc_pacer gc_pacing;
+
+} // Anonymous namespace
@@ -0,0 +1,266 @@
+/*-
+ * Copyright (c) 2017 David T Chisnall
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+#include <atomic>
+#include <limits.h>
+#include <pthread.h>
+#include <pthread_np.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/umtx.h>
+#include "utils.hh"
+
+namespace {
+
+/**
+ * A pool of helper threads for parallelising whole-heap passes in the
+ * collector.
+ *
+ * The pool is deliberately minimal.  It runs one job at a time, where a job is
+ * a callable that is invoked once for each index in a range.  Threads (the
+ * workers and the calling thread) claim indexes with an atomic increment, so
+ * work units of uneven cost are load balanced automatically.
+ *
+ * Workers sleep on the job generation counter with `_umtx_op`, rather than a
+ * pthread mutex and condition variable.  FreeBSD's default pthread mutexes
+ * call `malloc` on first use, which is not safe in the collector, and a worker
+ * that is suspended by `pthread_suspend_all_np` while holding a mutex would
+ * deadlock the collection.
+ *
+ * The workers are stopped along with everything else when the collector
+ * stops the world, so `parallel_for` resumes them before publishing each
+ * job.  They go back to sleep when the job completes and are suspended again
+ * at the next stop.
+ *
+ * Only one thread may call `parallel_for` at a time (in practice, the thread
+ * that is running the collector).
+ */
+class gc_thread_pool
+{
+	/**
+	 * The maximum number of helper threads.
+	 */
+	static const int max_workers = 64;
+	/**
+	 * Type-erased interface to a job.  This is not `std::function` because
+	 * that may allocate memory.
+	 */
+	struct job
+	{
+		/**
+		 * Run the job for the work unit at index `i`.
+		 */
+		virtual void run(size_t i) = 0;
+	};
+	/**
+	 * Concrete job, wrapping a callable that takes an index.  These are
+	 * created on the stack of the thread that calls `parallel_for`.
+	 */
+	template<typename T>
+	struct concrete_job : job
+	{
+		/**
+		 * The callable object.
+		 */
+		T &fn;
+		/**
+		 * Constructor.  Takes the callable object as an argument.
+		 */
+		concrete_job(T &f) : fn(f) {}
+		/**
+		 * Invoke the callable object.
+		 */
+		void run(size_t i) override
+		{
+			fn(i);
+		}
+	};
+	/**
+	 * The helper threads.
+	 */
+	pthread_t workers[max_workers];
+	/**
+	 * The number of helper threads.  The thread that calls `parallel_for`
+	 * also performs work, so the total parallelism is one more than this.
+	 */
+	int worker_count;
+	/**
+	 * Whether the workers have been created.  0 initially, 1 while one thread
+	 * is creating them and 2 afterwards.
+	 */
+	std::atomic<int> started;
+	/**
+	 * Counter incremented to publish each job.  Workers sleep on this value.
+	 */
+	std::atomic<unsigned int> generation;
+	/**
+	 * The number of workers that have not yet finished the current job.
+	 */
+	std::atomic<int> active;
+	/**
+	 * The index of the next work unit to claim for the current job.
+	 */
+	std::atomic<size_t> next_index;
+	/**
+	 * The number of work units in the current job.
+	 */
+	size_t job_size;
+	/**
+	 * The current job.
+	 */
+	job *current;
+	/**
+	 * Claim and run work units for the current job until there are none left.
+	 */
+	void work()
+	{
+		job *j = current;
+		size_t i;
+		while ((i = next_index.fetch_add(1, std::memory_order_relaxed)) < job_size)
+		{
+			j->run(i);
+		}
+	}
+	/**
+	 * Entry point for the helper threads.
+	 */
+	static void *worker_main(void *arg)
+	{
+		gc_thread_pool &pool = *static_cast<gc_thread_pool*>(arg);
+		unsigned int seen = 0;
+		while (true)
+		{
+			unsigned int g = pool.generation.load(std::memory_order_acquire);
+			if (g == seen)
+			{
+				_umtx_op(static_cast<void*>(&pool.generation),
+				         UMTX_OP_WAIT_UINT_PRIVATE, g, nullptr, nullptr);
+				continue;
+			}
+			seen = g;
+			pool.work();
+			pool.active.fetch_sub(1, std::memory_order_release);
+		}
+		return nullptr;
+	}
+	/**
+	 * Create the helper threads, if they have not yet been created.  The
+	 * number of threads is taken from the `GC_THREADS` environment variable
+	 * if it is set (the value is the total parallelism, including the calling
+	 * thread), or from the number of online CPUs otherwise.
+	 */
+	void start()
+	{
+		if (started.load(std::memory_order_acquire) == 2)
+		{
+			return;
+		}
+		int expected = 0;
+		if (!started.compare_exchange_strong(expected, 1))
+		{
+			while (started.load(std::memory_order_acquire) != 2) {}
+			return;
+		}
+		const char *env = getenv("GC_THREADS");
+		long threads = env ? strtol(env, nullptr, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+		threads = std::max(std::min(threads - 1, (long)max_workers), 0L);
+		int created = 0;
+		for (long i=0 ; i<threads ; i++)
+		{
+			if (pthread_create(&workers[created], nullptr, worker_main, this) == 0)
+			{
+				created++;
+			}
+		}
+		worker_count = created;
+		started.store(2, std::memory_order_release);
+	}
+	public:
+	/**
+	 * Returns the number of threads that will run each job, including the
+	 * caller.
+	 */
+	int concurrency()
+	{
+		start();
+		return worker_count + 1;
+	}
+	/**
+	 * Invoke `fn(i)` for every `i` in `[0, count)`, distributing the calls
+	 * across the helper threads and the calling thread.  Returns once all of
+	 * the calls have completed.  The order of the calls is unspecified.
+	 */
+	template<typename Fn>
+	void parallel_for(size_t count, Fn &&fn)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+		start();
+		if ((worker_count == 0) || (count == 1))
+		{
+			for (size_t i=0 ; i<count ; i++)
+			{
+				fn(i);
+			}
+			return;
+		}
+		concrete_job<Fn> j(fn);
+		// If the world is stopped, our workers are stopped too.
+		for (int i=0 ; i<worker_count ; i++)
+		{
+			pthread_resume_np(workers[i]);
+		}
+		current = &j;
+		job_size = count;
+		next_index.store(0, std::memory_order_relaxed);
+		active.store(worker_count, std::memory_order_relaxed);
+		generation.fetch_add(1, std::memory_order_release);
+		_umtx_op(static_cast<void*>(&generation), UMTX_OP_WAKE_PRIVATE,
+		         INT_MAX, nullptr, nullptr);
+		work();
+		while (active.load(std::memory_order_acquire) != 0)
+		{
+			sched_yield();
+		}
+		current = nullptr;
+	}
+};
+
+/**
+ * The thread pool shared by all collectors.
+ */
+gc_thread_pool gc_workers;
+
+} // Anonymous namespace
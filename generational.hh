@@ -0,0 +1,428 @@
+/*-
+ * Copyright (c) 2017 David T Chisnall
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <vector>
+#include <setjmp.h>
+#include <string.h>
+#include "cheri.hh"
+#include "page.hh"
+#include "counter.hh"
+#include "nonstd_function.hh"
+#include "bump_the_pointer_heap.hh"
+#include "card_table.hh"
+#include "gc_layout.hh"
+#include "heap_profiler.hh"
+
+namespace
+{
+
+/**
+ * Object header for objects in the nursery.  Declared outside the class so
+ * that its type doesn't depend on the template arguments.
+ */
+class alignas(void*) nursery_object_header
+{
+	template<class RootSet, class OldHeap, size_t NurserySize>
+	friend class generational_heap;
+	/**
+	 * The copy of this object in the old generation, or `nullptr` if the
+	 * object has not yet been promoted during the current minor collection.
+	 */
+	void *forwarding;
+	/**
+	 * The layout of the object, if it was allocated with `alloc_typed`.
+	 */
+	gc_layout layout_index;
+	public:
+	/**
+	 * Returns the layout of the object.
+	 */
+	gc_layout layout() const
+	{
+		return layout_index;
+	}
+	/**
+	 * Set the layout of the object.
+	 */
+	void set_layout(gc_layout l)
+	{
+		layout_index = l;
+	}
+};
+
+/**
+ * A generational heap.  Small objects are allocated by bumping a pointer in a
+ * nursery.  When the nursery is full, a minor collection copies the objects
+ * in it that are reachable from the roots, or from dirty cards in the old
+ * generation, into `OldHeap` and then empties the nursery.  The old
+ * generation is collected by a separate collector, installed with `set_gc`.
+ *
+ * Stores of pointers into objects that are not in the nursery must go via
+ * `write_barrier`, so that the minor collection can find pointers from the
+ * old generation to the young without scanning all of the old generation.
+ *
+ * Every object that survives a minor collection is promoted, so there is no
+ * aging in the young generation.
+ */
+template<class RootSet, class OldHeap, size_t NurserySize=8_MiB>
+class generational_heap
+{
+	/**
+	 * The type of this class.
+	 */
+	using ThisType = generational_heap<RootSet, OldHeap, NurserySize>;
+	/**
+	 * The type of the headers for objects in the old generation.
+	 */
+	using old_header = typename OldHeap::object_header;
+	/**
+	 * Capability type.
+	 */
+	template<typename T>
+	using capability = cheri::capability<T>;
+	/**
+	 * Objects of at least this size are allocated directly in the old
+	 * generation, as copying them would be more expensive than the
+	 * allocation that the nursery saves.
+	 */
+	static const size_t max_nursery_object = page_size;
+	/**
+	 * A promoted object that has not yet been scanned, and its layout.
+	 */
+	using promoted_object = std::pair<void*, gc_layout>;
+	/**
+	 * The young generation.
+	 */
+	bump_the_pointer_heap<NurserySize, nursery_object_header> nursery;
+	/**
+	 * The old generation.
+	 */
+	OldHeap &old;
+	/**
+	 * Cards recording the slots outside of the nursery that may hold
+	 * pointers into it.
+	 */
+	card_table<> cards;
+	/**
+	 * The roots for minor collections.
+	 */
+	RootSet m;
+	/**
+	 * Objects that have been promoted during the current minor collection
+	 * and not yet scanned.
+	 */
+	std::vector<promoted_object, PageAllocator<promoted_object>> grey;
+	/**
+	 * The callback that runs a major collection, or `nullptr` if there is no
+	 * collector for the old generation.
+	 */
+	Function *gc = nullptr;
+	/**
+	 * Buffer used to store the callback.
+	 */
+	char callback_buffer[128];
+	/**
+	 * Set when the old heap has asked for a major collection.  The collection
+	 * is run by the next allocation.
+	 */
+	std::atomic<bool> major_requested;
+	/**
+	 * Constructor.  Use `create` to construct instances of this class.
+	 */
+	generational_heap(OldHeap &o) : old(o), major_requested(false)
+	{
+		m.register_global_roots();
+		nursery.allocate_heap();
+	}
+	/**
+	 * Returns the promoted copy of the nursery object `obj`, or `nullptr` if
+	 * it has not been promoted.
+	 */
+	void *forwarded(void *obj)
+	{
+		nursery_object_header *header;
+		if (nullptr == nursery.object_for_allocation(obj, header))
+		{
+			return nullptr;
+		}
+		return header->forwarding;
+	}
+	/**
+	 * If `slot` points into the nursery, promote the object that it points
+	 * to (if it has not already been promoted) and update `slot` to point to
+	 * the copy.
+	 */
+	void evacuate(void *&slot)
+	{
+		capability<void> ptr(slot);
+		if (!ptr || !nursery.contains(ptr.base()))
+		{
+			return;
+		}
+		nursery_object_header *header;
+		void *obj = nursery.object_for_allocation(slot, header);
+		if (obj == nullptr)
+		{
+			return;
+		}
+		if (header->forwarding == nullptr)
+		{
+			size_t length = cheri::length(obj);
+			// The object was counted by the pacer and, if sampled, recorded
+			// by the profiler when it was allocated in the nursery.  Its
+			// sample is moved to the copy once the copying is finished.
+			void *copy = old.alloc_moved(std::max(length, sizeof(void*)), header->layout());
+			ASSERT(copy);
+			memcpy(copy, obj, length);
+			header->forwarding = copy;
+			grey.emplace_back(copy, header->layout());
+			++promoted;
+		}
+		// Derive the new pointer from the copy with the original pointer's
+		// bounds, offset and permissions, so that promotion never widens a
+		// capability that refers to part of the object or has reduced
+		// permissions.
+		slot = move_capability(header->forwarding, slot,
+		                       cheri::base(header->forwarding) - cheri::base(obj));
+	}
+	/**
+	 * Evacuate the nursery objects referenced from the slots of old objects
+	 * in the dirty card range from `start` to `end`.
+	 */
+	void scan_cards(vaddr_t start, vaddr_t end)
+	{
+		for (vaddr_t addr = start ; addr < end ; )
+		{
+			old_header *header;
+			void *obj = old.object_for_allocation(reinterpret_cast<void*>(addr), header);
+			// The old heap manages memory in whole chunks and cards never
+			// span chunks, so if this address is not in the old heap then
+			// none of the range is.  Slots elsewhere, such as globals, are
+			// found as roots.
+			if (obj == nullptr)
+			{
+				return;
+			}
+			vaddr_t obj_start = cheri::base(obj);
+			vaddr_t obj_end = obj_start + cheri::length(obj);
+			if (obj_end <= addr)
+			{
+				return;
+			}
+			gc_layouts[header->layout()].for_each_slot_in_range(static_cast<void**>(obj),
+				std::max(addr, obj_start) - obj_start,
+				std::min(end, obj_end) - obj_start,
+				[&](void *&slot)
+					{
+						evacuate(slot);
+					});
+			addr = obj_end;
+		}
+	}
+	/**
+	 * Scan the promoted objects, evacuating everything that they refer to,
+	 * until there are no more.
+	 */
+	void scan_promoted()
+	{
+		while (!grey.empty())
+		{
+			promoted_object p = grey.back();
+			grey.pop_back();
+			gc_layouts[p.second].for_each_slot(static_cast<void**>(p.first),
+				cheri::length(p.first),
+				[&](void *&slot)
+					{
+						evacuate(slot);
+					});
+		}
+	}
+	public:
+	/**
+	 * The number of objects promoted by the last minor collection.
+	 */
+	Counter<> promoted;
+	/**
+	 * Allocate a generational heap in front of `old`.
+	 */
+	static ThisType *create(OldHeap &old)
+	{
+		PageAllocator<ThisType> a;
+		return new (a.allocate(1)) ThisType(old);
+	}
+	/**
+	 * Set the callback for running a major collection.  The old heap's own
+	 * collection callback is replaced by one that defers the collection to
+	 * the next allocation, because a major collection must start with a
+	 * minor one so that pointers from the nursery are not missed.
+	 */
+	template<typename T>
+	void set_gc(T &fn)
+	{
+		static_assert(sizeof(T) <= sizeof(callback_buffer),
+		              "Callback buffer too small for callback");
+		gc = (new (callback_buffer) ConcreteFunction<T>(fn));
+		auto request = [this]()
+			{
+				major_requested = true;
+			};
+		old.set_gc(request);
+	}
+	/**
+	 * Returns true if `ptr` points into the nursery.
+	 */
+	bool in_nursery(void *ptr)
+	{
+		return nursery.contains((vaddr_t)ptr);
+	}
+	/**
+	 * Allocate `size` bytes.
+	 */
+	void *alloc(size_t size)
+	{
+		if (major_requested.exchange(false))
+		{
+			collect();
+		}
+		if (size >= max_nursery_object)
+		{
+			return old.alloc(size);
+		}
+		void *a;
+		while ((a = nursery.try_alloc(size)) == nullptr)
+		{
+			minor_collect();
+		}
+		return a;
+	}
+	/**
+	 * Allocate `size` bytes for an object whose pointer fields are described
+	 * by `layout`.  The layout is carried over when the object is promoted.
+	 */
+	void *alloc_typed(size_t size, gc_layout layout)
+	{
+		void *obj = alloc(size);
+		if (in_nursery(obj))
+		{
+			nursery_object_header *header;
+			if (nursery.object_for_allocation(obj, header))
+			{
+				header->set_layout(layout);
+			}
+			return obj;
+		}
+		old_header *header;
+		if (obj && old.object_for_allocation(obj, header))
+		{
+			header->set_layout(layout);
+		}
+		return obj;
+	}
+	/**
+	 * Store `value` in `slot`, recording the store if it creates a pointer
+	 * from outside of the nursery into it.
+	 */
+	void write_barrier(void **slot, void *value)
+	{
+		*slot = value;
+		if (in_nursery(value) && !in_nursery(slot))
+		{
+			cards.dirty(slot);
+		}
+	}
+	/**
+	 * Run a minor collection, promoting every reachable object in the
+	 * nursery to the old generation and then emptying the nursery.
+	 */
+	void minor_collect()
+	{
+		jmp_buf jb;
+		// Spill caller-save registers from any calling frames to the stack,
+		// so that they are updated along with the rest of the stack.
+		if (_setjmp(jb) != 0)
+		{
+			return;
+		}
+		// Promotion allocates in the old heap, which must not wait for a
+		// lazy sweep claimed by a thread that is about to be stopped.
+		old.finish_sweep();
+		m.temporary_roots.clear();
+		nursery.start_gc();
+		m.stop_the_world();
+		m.add_thread(static_cast<void**>(__builtin_cheri_stack_get()));
+		m.collect_roots_from_ranges();
+		promoted = 0;
+		for (auto &r : m)
+		{
+			evacuate(*r.first);
+		}
+		cards.for_each_dirty_range([&](vaddr_t start, vaddr_t end)
+			{
+				scan_cards(start, end);
+			});
+		scan_promoted();
+		// Samples are not roots, but they must follow the objects that they
+		// refer to.
+		sampling_heap_profiler.retire_dead([&](void *obj)
+			{
+				return !in_nursery(obj) || (forwarded(obj) != nullptr);
+			});
+		sampling_heap_profiler.for_each_sample([&](void *&obj)
+			{
+				if (in_nursery(obj))
+				{
+					obj = forwarded(obj);
+				}
+			});
+		nursery.reset();
+		m.start_the_world();
+		nursery.end_gc();
+		_longjmp(jb, 1);
+	}
+	/**
+	 * Run a full collection: a minor collection, so that every live object
+	 * is in the old generation, followed by a major collection of the old
+	 * generation.
+	 */
+	void collect()
+	{
+		minor_collect();
+		if (gc != nullptr)
+		{
+			(*gc)();
+		}
+	}
+};
+
+} // Anonymous namespace
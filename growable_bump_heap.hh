@@ -0,0 +1,486 @@
+/*-
+ * Copyright (c) 2017 David T Chisnall
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+#include "utils.hh"
+#include "config.hh"
+#include "nonstd_function.hh"
+#include "page.hh"
+#include "cheri.hh"
+#include "lock.hh"
+#include "bump_the_pointer_heap.hh"
+#include "gc_thread_pool.hh"
+#include "gc_pacer.hh"
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace {
+
+/**
+ * A bump-the-pointer heap that grows on demand.  The heap is a list of
+ * fixed-size regions, each of which is a `bump_the_pointer_heap` with its own
+ * start bitmap and crossing map.  Initially there is a single region.  A new
+ * region is added after a collection if the heap is still more than
+ * `grow_threshold_percent` full, or if an allocation fails immediately after a
+ * collection.
+ *
+ * Objects are never moved between regions: compaction slides the live objects
+ * in each region towards the start of that region.
+ */
+template<size_t RegionSize, class Header=void, size_t MaxRegions=64>
+class growable_bump_heap
+{
+	/**
+	 * The type of each region.
+	 */
+	using region_type = bump_the_pointer_heap<RegionSize, Header>;
+	/**
+	 * Convenience type for the current template instantiation.
+	 */
+	using ThisType = class growable_bump_heap<RegionSize, Header, MaxRegions>;
+	/**
+	 * The allocation granularity within each region.
+	 */
+	static const size_t alloc_granularity = region_type::alloc_granularity;
+	/**
+	 * If more than this percentage of the heap is in use after a collection,
+	 * then the heap grows by one region.
+	 */
+	static const size_t grow_threshold_percent = 70;
+	/**
+	 * The regions.  Entries below `region_count` are valid and are never
+	 * removed.
+	 */
+	std::array<region_type*, MaxRegions> regions;
+	/**
+	 * The number of regions.
+	 */
+	std::atomic<size_t> region_count;
+	/**
+	 * The index of the region that allocations try first.  This is the region
+	 * that the last successful allocation that missed in the previous one
+	 * used.
+	 */
+	std::atomic<size_t> current;
+	/**
+	 * Lock protecting the addition of regions.
+	 */
+	UncontendedSpinlock<long> grow_lock;
+	/**
+	 * Add a new region, if there are fewer than `MaxRegions`.  Returns false
+	 * if the heap can't grow.
+	 */
+	bool grow()
+	{
+		bool grown = false;
+		run_locked(grow_lock, [&]()
+			{
+				size_t n = region_count.load(std::memory_order_relaxed);
+				if (n == MaxRegions)
+				{
+					return;
+				}
+				region_type *r = region_type::create();
+				r->allocate_heap();
+				regions[n] = r;
+				current.store(n, std::memory_order_relaxed);
+				region_count.store(n + 1, std::memory_order_release);
+				grown = true;
+			});
+		return grown;
+	}
+	/**
+	 * Returns the region that contains `addr`, or `nullptr` if it is not in
+	 * this heap.
+	 */
+	region_type *region_containing(vaddr_t addr)
+	{
+		size_t n = region_count.load(std::memory_order_acquire);
+		for (size_t i=0 ; i<n ; i++)
+		{
+			if (regions[i]->contains(addr))
+			{
+				return regions[i];
+			}
+		}
+		return nullptr;
+	}
+	/**
+	 * Callback for invoking the GC.  This is called when allocation fails.
+	 */
+	Function *gc = nullptr;
+	/**
+	 * The space used to store the object that `gc` points to.
+	 */
+	char callback_buffer[128];
+	public:
+	/**
+	 * Iterator for objects in all regions.  Visits the regions in the order
+	 * in which they were created and the objects within each region in
+	 * address order.
+	 */
+	class iterator
+	{
+		/**
+		 * The heap allows creates iterators.
+		 */
+		friend class growable_bump_heap<RegionSize, Header, MaxRegions>;
+		/**
+		 * The heap that this iterator is iterating over.
+		 */
+		ThisType &heap;
+		/**
+		 * The index of the current region.
+		 */
+		size_t region;
+		/**
+		 * The start of the current object, in `alloc_granularity` units from
+		 * the start of the region.
+		 */
+		size_t start;
+		/**
+		 * The start of the next object, in `alloc_granularity` units from the
+		 * start of the region.
+		 */
+		size_t next;
+		/**
+		 * The end of the allocated part of the region, in `alloc_granularity`
+		 * units from the start of the region.
+		 */
+		size_t end;
+		/**
+		 * Move to the first object in the current region, skipping empty
+		 * regions.
+		 */
+		void enter_region()
+		{
+			start = 0;
+			for (size_t n = heap.region_count ; region < n ; region++)
+			{
+				region_type &r = *heap.regions[region];
+				end = r.allocated_end() / alloc_granularity;
+				if (end != 0)
+				{
+					next = std::min(r.start_bits.one_after(0), end);
+					return;
+				}
+			}
+		}
+		/**
+		 * Create an iterator pointing to the first object in region `r`.
+		 */
+		iterator(ThisType &h, size_t r) : heap(h), region(r), next(0), end(0)
+		{
+			enter_region();
+		}
+		public:
+		/**
+		 * Return a pair of a pointer to the current object header and a
+		 * pointer to the current object.
+		 */
+		std::pair<Header*, void*> operator*()
+		{
+			return heap.regions[region]->allocation_between(start, next);
+		}
+		/**
+		 * Increment the current iterator.
+		 */
+		iterator &operator++()
+		{
+			start = next;
+			if (start == end)
+			{
+				region++;
+				enter_region();
+				return *this;
+			}
+			next = std::min(heap.regions[region]->start_bits.one_after(start), end);
+			return *this;
+		}
+		/**
+		 * Inequality test.
+		 */
+		bool operator!=(const iterator &o) const
+		{
+			return (region != o.region) || (start != o.start);
+		}
+	};
+	/**
+	 * Start iterator for all objects in this heap.
+	 */
+	iterator begin()
+	{
+		return iterator(*this, 0);
+	}
+	/**
+	 * End iterator for all objects in this heap.
+	 */
+	iterator end()
+	{
+		return iterator(*this, region_count);
+	}
+	/**
+	 * Call `v` with an object handle for every object in the heap, in the
+	 * same order as the iterator.
+	 */
+	template<typename Visitor>
+	void for_each_allocation(Visitor &&v)
+	{
+		size_t n = region_count;
+		for (size_t i=0 ; i<n ; i++)
+		{
+			regions[i]->for_each_allocation(v);
+		}
+	}
+	/**
+	 * Returns the number of work units that cover the allocated part of the
+	 * heap.  Work units do not span regions.
+	 */
+	size_t work_unit_count()
+	{
+		size_t count = 0;
+		size_t n = region_count;
+		for (size_t i=0 ; i<n ; i++)
+		{
+			count += regions[i]->work_unit_count();
+		}
+		return count;
+	}
+	/**
+	 * Call `fn` with the (header, object) pair for each object that starts in
+	 * the work unit with index `unit`.
+	 */
+	template<typename Fn>
+	void for_each_in_work_unit(size_t unit, Fn &&fn)
+	{
+		size_t n = region_count;
+		for (size_t i=0 ; i<n ; i++)
+		{
+			size_t units = regions[i]->work_unit_count();
+			if (unit < units)
+			{
+				regions[i]->for_each_in_work_unit(unit, fn);
+				return;
+			}
+			unit -= units;
+		}
+	}
+	/**
+	 * Call `fn` with every object in the heap, visiting work units in
+	 * parallel on the threads in `pool`.  `fn` may be called concurrently
+	 * from multiple threads.
+	 */
+	template<typename Fn>
+	void parallel_for_each(Fn &&fn, gc_thread_pool &pool=gc_workers)
+	{
+		pool.parallel_for(work_unit_count(), [&](size_t i)
+			{
+				for_each_in_work_unit(i, fn);
+			});
+	}
+	/**
+	 * Update a pointer to an object in this heap to point to a new location.
+	 */
+	void *move_reference(void *ptr, ptrdiff_t disp)
+	{
+		region_type *r = region_containing(cheri::base(ptr));
+		ASSERT(r);
+		return r->move_reference(ptr, disp);
+	}
+	/**
+	 * Move an object in this heap.  The destination must be in the same
+	 * region.
+	 */
+	void *move_object(void *obj_start, ptrdiff_t disp)
+	{
+		region_type *r = region_containing(cheri::base(obj_start));
+		ASSERT(r);
+		return r->move_object(obj_start, disp);
+	}
+	/**
+	 * Returns the compaction region that contains `obj`, identified by the
+	 * address of its start, or 0 if `obj` is not in this heap.
+	 */
+	vaddr_t compaction_region(void *obj)
+	{
+		region_type *r = region_containing(cheri::base(obj));
+		return r ? r->compaction_region(obj) : 0;
+	}
+	/**
+	 * Notify the allocator that all objects in the compaction region
+	 * `region` that end after `end` are no longer needed.
+	 */
+	void set_region_end(vaddr_t region, vaddr_t end)
+	{
+		region_type *r = region_containing(region);
+		ASSERT(r);
+		r->set_region_end(region, end);
+	}
+	/**
+	 * Release objects for which `is_live` returns false.  Nothing to do here:
+	 * compaction reclaims the space used by dead objects.
+	 */
+	template<typename IsLive>
+	void release_unreachable(IsLive &&)
+	{
+	}
+	/**
+	 * Returns the object that contains the start of `ptr`, or `nullptr` if the
+	 * object is not in this heap.
+	 */
+	void *object_for_allocation(void *ptr, Header *&h)
+	{
+		region_type *r = region_containing(cheri::base(ptr));
+		return r ? r->object_for_allocation(ptr, h) : nullptr;
+	}
+	/**
+	 * Allocate the first region.
+	 */
+	void allocate_heap()
+	{
+		assert(region_count == 0);
+		grow();
+	}
+	/**
+	 * Set the callback for invoking the garbage collector.
+	 */
+	template<typename T>
+	void set_gc(T &fn)
+	{
+		static_assert(sizeof(T) <= sizeof(callback_buffer),
+		              "Callback buffer too small for callback");
+		gc = (new (callback_buffer) ConcreteFunction<T>(fn));
+	}
+	/**
+	 * Expose the object header type.
+	 */
+	typedef Header object_header;
+	/**
+	 * Notify the allocator that the GC has started to run.
+	 */
+	void start_gc()
+	{
+		grow_lock.lock();
+		size_t n = region_count;
+		for (size_t i=0 ; i<n ; i++)
+		{
+			regions[i]->start_gc();
+		}
+	}
+	/**
+	 * Notify the allocator that the GC has finished running.  If the heap is
+	 * still mostly full then it grows, so that a large live set doesn't cause
+	 * the collector to run on almost every allocation.
+	 */
+	void end_gc()
+	{
+		size_t n = region_count;
+		size_t used = 0;
+		for (size_t i=0 ; i<n ; i++)
+		{
+			used += regions[i]->used_bytes();
+			regions[i]->end_gc();
+		}
+		grow_lock.unlock();
+		if (used * 100 > n * RegionSize * grow_threshold_percent)
+		{
+			grow();
+		}
+	}
+	/**
+	 * Create an instance of this object.
+	 */
+	static ThisType *create()
+	{
+		return PageAllocator<ThisType>().allocate(1);
+	}
+	/**
+	 * Return whether an object in a given range may contain pointers.
+	 */
+	bool may_contain_pointers(void *)
+	{
+		return true;
+	}
+	/**
+	 * Allocate an object of the given size.  Tries each region, starting with
+	 * the one that the last allocation used.  If all of the regions are full
+	 * then this runs the collector and, if that doesn't free enough space,
+	 * adds a region.  Returns `nullptr` only if the heap can't grow any more.
+	 * The collector also runs when the pacer decides that enough has been
+	 * allocated since the last collection.
+	 */
+	void *alloc(size_t size)
+	{
+		ASSERT(this);
+		if ((gc != nullptr) && gc_pacing.record_allocation(size))
+		{
+			(*gc)();
+		}
+		bool collected = false;
+		while (true)
+		{
+			size_t n = region_count.load(std::memory_order_acquire);
+			size_t first = current.load(std::memory_order_relaxed);
+			for (size_t i=0 ; i<n ; i++)
+			{
+				size_t r = (first + i) % n;
+				void *a = regions[r]->try_alloc(size);
+				if (a != nullptr)
+				{
+					if (r != first)
+					{
+						current.store(r, std::memory_order_relaxed);
+					}
+					return a;
+				}
+			}
+			if (!collected)
+			{
+				(*gc)();
+				collected = true;
+				continue;
+			}
+			if (!grow())
+			{
+				return nullptr;
+			}
+		}
+	}
+	/**
+	 * Invoke the garbage collector.
+	 */
+	void collect()
+	{
+		(*gc)();
+	}
+};
+
+} // Anonymous namespace
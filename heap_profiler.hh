@@ -0,0 +1,504 @@
+/*-
+ * Copyright (c) 2017 David T Chisnall
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <vector>
+#include <link.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "utils.hh"
+#include "page.hh"
+#include "lock.hh"
+
+namespace {
+
+/**
+ * Per-thread state for the sampling heap profiler.  This is plain data so that
+ * it can live in thread-local storage without any C++ runtime support for
+ * thread-local constructors or destructors.
+ */
+struct heap_profiler_thread_state
+{
+	/**
+	 * The number of bytes that this thread may allocate before the next
+	 * sample is taken.
+	 */
+	ptrdiff_t bytes_until_sample;
+	/**
+	 * State for the random number generator that picks sample intervals.
+	 * Zero until the thread first reaches the slow path.
+	 */
+	uint64_t random_state;
+};
+
+/**
+ * The profiler state for the current thread.
+ */
+thread_local heap_profiler_thread_state heap_profiler_thread;
+
+/**
+ * Sampling heap profiler.  Allocators call `sample` on every allocation, which
+ * costs a subtraction and a branch in the common case.  Roughly every
+ * `sample_rate` bytes (the intervals are drawn from a geometric distribution,
+ * so that allocation patterns cannot alias with the sampling), the profiler
+ * records the allocation and the backtrace that led to it.
+ *
+ * After each collection, the collector calls `retire_dead` to discard samples
+ * for objects that were not reached, and `report` to write the samples that
+ * survived.  Reports use the legacy pprof heap profile format and so can be
+ * read with `pprof --inuse_space <binary> <profile>`.
+ *
+ * The profiler is configured from the environment.  `GC_HEAP_PROFILE` gives
+ * the prefix for the profile files (one is written per collection) and
+ * `GC_HEAP_PROFILE_RATE` gives the mean number of bytes between samples.  If
+ * `GC_HEAP_PROFILE` is not set, the profiler is disabled.
+ */
+class heap_profiler
+{
+	/**
+	 * The maximum number of frames recorded for each sample.
+	 */
+	static const int max_depth = 32;
+	/**
+	 * The default mean sampling interval, in bytes.
+	 */
+	static const size_t default_sample_rate = 512_KiB;
+	/**
+	 * The interval at which threads recheck whether the profiler has been
+	 * enabled, when it is disabled.
+	 */
+	static const ptrdiff_t disabled_recheck_interval = 64_MiB;
+	/**
+	 * A sampled allocation.
+	 */
+	struct sample_record
+	{
+		/**
+		 * The sampled object.  Samples are stored in page-allocated memory,
+		 * which the collector does not scan, so this pointer does not keep
+		 * the object alive.
+		 */
+		void *object;
+		/**
+		 * The requested size of the allocation.
+		 */
+		size_t size;
+		/**
+		 * The number of valid entries in `stack`.
+		 */
+		int depth;
+		/**
+		 * The return addresses of the frames that led to the allocation,
+		 * innermost first.
+		 */
+		size_t stack[max_depth];
+	};
+	/**
+	 * The type used to store samples.
+	 */
+	using sample_vector = std::vector<sample_record, PageAllocator<sample_record>>;
+	/**
+	 * The samples for objects that have not yet been found to be dead.
+	 */
+	sample_vector samples;
+	/**
+	 * Lock protecting `samples`.  Sampling is rare, so this should be
+	 * uncontended.
+	 */
+	UncontendedSpinlock<long> lock;
+	/**
+	 * The state of the profiler.
+	 */
+	enum
+	{
+		/// The environment has not yet been read.
+		uninitialised = 0,
+		/// A thread is reading the environment.
+		initialising,
+		/// The profiler is not recording samples.
+		disabled,
+		/// The profiler is recording samples.
+		enabled
+	};
+	/**
+	 * The current state, one of the values from the enumeration above.
+	 */
+	std::atomic<int> state;
+	/**
+	 * The mean number of bytes between samples.
+	 */
+	size_t sample_rate;
+	/**
+	 * The prefix for the files that reports are written to.
+	 */
+	const char *output_prefix;
+	/**
+	 * The number of reports written so far.
+	 */
+	int reports;
+	/**
+	 * The total number of allocations that have been sampled.
+	 */
+	size_t sampled_objects;
+	/**
+	 * The total number of bytes in allocations that have been sampled.
+	 */
+	size_t sampled_bytes;
+	/**
+	 * The number of bits in `maybe_sampled`.
+	 */
+	static const size_t filter_bits = 16384;
+	/**
+	 * Filter of the addresses of sampled objects, indexed by a hash of the
+	 * address.  A clear bit means that no sampled object has an address
+	 * with that hash, so `forget` can return without taking the lock.  Bits
+	 * are set (under `lock`) when an object is sampled, and the filter is
+	 * rebuilt whenever a collection discards or moves samples.
+	 */
+	std::array<std::atomic<uint64_t>, filter_bits / 64> maybe_sampled;
+	/**
+	 * Returns the index in `maybe_sampled` for the object at `ptr`.
+	 */
+	static size_t filter_index(void *ptr)
+	{
+		uint64_t h = (uint64_t)(vaddr_t)ptr * 0x9E3779B97F4A7C15ULL;
+		return h >> (64 - __builtin_ctzll(filter_bits));
+	}
+	/**
+	 * Set the bit in `maybe_sampled` for the object at `ptr`.
+	 */
+	void add_to_filter(void *ptr)
+	{
+		size_t i = filter_index(ptr);
+		maybe_sampled[i / 64].fetch_or(1ULL << (i % 64), std::memory_order_relaxed);
+	}
+	/**
+	 * Returns false if there is definitely no sample for the object at `ptr`.
+	 */
+	bool may_be_sampled(void *ptr)
+	{
+		size_t i = filter_index(ptr);
+		return maybe_sampled[i / 64].load(std::memory_order_relaxed) & (1ULL << (i % 64));
+	}
+	/**
+	 * Recompute `maybe_sampled` from `samples`.  Must be called with `lock`
+	 * held.
+	 */
+	void rebuild_filter()
+	{
+		for (auto &w : maybe_sampled)
+		{
+			w.store(0, std::memory_order_relaxed);
+		}
+		for (auto &s : samples)
+		{
+			add_to_filter(s.object);
+		}
+	}
+	/**
+	 * Read the configuration from the environment, if no thread has done so
+	 * yet.  Exactly one thread reads it, and any others that arrive meanwhile
+	 * wait until it has finished.  This uses the state flag, rather than
+	 * `std::call_once`, so that it does not need any C++ runtime support.
+	 */
+	void initialise()
+	{
+		int expected = uninitialised;
+		if (!state.compare_exchange_strong(expected, initialising))
+		{
+			while (state.load() == initialising)
+			{
+				sched_yield();
+			}
+			return;
+		}
+		output_prefix = getenv("GC_HEAP_PROFILE");
+		const char *rate = getenv("GC_HEAP_PROFILE_RATE");
+		sample_rate = rate ? strtoull(rate, nullptr, 0) : default_sample_rate;
+		state = ((output_prefix != nullptr) && (sample_rate != 0)) ? enabled : disabled;
+	}
+	/**
+	 * Return the next value from a xorshift64* generator.
+	 */
+	static uint64_t next_random(uint64_t &s)
+	{
+		s ^= s >> 12;
+		s ^= s << 25;
+		s ^= s >> 27;
+		return s * 2685821657736338717ULL;
+	}
+	/**
+	 * Returns the number of bytes until the next sample.  This is drawn from
+	 * an exponential distribution with a mean of `sample_rate`, computed as
+	 * `-ln(u) * sample_rate` for uniformly distributed `u`.  The logarithm is
+	 * approximated so that we don't need to link against libm.
+	 */
+	ptrdiff_t next_interval(heap_profiler_thread_state &t)
+	{
+		// A uniform 53-bit integer, `u * 2^53`.
+		uint64_t r = (next_random(t.random_state) >> 11) | 1;
+		int exponent = log2(r);
+		// Approximate log2 of the mantissa, which is in [1, 2).
+		double f = (double)r / (double)(1ULL << exponent) - 1.0;
+		double log2_u = exponent + f * (1.3465 - 0.3465 * f) - 53;
+		return (ptrdiff_t)(-log2_u * 0.6931471805599453 * sample_rate) + 1;
+	}
+	/**
+	 * Slow path for sampling.  Called when the current thread's countdown
+	 * reaches zero.
+	 */
+	__attribute__((noinline))
+	void sample_slow_path(void *ptr, size_t size)
+	{
+		heap_profiler_thread_state &t = heap_profiler_thread;
+		if (state.load() <= initialising)
+		{
+			initialise();
+		}
+		if (state != enabled)
+		{
+			t.bytes_until_sample = disabled_recheck_interval;
+			return;
+		}
+		// The first time that a thread reaches the slow path, pick a random
+		// starting point rather than sampling the current allocation.
+		if (t.random_state == 0)
+		{
+			t.random_state = ((uint64_t)(size_t)&t) * 0x9E3779B97F4A7C15ULL | 1;
+			t.bytes_until_sample += next_interval(t);
+			if (t.bytes_until_sample > 0)
+			{
+				return;
+			}
+		}
+		t.bytes_until_sample = next_interval(t);
+		sample_record s;
+		s.object = ptr;
+		s.size = size;
+		// Skip this function and `capture_backtrace`.
+		s.depth = capture_backtrace(s.stack, max_depth, 2);
+		run_locked(lock, [&]()
+			{
+				samples.push_back(s);
+				add_to_filter(ptr);
+				sampled_objects++;
+				sampled_bytes += size;
+			});
+	}
+	/**
+	 * Write the executable mappings for the current process in the format
+	 * that pprof expects, so that it can symbolise the return addresses.
+	 */
+	static void write_mappings(FILE *f)
+	{
+		fprintf(f, "\nMAPPED_LIBRARIES:\n");
+		dl_iterate_phdr(
+			[](struct dl_phdr_info *pinfo, size_t, void *data) -> int
+			{
+				FILE *f = static_cast<FILE*>(data);
+				const char *name = pinfo->dlpi_name;
+				for (decltype(pinfo->dlpi_phnum) i=0 ; i<pinfo->dlpi_phnum ; ++i)
+				{
+					const auto *phdr = &pinfo->dlpi_phdr[i];
+					if ((phdr->p_type != PT_LOAD) || ((phdr->p_flags & PF_X) != PF_X))
+					{
+						continue;
+					}
+					size_t start = (size_t)pinfo->dlpi_addr + phdr->p_vaddr;
+					fprintf(f, "%08zx-%08zx r-xp %08zx 00:00 0 %s\n",
+					        start, start + phdr->p_memsz, (size_t)phdr->p_offset,
+					        (name && name[0]) ? name : "[main]");
+				}
+				return 0;
+			}, static_cast<void*>(f));
+	}
+	public:
+	/**
+	 * Record an allocation of `size` bytes at `ptr`.  This should be called
+	 * by allocators on every allocation.
+	 */
+	__attribute__((always_inline))
+	void sample(void *ptr, size_t size)
+	{
+		heap_profiler_thread_state &t = heap_profiler_thread;
+		t.bytes_until_sample -= size;
+		if (__builtin_expect(t.bytes_until_sample > 0, true))
+		{
+			return;
+		}
+		sample_slow_path(ptr, size);
+	}
+	/**
+	 * Returns true if the profiler is recording samples.
+	 */
+	bool is_enabled()
+	{
+		return state == enabled;
+	}
+	/**
+	 * Change the mean sampling interval.  A value of zero disables the
+	 * profiler.  Threads pick up the new rate after their next sample (or
+	 * within `disabled_recheck_interval` bytes, if the profiler was
+	 * disabled).
+	 */
+	void set_sample_rate(size_t rate)
+	{
+		if (state.load() <= initialising)
+		{
+			initialise();
+		}
+		sample_rate = rate;
+		state = ((output_prefix != nullptr) && (sample_rate != 0)) ? enabled : disabled;
+	}
+	/**
+	 * Discard the sample for `ptr`, if there is one, because the object has
+	 * been explicitly freed.  Most freed objects were not sampled, and the
+	 * address filter lets those return without taking the lock.  Sampling is
+	 * rare, so there are few samples to search for the rest.
+	 */
+	void forget(void *ptr)
+	{
+		if (!is_enabled() || !may_be_sampled(ptr))
+		{
+			return;
+		}
+		run_locked(lock, [&]()
+			{
+				for (size_t i=0 ; i<samples.size() ; i++)
+				{
+					if (samples[i].object == ptr)
+					{
+						samples[i] = samples.back();
+						samples.pop_back();
+						return;
+					}
+				}
+			});
+	}
+	/**
+	 * Discard the samples for objects that did not survive a collection.  The
+	 * argument is called with each sampled object and should return true if
+	 * the object is still live.  This must be called while the world is
+	 * stopped, after tracing and before any memory is reused.
+	 */
+	template<typename IsLive>
+	void retire_dead(IsLive &&is_live)
+	{
+		if (!is_enabled())
+		{
+			return;
+		}
+		run_locked(lock, [&]()
+			{
+				for (size_t i=0 ; i<samples.size() ; )
+				{
+					if (is_live(samples[i].object))
+					{
+						i++;
+						continue;
+					}
+					samples[i] = samples.back();
+					samples.pop_back();
+				}
+				rebuild_filter();
+			});
+	}
+	/**
+	 * Call `fn` with a reference to each sampled object pointer.  Moving
+	 * collectors use this to update the samples after relocating objects.
+	 */
+	template<typename Fn>
+	void for_each_sample(Fn &&fn)
+	{
+		if (!is_enabled())
+		{
+			return;
+		}
+		run_locked(lock, [&]()
+			{
+				for (auto &s : samples)
+				{
+					fn(s.object);
+				}
+				rebuild_filter();
+			});
+	}
+	/**
+	 * Write a profile of the sampled objects that are still live.  This should
+	 * be called after `retire_dead`.
+	 */
+	void report()
+	{
+		if (!is_enabled())
+		{
+			return;
+		}
+		char path[1024];
+		snprintf(path, sizeof(path), "%s.%04d.heap", output_prefix, reports++);
+		FILE *f = fopen(path, "w");
+		if (f == nullptr)
+		{
+			fprintf(stderr, "Unable to write heap profile to %s\n", path);
+			return;
+		}
+		run_locked(lock, [&]()
+			{
+				size_t live_bytes = 0;
+				for (auto &s : samples)
+				{
+					live_bytes += s.size;
+				}
+				fprintf(f, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+				        samples.size(), live_bytes, sampled_objects, sampled_bytes,
+				        sample_rate);
+				for (auto &s : samples)
+				{
+					fprintf(f, "1: %zu [1: %zu] @", s.size, s.size);
+					for (int i=0 ; i<s.depth ; i++)
+					{
+						fprintf(f, " %#zx", s.stack[i]);
+					}
+					fprintf(f, "\n");
+				}
+			});
+		write_mappings(f);
+		fclose(f);
+	}
+};
+
+/**
+ * The heap profiler shared by all of the allocators.
+ */
+heap_profiler sampling_heap_profiler;
+
+} // Anonymous namespace
@@ -29,12 +29,22 @@
  */
 
 #pragma once
+#include <array>
+#include <atomic>
 #include <type_traits>
 #include <vector>
+#include <sched.h>
 #include <setjmp.h>
 #include "cheri.hh"
 #include "page.hh"
 #include "counter.hh"
+#include "heap_profiler.hh"
+#include "gc_pacer.hh"
+#include "gc_thread_pool.hh"
+#include "work_stealing_deque.hh"
+#include "mark_stack.hh"
+#include "BitSet.hh"
+#include "gc_layout.hh"
 
 namespace 
 {
@@ -55,6 +65,143 @@ struct always_true
 	}
 };
 
+/**
+ * Trait that is true if `Heap` keeps the mark state for its objects in side
+ * bitmaps, rather than leaving it to the object headers.  Such heaps define
+ * `has_side_mark_bits` and provide `try_mark`, `try_visit`, `is_marked`,
+ * `is_visited` and `is_noscan` methods that take a pointer to the object.
+ */
+template<class Heap, class Enable=void>
+struct has_side_mark_bits : std::false_type {};
+/**
+ * Specialisation for heaps that keep side mark bits.
+ */
+template<class Heap>
+struct has_side_mark_bits<Heap, typename std::enable_if<Heap::has_side_mark_bits>::type> : std::true_type {};
+
+/**
+ * Mark state accessors for heaps that keep mark state in the object headers.
+ * The header must provide `try_mark`, `try_visit`, `is_marked`, `is_visited`
+ * and `set_contains_pointers` methods.
+ */
+template<class Heap, class Header>
+struct header_mark_state
+{
+	/**
+	 * Move an object from unmarked to marked.  Returns true if this call made
+	 * the change, so that only one marker pushes each object.
+	 */
+	static bool try_mark(Heap &, void *, Header *header)
+	{
+		return header->try_mark();
+	}
+	/**
+	 * Move an object to visited.  Returns true if this call made the change,
+	 * so that only one marker scans each object.
+	 */
+	static bool try_visit(Heap &, void *, Header *header)
+	{
+		return header->try_visit();
+	}
+	/**
+	 * Returns whether an object is marked but not yet visited.
+	 */
+	static bool is_marked(Heap &, void *, Header *header)
+	{
+		return header->is_marked();
+	}
+	/**
+	 * Returns whether an object has been visited.
+	 */
+	static bool is_visited(Heap &, void *, Header *header)
+	{
+		return header->is_visited();
+	}
+	/**
+	 * Returns whether an object may hold pointers and so must be scanned.
+	 * Headers do not record this, so every object is scanned.
+	 */
+	static bool should_scan(Heap &, void *, Header *)
+	{
+		return true;
+	}
+	/**
+	 * Record that an object contains pointers.
+	 */
+	static void set_contains_pointers(Header *header)
+	{
+		header->set_contains_pointers();
+	}
+	/**
+	 * Prefetch the mark state of an object that is about to be scanned.  This
+	 * is in the header, which `try_visit` writes.
+	 */
+	static void prefetch(Heap &, void *, Header *header)
+	{
+		__builtin_prefetch(header, 1);
+	}
+};
+
+/**
+ * Mark state accessors for heaps with side mark bits.  These never touch the
+ * header, so marking does not write to header or object pages.
+ */
+template<class Heap, class Header>
+struct side_mark_state
+{
+	/**
+	 * Move an object from unmarked to marked.  Returns true if this call made
+	 * the change, so that only one marker pushes each object.
+	 */
+	static bool try_mark(Heap &h, void *obj, Header *)
+	{
+		return h.try_mark(obj);
+	}
+	/**
+	 * Move an object to visited.  Returns true if this call made the change,
+	 * so that only one marker scans each object.
+	 */
+	static bool try_visit(Heap &h, void *obj, Header *)
+	{
+		return h.try_visit(obj);
+	}
+	/**
+	 * Returns whether an object is marked but not yet visited.
+	 */
+	static bool is_marked(Heap &h, void *obj, Header *)
+	{
+		return h.is_marked(obj);
+	}
+	/**
+	 * Returns whether an object has been visited.
+	 */
+	static bool is_visited(Heap &h, void *obj, Header *)
+	{
+		return h.is_visited(obj);
+	}
+	/**
+	 * Returns whether an object may hold pointers and so must be scanned.
+	 * Objects allocated with `alloc_noscan` are marked but never scanned.
+	 */
+	static bool should_scan(Heap &h, void *obj, Header *)
+	{
+		return !h.is_noscan(obj);
+	}
+	/**
+	 * The contains-pointers flag lives in the header, so it is not recorded.
+	 */
+	static void set_contains_pointers(Header *) {}
+	/**
+	 * Prefetch the mark state of an object that is about to be scanned, and
+	 * its header, which holds the layout.
+	 */
+	static void prefetch(Heap &h, void *obj, Header *header)
+	{
+		h.prefetch_mark_state(obj);
+		__builtin_prefetch(header);
+	}
+};
+
 /**
  * Mark and compact garbage collector, based on the LISP2 design.
  *
@@ -84,16 +231,403 @@ class mark
 	 * The number of objects that 
 	 */
 	Counter<> visited;
+	/**
+	 * The number of times that a marker moved on to grey objects in a
+	 * different chunk during the last trace.  Each switch moves the header
+	 * and object accesses to a new set of pages, so this measures how well
+	 * the trace keeps to the TLB.
+	 */
+	Counter<> chunk_switches;
+	/**
+	 * The number of bytes in objects found live by the current mark.
+	 */
+	size_t live_bytes = 0;
 	/**
 	 * Import the `cheri::capability` class.
 	 */
 	template<typename T> using capability = cheri::capability<T>;
 	/**
-	 * The mark list (i.e. list of objects seen but not yet inspected by the
-	 * collector).  This is page allocated and should be invisible to the
-	 * collector.
+	 * Accessors for the mark state, which is in the heap's side bitmaps if it
+	 * has them and in the headers otherwise.
+	 */
+	using mark_state = typename std::conditional<has_side_mark_bits<Heap>::value,
+	                                             side_mark_state<Heap, Header>,
+	                                             header_mark_state<Heap, Header>>::type;
+	/**
+	 * The maximum number of threads that mark in parallel.
+	 */
+	static const int max_markers = 64;
+	/**
+	 * The number of grey lists for each marker.  Each non-empty list holds
+	 * the grey objects in one chunk.
+	 */
+	static const int grey_list_count = 8;
+	/**
+	 * The state for one marking thread.  Each has a work-stealing mark stack
+	 * (the list of objects seen but not yet inspected by the collector) and a
+	 * set of grey lists, each holding the objects in one chunk.  The marker
+	 * works on one chunk at a time: objects in that chunk go on the stack and
+	 * are scanned soon, and others wait on the list for their chunk.  When
+	 * the stack is empty, the marker moves on to the list for the next chunk
+	 * in address order.  This keeps the header and object accesses during
+	 * tracing within a few (super)pages at a time, as BDW observe.  The
+	 * stacks are page allocated and so are invisible to the collector.
+	 */
+	struct marker
+	{
+		/**
+		 * Objects that this marker has claimed but not yet scanned.  Other
+		 * markers may steal from this.
+		 */
+		work_stealing_deque<void*> stack;
+		/**
+		 * Objects waiting to be scanned, one chunk in each list.  These are
+		 * moved to `stack` when it is empty, one list at a time.
+		 */
+		segmented_mark_stack grey_lists[grey_list_count];
+		/**
+		 * The index of the chunk whose objects are in each non-empty grey
+		 * list.
+		 */
+		size_t grey_chunks[grey_list_count];
+		/**
+		 * Objects waiting to be scanned whose chunk had no grey list when
+		 * they were pushed.  These are sorted into the grey lists once the
+		 * lists have been drained.
+		 */
+		segmented_mark_stack spill;
+		/**
+		 * The index of the chunk that this marker is working on.
+		 */
+		size_t current_chunk;
+		/**
+		 * The number of times that this marker has moved on to a different
+		 * chunk.
+		 */
+		size_t chunk_switches;
+		/**
+		 * The number of objects that this marker has scanned.
+		 */
+		size_t objects;
+		/**
+		 * The number of bytes in the objects that this marker has scanned.
+		 */
+		size_t bytes;
+	};
+	/**
+	 * The number of objects that a marker has prefetched but not yet
+	 * scanned.
+	 */
+	static const int prefetch_distance = 8;
+	/**
+	 * An object and its header.
+	 */
+	using grey_object = std::pair<void*, Header*>;
+	/**
+	 * FIFO of objects taken from a mark stack that have been prefetched and
+	 * are waiting to be scanned.  Scanning an object `prefetch_distance`
+	 * objects after its prefetch was issued hides most of the latency of
+	 * loading it, rather than taking a dependent cache miss for each edge.
+	 * Each entry keeps the header found when the object was taken, so
+	 * scanning does not look it up again.
+	 */
+	struct prefetch_queue
+	{
+		/**
+		 * The queued objects.
+		 */
+		grey_object entries[prefetch_distance];
+		/**
+		 * The index of the oldest entry.
+		 */
+		int head = 0;
+		/**
+		 * The number of entries.
+		 */
+		int count = 0;
+		/**
+		 * Add an object.  The queue must not be full.
+		 */
+		void push(grey_object p)
+		{
+			entries[(head + count++) % prefetch_distance] = p;
+		}
+		/**
+		 * Remove the oldest object.  The queue must not be empty.
+		 */
+		grey_object pop()
+		{
+			grey_object p = entries[head];
+			head = (head + 1) % prefetch_distance;
+			count--;
+			return p;
+		}
+	};
+	/**
+	 * Prefetch the mark state, header and first cache lines of an object that
+	 * is about to be scanned.
+	 */
+	void prefetch_object(void *obj, Header *header)
+	{
+		mark_state::prefetch(h, obj, header);
+		capability<void> cap(obj);
+		__builtin_prefetch(obj);
+		if (cap.length() - cap.offset() > cache_line_size)
+		{
+			__builtin_prefetch(static_cast<char*>(obj) + cache_line_size);
+		}
+	}
+	/**
+	 * The number of chunk-sized address ranges tracked by `rescan_chunks`.
+	 */
+	static const size_t rescan_chunk_count = 1ULL << (address_space_size_bits - chunk_size_bits);
+	/**
+	 * One bit for each chunk that contains a marked object that was not
+	 * pushed onto a mark stack.  Addresses outside of the expected address
+	 * space alias, which only causes extra rescanning.  There are two sets,
+	 * so that objects that overflow while one is being rescanned are
+	 * recorded in the other.
+	 */
+	BitSet<rescan_chunk_count, true> rescan_chunks[2];
+	/**
+	 * The index in `rescan_chunks` of the set that overflows are recorded in.
+	 */
+	int overflow_set = 0;
+	/**
+	 * Returns the index in `rescan_chunks` of the chunk containing `address`.
+	 * This is also the key for the grey lists.
+	 */
+	static size_t chunk_index(size_t address)
+	{
+		return (address >> chunk_size_bits) & (rescan_chunk_count - 1);
+	}
+	/**
+	 * Returns the grey list of marker `self` for the objects in `chunk`.  If
+	 * no list holds that chunk, an empty list is given to it.  Returns
+	 * `nullptr` if every list holds another chunk.
+	 */
+	static segmented_mark_stack *grey_list_for(marker &self, size_t chunk)
+	{
+		int unused = -1;
+		for (int i=0 ; i<grey_list_count ; i++)
+		{
+			if (self.grey_lists[i].empty_hint())
+			{
+				if (unused < 0)
+				{
+					unused = i;
+				}
+				continue;
+			}
+			if (self.grey_chunks[i] == chunk)
+			{
+				return &self.grey_lists[i];
+			}
+		}
+		if (unused < 0)
+		{
+			return nullptr;
+		}
+		self.grey_chunks[unused] = chunk;
+		return &self.grey_lists[unused];
+	}
+	/**
+	 * Returns the non-empty grey list of marker `self` with the lowest chunk
+	 * at or above the current one, wrapping around to the lowest chunk if
+	 * there is none, so that chunks are visited in address order.  Returns -1
+	 * if all of the lists are empty.
+	 */
+	static int next_grey_list(marker &self)
+	{
+		int next = -1;
+		int lowest = -1;
+		for (int i=0 ; i<grey_list_count ; i++)
+		{
+			if (self.grey_lists[i].empty_hint())
+			{
+				continue;
+			}
+			size_t chunk = self.grey_chunks[i];
+			if ((lowest < 0) || (chunk < self.grey_chunks[lowest]))
+			{
+				lowest = i;
+			}
+			if ((chunk >= self.current_chunk) &&
+			    ((next < 0) || (chunk < self.grey_chunks[next])))
+			{
+				next = i;
+			}
+		}
+		return (next < 0) ? lowest : next;
+	}
+	/**
+	 * Push an object that has just been marked, with its header, for marker
+	 * `self`.  Objects in the chunk that the marker is working on go on its
+	 * stack and will be taken soon, so their mark state and header are
+	 * prefetched.  Others go on the grey list for their chunk, or on the
+	 * spill list if they don't have one.  If there is no space and no more
+	 * memory may be used for mark stacks, the object is left marked (but not
+	 * visited) and its chunk is flagged to be rescanned when the trace
+	 * finishes.
+	 */
+	void push_grey(marker &self, void *p, Header *header)
+	{
+		size_t chunk = chunk_index(cheri::base(p));
+		if ((chunk == self.current_chunk) && self.stack.push(p))
+		{
+			mark_state::prefetch(h, p, header);
+			return;
+		}
+		segmented_mark_stack *list = grey_list_for(self, chunk);
+		if (((list != nullptr) && list->push(p)) ||
+		    self.spill.push(p) || self.stack.push(p))
+		{
+			return;
+		}
+		rescan_chunks[overflow_set].set(chunk);
+	}
+	/**
+	 * Move the objects on the spill list of marker `self` to the grey lists
+	 * for their chunks.  Objects whose chunk still has no list go on the
+	 * stack instead, up to half of its capacity, so each object is spilled
+	 * at most once.  Returns true if any objects were moved to the stack.
+	 */
+	bool sort_spilled(marker &self)
+	{
+		void *p;
+		size_t moved = 0;
+		while ((moved < decltype(self.stack)::capacity / 2) && self.spill.pop(p))
+		{
+			segmented_mark_stack *list = grey_list_for(self, chunk_index(cheri::base(p)));
+			if ((list != nullptr) && list->push(p))
+			{
+				continue;
+			}
+			self.stack.push(p);
+			moved++;
+		}
+		return moved > 0;
+	}
+	/**
+	 * Move up to half a stack's worth of objects from a grey list of marker
+	 * `self` to its stealable stack.  This uses the list for the current
+	 * chunk if it is not empty, or moves to the next chunk in address order
+	 * otherwise.  Once all of the lists are empty, the spill list is sorted
+	 * into them.  Returns false if there are no grey objects left.
+	 */
+	bool refill(marker &self)
+	{
+		int list = next_grey_list(self);
+		bool moved_spilled = false;
+		if (list < 0)
+		{
+			moved_spilled = sort_spilled(self);
+			list = next_grey_list(self);
+		}
+		if (list < 0)
+		{
+			return moved_spilled;
+		}
+		if (self.grey_chunks[list] != self.current_chunk)
+		{
+			self.current_chunk = self.grey_chunks[list];
+			self.chunk_switches++;
+		}
+		void *p;
+		size_t moved = 0;
+		while ((moved < decltype(self.stack)::capacity / 2) &&
+		       self.grey_lists[list].pop(p))
+		{
+			self.stack.push(p);
+			moved++;
+		}
+		return true;
+	}
+	/**
+	 * Push every object that is marked but not visited in a chunk flagged in
+	 * `rescan_chunks`, dealing them out to the markers, and clear the flags.
+	 * These are the objects that overflowed the mark stacks.
 	 */
-	std::vector<void*, PageAllocator<void*>> mark_list;
+	void rescan_overflowed()
+	{
+		auto &chunks = rescan_chunks[overflow_set];
+		overflow_set ^= 1;
+		int next = 0;
+		h.for_each_allocation([&](const auto &alloc)
+			{
+				if (!chunks[chunk_index(alloc.address())])
+				{
+					return;
+				}
+				void *obj = alloc.object();
+				if (!mark_state::is_marked(h, obj, alloc.header()))
+				{
+					return;
+				}
+				push_grey(markers[next], obj, alloc.header());
+				next = (next + 1) % marker_count;
+			});
+		chunks.clear_range(0, rescan_chunk_count);
+	}
+	/**
+	 * Scan objects from the stack of marker `self` until the stack is empty.
+	 * Each object is prefetched when it is taken from the stack and scanned
+	 * once `prefetch_distance` more objects have been taken.
+	 */
+	void drain(marker &self)
+	{
+		prefetch_queue queue;
+		void *p;
+		while (true)
+		{
+			// Another marker may steal everything that a refill moves to the
+			// stack, so keep refilling until the grey lists are empty.
+			bool found = self.stack.take(p);
+			while (!found && refill(self))
+			{
+				found = self.stack.take(p);
+			}
+			if (found)
+			{
+				// The stacks hold only objects, so this is the one lookup
+				// of the header before the object is scanned.
+				Header *header;
+				void *obj = h.object_for_allocation(p, header);
+				if (!obj)
+				{
+					continue;
+				}
+				prefetch_object(obj, header);
+				if (queue.count == prefetch_distance)
+				{
+					grey_object next = queue.pop();
+					scan_object(next.first, next.second, self);
+				}
+				queue.push(grey_object(obj, header));
+				continue;
+			}
+			if (queue.count == 0)
+			{
+				return;
+			}
+			// Scanning may push more objects, which we'll then take.
+			grey_object next = queue.pop();
+			scan_object(next.first, next.second, self);
+		}
+	}
+	/**
+	 * The state for each marking thread.
+	 */
+	std::array<marker, max_markers> markers;
+	/**
+	 * The number of markers used for the current collection.
+	 */
+	int marker_count = 1;
+	/**
+	 * The number of markers that are currently scanning objects (and so may
+	 * push more work).
+	 */
+	std::atomic<int> active_markers;
 	/**
 	 * Constructor.
 	 */
@@ -102,9 +636,11 @@ class mark
 		m.register_global_roots();
 	}
 	/**
-	 * Mark the object referred to by the specified pointer.
+	 * Scan the object referred to by the specified pointer, pushing any
+	 * objects that it refers to and that have not yet been seen onto the
+	 * mark stack of marker `self`.
 	 */
-	void mark_pointer(void *p)
+	void mark_pointer(void *p, marker &self)
 	{
 		Header *header;
 		void *obj = h.object_for_allocation(p, header);
@@ -115,87 +651,239 @@ class mark
 		{
 			return;
 		}
+		scan_object(obj, header, self);
+	}
+	/**
+	 * Scan the object `obj`, whose header is `header`, pushing any objects
+	 * that it refers to and that have not yet been seen onto the mark stack
+	 * of marker `self`.
+	 */
+	void scan_object(void *obj, Header *header, marker &self)
+	{
 		Filter f;
 		// If the GC policy tells us to ignore this object, then skip it.
 		if (!f(*header, obj))
 		{
 			return;
 		}
-		// Objects should only be added to the mark stack if they're really
-		// objects and have not yet been seen, but if one is then skip it.
-		//
-		// FIXME: We should be able to assert that color is marked, find out
-		// why we can't.
-		if (header->is_visited())
+		// Claim the object.  This atomically sets it to visited (resetting the
+		// header, if the mark state is kept there), and fails if another
+		// marker has already done so, so each object is scanned exactly once.
+		if (!mark_state::try_visit(h, obj, header))
 		{
 			return;
 		}
-		// Count the number of visited objects, for sanity checking later.
-		++visited;
-		// Initialise the header.
-		header->reset();
-		header->set_visited();
-		// Scan the contents of the object.
-		capability<void*> cap(static_cast<void**>(obj));
-		for (void *ptr : cap)
+		// Count the visited objects, for sanity checking and pacing later.
+		self.objects++;
+		self.bytes += cheri::length(obj);
+		// Pointer-free objects are live, but there is nothing to scan.
+		if (!mark_state::should_scan(h, obj, header))
 		{
-			// Skip pointer-sized things that are not pointers.
-			capability<void> ptr_as_cap(ptr);
-			if (!ptr_as_cap)
+			return;
+		}
+		// Scan the words of the object that its layout says may hold
+		// pointers.  Objects allocated without a layout are scanned
+		// conservatively.
+		gc_descriptor layout = gc_layouts[header->layout()];
+		layout.for_each_slot(static_cast<void**>(obj), cheri::length(obj), [&](void *ptr)
 			{
-				continue;
+				// Skip pointer-sized things that are not pointers.
+				capability<void> ptr_as_cap(ptr);
+				if (!ptr_as_cap)
+				{
+					return;
+				}
+				// If we see a pointer, record the fact.
+				Header *pointee_header;
+				mark_state::set_contains_pointers(header);
+				ptr = h.object_for_allocation(ptr, pointee_header);
+				if (!ptr)
+				{
+					return;
+				}
+				// If an object has not yet been seen, add it to the mark
+				// stack.  Only the marker that moves it from unmarked to
+				// marked pushes it.
+				if (mark_state::try_mark(h, ptr, pointee_header))
+				{
+					// Note: BDW observe that having separate mark lists for
+					// nearby allocations improves cache / TLB usage.
+					push_grey(self, ptr, pointee_header);
+				}
+			});
+	}
+	/**
+	 * Returns true if all of the mark stacks are empty.
+	 */
+	bool mark_stacks_empty()
+	{
+		for (int i=0 ; i<marker_count ; i++)
+		{
+			if (!markers[i].stack.empty_hint())
+			{
+				return false;
 			}
-			// If we see a pointer, record the fact.
-			Header *pointee_header;
-			header->set_contains_pointers();
-			ptr = h.object_for_allocation(ptr, pointee_header);
-			if (!ptr)
+			for (auto &list : markers[i].grey_lists)
 			{
-				continue;
+				if (!list.empty_hint())
+				{
+					return false;
+				}
 			}
-			// If an object has not yet been seen, add it to the mark list.
-			if (pointee_header->is_unmarked())
+			if (!markers[i].spill.empty_hint())
 			{
-				pointee_header->set_marked();
-				// Note: BDW observe that having separate mark lists for nearby
-				// allocations improves cache / TLB usage.
-				mark_list.push_back(ptr);
+				return false;
 			}
 		}
+		return true;
+	}
+	/**
+	 * Try to steal an object from another marker's stack.  Returns false if
+	 * there was nothing to steal.
+	 */
+	bool steal(marker &self, void *&p)
+	{
+		int first = &self - &markers[0];
+		for (int i=1 ; i<marker_count ; i++)
+		{
+			auto &victim = markers[(first + i) % marker_count].stack;
+			typename work_stealing_deque<void*>::steal_result r;
+			while ((r = victim.steal(p)) == work_stealing_deque<void*>::lost_race) {}
+			if (r == work_stealing_deque<void*>::stolen)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+	/**
+	 * Run one marker until there is no work left anywhere.  The marker drains
+	 * its own stack and then steals from the others.  It exits when all of
+	 * the stacks are empty and no marker is scanning an object.
+	 */
+	void run_marker(marker &self)
+	{
+		void *p;
+		active_markers.fetch_add(1);
+		while (true)
+		{
+			drain(self);
+			active_markers.fetch_sub(1);
+			while (!steal(self, p))
+			{
+				if ((active_markers.load() == 0) && mark_stacks_empty())
+				{
+					return;
+				}
+				sched_yield();
+			}
+			active_markers.fetch_add(1);
+			mark_pointer(p, self);
+		}
 	}
 	/**
 	 * Trace: Inspect all of the objects that are known live and recursively
-	 * find all that are reachable from them.
+	 * find all that are reachable from them.  This runs one marker on each of
+	 * the threads in the GC thread pool.
 	 */
 	void trace()
 	{
-		while (!mark_list.empty())
+		// If the mark stacks overflowed, some marked objects were never
+		// scanned.  Find them and trace again until nothing overflows.
+		while (true)
 		{
-			void *p = mark_list.back();
-			mark_list.pop_back();
-			mark_pointer(p);
+			active_markers = 0;
+			gc_workers.parallel_for(marker_count, [&](size_t i)
+				{
+					run_marker(markers[i]);
+				});
+			if (rescan_chunks[overflow_set].empty())
+			{
+				break;
+			}
+			rescan_overflowed();
 		}
+		size_t objects = 0;
+		size_t switches = 0;
+		for (int i=0 ; i<marker_count ; i++)
+		{
+			objects += markers[i].objects;
+			switches += markers[i].chunk_switches;
+			live_bytes += markers[i].bytes;
+			markers[i].stack.reset();
+			for (auto &list : markers[i].grey_lists)
+			{
+				list.release_spare();
+			}
+			markers[i].spill.release_spare();
+		}
+		visited = static_cast<uint64_t>(visited) + objects;
+		chunk_switches = switches;
+	}
+	/**
+	 * Discard heap profiler samples for objects that the trace did not reach
+	 * and write a profile of the ones that survived.  Must be called after
+	 * `trace` and before any unreachable memory is reused.
+	 */
+	void profile_survivors()
+	{
+		sampling_heap_profiler.retire_dead([&](void *obj)
+			{
+				Header *header;
+				void *alloc = h.object_for_allocation(obj, header);
+				return (nullptr != alloc) && mark_state::is_visited(h, alloc, header);
+			});
+		sampling_heap_profiler.report();
 	}
 	/**
-	 * Look at all of the roots and add any reachable objects to the stack.
+	 * Report the live size found by this mark to the pacer, which uses it to
+	 * decide when to run the next collection.  `untraced` is the number of
+	 * live bytes that this mark did not trace, such as those in objects that
+	 * a generational collector treats as old.  Must be called after `trace`.
+	 */
+	void pace_next_cycle(size_t untraced=0)
+	{
+		gc_pacing.cycle_complete(live_bytes + untraced);
+	}
+	/**
+	 * Look at all of the roots and add any reachable objects to the mark
+	 * stacks.  The roots are dealt out to the markers' stealable stacks in
+	 * turn, so that scanning the objects that they refer to is partitioned
+	 * across the threads from the start of the trace and idle markers can
+	 * steal them.  Roots only go to the grey lists once a stack is full.
 	 */
 	void mark_roots()
 	{
+		live_bytes = 0;
+		marker_count = std::min(gc_workers.concurrency(), max_markers);
+		for (int i=0 ; i<marker_count ; i++)
+		{
+			markers[i].objects = 0;
+			markers[i].bytes = 0;
+			markers[i].current_chunk = 0;
+			markers[i].chunk_switches = 0;
+		}
 		m.collect_roots_from_ranges();
+		int next = 0;
 		// FIXME: We should record the roots of objects that we're going to
 		// move here, rather than scanning for them again.
 		for (auto &r : m)
 		{
 			Header *header;
-			if (nullptr == h.object_for_allocation(r.second, header))
+			void *obj = h.object_for_allocation(r.second, header);
+			if (nullptr == obj)
 			{
 				continue;
 			}
-			if (header->is_unmarked())
+			if (mark_state::try_mark(h, obj, header))
 			{
 				// FIXME: We should be recording this as a reachable root
 				// so that we don't have to scan all of root memory twice.
-				mark_pointer(r.second);
+				if (!markers[next].stack.push(obj))
+				{
+					push_grey(markers[next], obj, header);
+				}
+				next = (next + 1) % marker_count;
 			}
 		};
 	}
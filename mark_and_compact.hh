@@ -36,6 +36,7 @@
 #include "page.hh"
 #include "counter.hh"
 #include "mark.hh"
+#include "gc_layout.hh"
 
 namespace
 {
@@ -73,7 +74,25 @@ class alignas(void*) mark_and_compact_object_header
 	 * Does the object contain any pointers?
 	 */
 	bool contains_pointers;
+	/**
+	 * The layout of the object, if it was allocated with `alloc_typed`.
+	 */
+	gc_layout layout_index;
 	public:
+	/**
+	 * Returns the layout of the object.
+	 */
+	gc_layout layout() const
+	{
+		return layout_index;
+	}
+	/**
+	 * Set the layout of the object.
+	 */
+	void set_layout(gc_layout l)
+	{
+		layout_index = l;
+	}
 	/**
 	 * Helper for debugging: dump the header in a human-readable format.
 	 */
@@ -159,6 +178,38 @@ class alignas(void*) mark_and_compact_object_header
 	{
 		return color == unmarked;
 	}
+	/**
+	 * Atomically move from unmarked to marked.  Returns true if this call
+	 * made the change, so that only one marker pushes each object.
+	 */
+	bool try_mark()
+	{
+		auto expected = unmarked;
+		auto desired = marked;
+		return __atomic_compare_exchange(&color, &expected, &desired, false,
+		                                 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	}
+	/**
+	 * Atomically reset the state and set the colour to visited, unless the
+	 * colour is already visited.  Returns true if this call made the change,
+	 * so that only one marker scans each object.
+	 */
+	bool try_visit()
+	{
+		auto old = __atomic_load_n(&color, __ATOMIC_RELAXED);
+		auto desired = visited;
+		do
+		{
+			if (old == visited)
+			{
+				return false;
+			}
+		} while (!__atomic_compare_exchange(&color, &old, &desired, true,
+		                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+		displacement = 0;
+		contains_pointers = false;
+		return true;
+	}
 };
 
 // The header is expected to be small enough to fit in a pointer.
@@ -190,10 +241,6 @@ class mark_and_compact : mark<RootSet, Heap, mark_and_compact_object_header>
 	 * Import the visited counter from the superclass.
 	 */
 	using Super::visited;
-	/**
-	 * Import the mark list from the superclass.
-	 */
-	using Super::mark_list;
 	/**
 	 * Import the `cheri::capability` class.
 	 */
@@ -209,26 +256,32 @@ class mark_and_compact : mark<RootSet, Heap, mark_and_compact_object_header>
 	 */
 	void calculate_displacements()
 	{
+		vaddr_t region = 0;
 		size_t last_end = 0;
-		// FIXME: Some of this logic should be in the heap, which knows about the location.
-		// Ideally, we should ask the heap to give us the displacement between
-		// two known-live objects, which it can also use to mark any
-		// intervening objects as dead.
+		// The heap tells us which compaction region each object is in.
+		// Objects slide towards the start of their own region, and objects
+		// that are not in any region (for example, large objects) never move.
 		for (auto alloc : h)
 		{
 			capability<object_header> header(alloc.first);
 			capability<void> object(alloc.second);
-			if (last_end == 0)
-			{
-				last_end = header.base();
-			}
 			if (header->color == object_header::unmarked)
 			{
 				continue;
 			}
 			ASSERT(header->color == object_header::visited);
-			size_t base = header.base();
 			header->displacement = 0;
+			vaddr_t r = h.compaction_region(alloc.second);
+			if (r == 0)
+			{
+				continue;
+			}
+			if (r != region)
+			{
+				region = r;
+				last_end = r;
+			}
+			size_t base = header.base();
 			if (base > last_end)
 			{
 				header->displacement = last_end - base;
@@ -255,6 +308,17 @@ class mark_and_compact : mark<RootSet, Heap, mark_and_compact_object_header>
 				*r.first = h.move_reference(r.second, header->displacement);
 			}
 		}
+		// Samples are not roots, but they must follow the objects that they
+		// refer to.
+		sampling_heap_profiler.for_each_sample([&](void *&obj)
+			{
+				object_header *header;
+				if ((nullptr != h.object_for_allocation(obj, header)) &&
+				    (header->displacement != 0))
+				{
+					obj = h.move_reference(obj, header->displacement);
+				}
+			});
 		int live = 0;
 		int dead = 0;
 		int objects = 0;
@@ -270,22 +334,25 @@ class mark_and_compact : mark<RootSet, Heap, mark_and_compact_object_header>
 			{
 				continue;
 			}
-			capability<void*> cap(static_cast<void**>(alloc.second));
-			for (void *&ptr : cap)
-			{
-				capability<void> ptr_as_cap;
-				if (!ptr_as_cap)
-				{
-					continue;
-				}
-				object_header *pointee_header;
-				void *obj = h.object_for_allocation(ptr, pointee_header);
-				if (!obj || (pointee_header->displacement == 0))
+			// Only the words that the layout says may hold pointers are
+			// inspected.
+			gc_layouts[alloc.first->layout()].for_each_slot(static_cast<void**>(alloc.second),
+			                                                cheri::length(alloc.second),
+			                                                [&](void *&ptr)
 				{
-					continue;
-				}
-				ptr = h.move_reference(obj, pointee_header->displacement);
-			}
+					capability<void> ptr_as_cap(ptr);
+					if (!ptr_as_cap)
+					{
+						return;
+					}
+					object_header *pointee_header;
+					void *obj = h.object_for_allocation(ptr, pointee_header);
+					if (!obj || (pointee_header->displacement == 0))
+					{
+						return;
+					}
+					ptr = h.move_reference(obj, pointee_header->displacement);
+				});
 		}
 		fprintf(stderr, "Found %d live objects, %d dead ones\n", live, dead);
 		ASSERT(visited == live);
@@ -295,9 +362,23 @@ class mark_and_compact : mark<RootSet, Heap, mark_and_compact_object_header>
 	 */
 	void move_objects()
 	{
-		void *last_object = nullptr;
+		vaddr_t region = 0;
+		vaddr_t region_end = 0;
 		for (auto alloc : h)
 		{
+			// When we leave a region, notify the heap of the end of the last
+			// live object in it, so that it can reuse any space after that
+			// object.
+			vaddr_t r = h.compaction_region(alloc.second);
+			if (r != region)
+			{
+				if (region != 0)
+				{
+					h.set_region_end(region, region_end);
+				}
+				region = r;
+				region_end = r;
+			}
 			if (alloc.first->color != object_header::visited)
 			{
 				ASSERT(alloc.first->color == object_header::unmarked);
@@ -306,17 +387,17 @@ class mark_and_compact : mark<RootSet, Heap, mark_and_compact_object_header>
 			object_header *header = alloc.first;
 			// FIXME: Incremental collection could leave these in the marked state
 			header->color = object_header::unmarked;
+			void *obj = alloc.second;
 			if (header->displacement != 0)
 			{
 				fprintf(stderr, "Moving object: %#p\n", alloc.second);
-				last_object = h.move_object(alloc.second, header->displacement);
+				obj = h.move_object(alloc.second, header->displacement);
 			}
+			region_end = cheri::base(obj) + cheri::length(obj);
 		};
-		// If we've moved objects, notify the heap of the last object that
-		// we've moved so that it can reuse any space after that object.
-		if (last_object)
+		if (region != 0)
 		{
-			h.set_last_object(last_object);
+			h.set_region_end(region, region_end);
 		}
 	}
 	public:
@@ -341,16 +422,27 @@ class mark_and_compact : mark<RootSet, Heap, mark_and_compact_object_header>
 			return;
 		}
 		m.temporary_roots.clear();
+		// Tell the heap before stopping the world, so that threads that are
+		// allocating can finish (or back out) and so that their allocation
+		// buffers are invalidated.
+		h.start_gc();
 		m.stop_the_world();
 		// FIXME: Other threads, sandboxes
 		m.add_thread(static_cast<void**>(__builtin_cheri_stack_get()));
 		Super::mark_roots();
 		Super::trace();
-		ASSERT(mark_list.empty());
+		ASSERT(Super::mark_stacks_empty());
+		Super::profile_survivors();
+		Super::pace_next_cycle();
+		h.release_unreachable([](object_header *header)
+			{
+				return header->color == object_header::visited;
+			});
 		calculate_displacements();
 		update_pointers();
 		move_objects();
 		m.start_the_world();
+		h.end_gc();
 		// FIXME: We should probably zero caller-save capability registers
 		// before returning.
 		_longjmp(jb, 1);
@@ -29,6 +29,7 @@
  */
 
 #pragma once
+#include <atomic>
 #include <type_traits>
 #include <vector>
 #include <setjmp.h>
@@ -36,128 +37,53 @@
 #include "page.hh"
 #include "counter.hh"
 #include "mark.hh"
+#include "gc_layout.hh"
+#include "remembered_set.hh"
 
 namespace
 {
 
-// Forward declare mark_and_sweep so that it can be a friend of the header.
-template<class RootSet, class Heap>
-class mark_and_sweep;
-
 /**
  * Object header for this collector.  Declared outside the class so that its
  * type doesn't depend on the template arguments.
  *
  * This is intended to be stored in a separate location to the rest of the
- * allocation and so is designed to be tightly packed.
+ * allocation and so is designed to be tightly packed.  The mark state is not
+ * stored here: the heap keeps it in side bitmaps, so marking never writes to
+ * headers.
  */
 class mark_and_sweep_object_header
 {
-	template<class RootSet, class Heap>
-	friend class mark_and_sweep;
-	/**
-	 * The GC state for this object.
-	 */
-	enum : unsigned char
-	{
-		/// Object has not been seen by the GC yet
-		unmarked = 0,
-		/// Object has been marked as live, but it has not yet been scanned.
-		marked,
-		/// Object has been visited.
-		visited
-	} color:2;
-	/**
-	 * Does the object contain any pointers?
-	 */
-	bool contains_pointers:1;
 	public:
 	/**
 	 * Has this object been free'd?
 	 */
 	bool is_free:1;
 	/**
-	 * Helper for debugging: dump the header in a human-readable format.
-	 */
-	void dump()
-	{
-		fprintf(stderr, "Color: %s, contains pointers: %s\n",
-				(color == unmarked) ? "unmarked" :
-					((color == marked) ? "marked" :
-						((color == visited) ? "visited" :
-						 	"unknown")),
-				contains_pointers ? "true" : "false");
-	}
-	/**
-	 * Set the colour to marked.
-	 *
-	 * This method avoids the need for the marker to know the implementation
-	 * details of the header.
-	 */
-	void set_marked()
-	{
-		color = marked;
-	}
-	/**
-	 * Set the colour to visited.
-	 *
-	 * This method avoids the need for the marker to know the implementation
-	 * details of the header.
-	 */
-	void set_visited()
-	{
-		color = visited;
-	}
-	/**
-	 * Set the contains-pointers flag.
-	 *
-	 * This method avoids the need for the marker to know the implementation
-	 * details of the header.
+	 * The layout of the object, if it was allocated with `alloc_typed`.
 	 */
-	void set_contains_pointers()
-	{
-		contains_pointers = true;
-	}
+	gc_layout layout_index:7;
 	/**
-	 * Reset the state.
-	 *
-	 * This method avoids the need for the marker to know the implementation
-	 * details of the header.
-	 */
-	void reset()
-	{
-		color = unmarked;
-		contains_pointers = false;
-	}
-	/**
-	 * Return whether the colour is visited.
-	 *
-	 * This method avoids the need for the marker to know the implementation
-	 * details of the header.
+	 * Helper for debugging: dump the header in a human-readable format.
 	 */
-	bool is_visited()
+	void dump()
 	{
-		return color == visited;
+		fprintf(stderr, "Free: %s, layout: %d\n", is_free ? "true" : "false",
+				(int)layout_index);
 	}
 	/**
-	 * Return whether the colour is marked.
-	 *
-	 * This method avoids the need for the marker to know the implementation
-	 * details of the header.
+	 * Returns the layout of the object.
 	 */
-	bool is_marked()
+	gc_layout layout() const
 	{
-		return color == marked;
+		return layout_index;
 	}
 	/**
-	 * Return whether the colour is unmarked.
-	 *
-	 * This method avoids the need for the marker to know the implementation
-	 * details of the header.
+	 * Set the layout of the object.
 	 */
-	bool is_unmarked()
+	void set_layout(gc_layout l)
 	{
-		return color == unmarked;
+		layout_index = l;
 	}
 };
 
@@ -198,10 +124,6 @@ class mark_and_sweep : mark<RootSet, Heap, mark_and_sweep_object_header, skip_fr
 	 * Import the heap from the superclass.
 	 */
 	using Super::h;
-	/**
-	 * Import the mark list from the superclass.
-	 */
-	using Super::mark_list;
 	/**
 	 * Import the `cheri::capability` class.
 	 */
@@ -212,45 +134,134 @@ class mark_and_sweep : mark<RootSet, Heap, mark_and_sweep_object_header, skip_fr
 	using object_header = mark_and_sweep_object_header;
 	static_assert(std::is_same<typename Heap::object_header, object_header>::value,
 			"Heap must insert correct object header");
-	void free_unmarked()
+	static_assert(has_side_mark_bits<Heap>::value,
+			"Heap must keep mark state in side bitmaps");
+	/**
+	 * The number of objects that have been explicitly freed and not yet
+	 * returned to the heap.  If this is zero, the sweep does not need to look
+	 * at any headers.
+	 */
+	std::atomic<size_t> pending_frees;
+	/**
+	 * In generational mode, the number of minor collections that run between
+	 * full collections.
+	 */
+	static const unsigned int minor_collections_per_full = 7;
+	/**
+	 * Is the collector in generational mode?  If so, the sweep keeps the
+	 * marks of the objects that survive it (sticky mark bits), so that they
+	 * are treated as old and are not traced or swept by minor collections.
+	 */
+	bool generational = false;
+	/**
+	 * Did the last sweep keep the marks of the survivors?  If so, they must be
+	 * cleared before a full collection.
+	 */
+	bool marks_kept = false;
+	/**
+	 * While marks are kept, the bytes found live by the last full collection
+	 * plus those found by the minor collections since.  Minor collections do
+	 * not trace these, but the pacer must still count them as live.
+	 */
+	size_t old_bytes = 0;
+	/**
+	 * The number of minor collections since the last full collection.
+	 */
+	unsigned int minor_collections = 0;
+	/**
+	 * The slots in old objects that may hold pointers to young objects,
+	 * recorded by `write_barrier`.
+	 */
+	remembered_set remembered;
+	/**
+	 * Explicitly freed objects that were still reachable when a sweep kept
+	 * the marks.  They are old, so minor collections do not trace them and
+	 * cannot tell whether they are still reachable.  Their `is_free` flag is
+	 * cleared so that minor collections skip them, and set again by the next
+	 * collection that traces the whole heap.  This is only accessed with the
+	 * world stopped.
+	 */
+	std::vector<void*, PageAllocator<void*>> deferred_frees;
+	/**
+	 * Mark the objects in `deferred_frees` as freed again, so that the
+	 * current collection, which traces the whole heap, can return the
+	 * unreachable ones.
+	 */
+	void restore_deferred_frees()
 	{
-		for (auto alloc : h)
+		for (void *obj : deferred_frees)
 		{
-			ASSERT(!alloc.second->is_marked() || alloc.second->is_free);
-			if (alloc.second->is_free)
-			{
-				memset(cheri::set_offset(alloc.first, 0), 0, cheri::length(alloc.first));
-				++free_reachable;
-			}
-			if (alloc.second->is_unmarked())
+			object_header *header = nullptr;
+			h.object_for_allocation(obj, header);
+			if (header && !header->is_free)
 			{
-				h.free(alloc.first);
-			}
-			else
-			{
-				alloc.second->reset();
+				header->is_free = true;
+				pending_frees++;
 			}
 		}
+		deferred_frees.clear();
 	}
-	public:
-	/**
-	 * Import the visited counter from the superclass and make it public.
-	 */
-	using Super::visited;
 	/**
-	 * Counter for the number of free objects that are still reachable.
+	 * Returns true if `ptr` refers to an object that is marked.  Between
+	 * collections in generational mode, these are the objects that have
+	 * survived a collection.
 	 */
-	Counter<> free_reachable;
+	bool is_old(void *ptr)
+	{
+		return h.is_marked(ptr) || h.is_visited(ptr);
+	}
 	/**
-	 * Constructor.
+	 * Start sweeping the heap.  The heap frees the allocations that were not
+	 * reached lazily, as it allocates, so the only work done in the pause is
+	 * to deal with objects that have been explicitly freed.
 	 */
-	mark_and_sweep(Heap &heap) : Super(heap)
+	void free_unmarked()
 	{
+		// Zero explicitly freed objects that are still reachable, and make
+		// sure that unreachable ones don't leave their slot looking freed.
+		size_t still_reachable = 0;
+		if (pending_frees != 0)
+		{
+			h.for_each_allocation([&](const auto &alloc)
+				{
+					object_header *header = alloc.header();
+					if (!header->is_free)
+					{
+						return;
+					}
+					void *obj = alloc.object();
+					if (h.is_marked(obj) || h.is_visited(obj))
+					{
+						memset(cheri::set_offset(obj, 0), 0, cheri::length(obj));
+						++free_reachable;
+						// This sweep keeps the mark, so later minor
+						// collections will not look at this object again.
+						if (generational)
+						{
+							header->is_free = false;
+							deferred_frees.push_back(obj);
+							return;
+						}
+						still_reachable++;
+					}
+					else
+					{
+						header->is_free = false;
+					}
+				});
+		}
+		h.begin_sweep(generational);
+		marks_kept = generational;
+		pending_frees = still_reachable;
 	}
 	/**
-	 * Run the collector.
+	 * Run a collection.  A minor collection traces only from the roots and
+	 * the remembered set, and stops at objects that are still marked from an
+	 * earlier collection, so only the objects allocated since then are traced
+	 * and freed.  A full collection clears the marks first and traces
+	 * everything.
 	 */
-	void collect()
+	void run(bool minor)
 	{
 		visited = 0;
 		free_reachable = 0;
@@ -263,25 +274,133 @@ class mark_and_sweep : mark<RootSet, Heap, mark_and_sweep_object_header, skip_fr
 			return;
 		}
 		m.temporary_roots.clear();
+		// This cycle reuses the mark bits, so finish the last cycle's sweep
+		// while the other threads are still running.
+		late_swept = h.finish_sweep();
 		m.stop_the_world();
 		// FIXME: Other threads, sandboxes
 		m.add_thread(static_cast<void**>(__builtin_cheri_stack_get()));
+		if (minor)
+		{
+			remembered.for_each_slot([&](void **slot)
+				{
+					if (cheri::is_valid(*slot))
+					{
+						m.temporary_roots.emplace_back(slot, *slot);
+					}
+				});
+		}
+		else if (marks_kept)
+		{
+			h.clear_marks();
+		}
+		if (!(minor && marks_kept))
+		{
+			restore_deferred_frees();
+		}
+		// Every object that survives this collection is either unmarked (and
+		// so traced by the next one) or old, so the recorded slots are no
+		// longer needed.
+		remembered.clear();
 		Super::mark_roots();
 		Super::trace();
+		Super::profile_survivors();
+		size_t untraced = (minor && marks_kept) ? old_bytes : 0;
+		Super::pace_next_cycle(untraced);
+		old_bytes = untraced + Super::live_bytes;
 		free_unmarked();
-		ASSERT(mark_list.empty());
+		ASSERT(Super::mark_stacks_empty());
 		m.start_the_world();
 		// FIXME: We should probably zero caller-save capability registers
 		// before returning.
 		_longjmp(jb, 1);
 	}
+	public:
+	/**
+	 * Import the visited counter from the superclass and make it public.
+	 */
+	using Super::visited;
+	/**
+	 * Import the chunk switch counter from the superclass and make it public.
+	 */
+	using Super::chunk_switches;
+	/**
+	 * Counter for the number of free objects that are still reachable.
+	 */
+	Counter<> free_reachable;
+	/**
+	 * Counter for the number of unreachable objects from the previous cycle
+	 * that had not been swept lazily by the time this cycle started.
+	 */
+	Counter<> late_swept;
+	/**
+	 * Constructor.
+	 */
+	mark_and_sweep(Heap &heap) : Super(heap), pending_frees(0)
+	{
+	}
+	/**
+	 * Enable or disable generational mode.  While it is enabled, every store
+	 * of a pointer into a heap object must use `write_barrier`.
+	 */
+	void set_generational(bool enable)
+	{
+		generational = enable;
+		minor_collections = 0;
+	}
+	/**
+	 * Store `value` in `slot`.  In generational mode, if `slot` is in an old
+	 * object and `value` does not point to one, record the slot in the
+	 * remembered set so that the next minor collection finds the pointer.
+	 */
+	void write_barrier(void **slot, void *value)
+	{
+		*slot = value;
+		if (generational && cheri::is_valid(value) && is_old(slot) && !is_old(value))
+		{
+			remembered.record(slot);
+		}
+	}
+	/**
+	 * Run the collector.  In generational mode, this runs
+	 * `minor_collections_per_full` minor collections between each full
+	 * collection.
+	 */
+	void collect()
+	{
+		if (generational && (minor_collections < minor_collections_per_full))
+		{
+			minor_collections++;
+			run(true);
+			return;
+		}
+		collect_full();
+	}
+	/**
+	 * Run a minor collection.  Without generational mode, no marks are kept
+	 * between collections and so this traces the whole heap.
+	 */
+	void collect_minor()
+	{
+		run(true);
+	}
+	/**
+	 * Run a full collection.
+	 */
+	void collect_full()
+	{
+		minor_collections = 0;
+		run(false);
+	}
 	void free(void *obj)
 	{
 		mark_and_sweep_object_header *header = nullptr;
-		h.object_for_allocation(obj, header);
+		void *alloc = h.object_for_allocation(obj, header);
 		if (header)
 		{
 			header->is_free = true;
+			pending_frees++;
+			sampling_heap_profiler.forget(alloc);
 		}
 	}
 };
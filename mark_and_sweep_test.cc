@@ -30,12 +30,14 @@
 
 // Make sure that we don't depend on libc++ being linked.
 #define _LIBCPP_EXTERN_TEMPLATE(...)
+#include <cstddef>
 #include <cstdlib>
 #include <cstdio>
 
 #include "slab_allocator.hh"
 #include "roots.hh"
 #include "mark_and_sweep.hh"
+#include "generational.hh"
 
 /**
  * Testing implementation of a GC.  You should be able to change the
@@ -54,6 +56,14 @@ using heap_type = slab_allocator<mark_and_sweep_object_header>;
  */
 using gc_type = mark_and_sweep<Roots, std::remove_pointer<heap_type>::type>;
 gc_type *gc;
+/**
+ * Generational heap, with a 1MiB nursery in front of a separate slab heap.
+ */
+using young_heap_type = generational_heap<Roots, heap_type, 1_MiB>;
+/**
+ * The generational heap, once the test has created it.
+ */
+young_heap_type *young_heap;
 /**
  * Allocate the heap and return it.  This function should only be called once.
  */
@@ -69,6 +79,7 @@ heap_type *get_heap_once()
 		{
 			gc->collect();
 		};
+	h->set_gc(run_gc);
 	return h;
 }
 /**
@@ -122,6 +133,28 @@ void *GC_malloc(size_t size)
 	return get_heap()->alloc(size);
 }
 
+/**
+ * Public interface to allocate garbage-collected memory that will never hold
+ * pointers.  This is not scanned by the collector and is not zeroed.
+ */
+extern "C"
+void *GC_malloc_atomic(size_t size)
+{
+	allocated++;
+	return get_heap()->alloc_noscan(size);
+}
+
+/**
+ * Public interface to allocate garbage-collected memory for an object whose
+ * pointer fields are described by `layout`.  Only those fields are scanned.
+ */
+extern "C"
+void *GC_malloc_typed(size_t size, gc_layout layout)
+{
+	allocated++;
+	return get_heap()->alloc_typed(size, layout);
+}
+
 /**
  * Public interface to mark garbage-collected memory as free.
  */
@@ -131,6 +164,22 @@ void GC_free(void *ptr)
 	gc->free(ptr);
 }
 
+/**
+ * Public interface to store `value` in `slot`, an object field.  Stores of
+ * pointers into heap objects must go through this write barrier, so that
+ * generational collection can find pointers from old objects to young ones.
+ */
+extern "C"
+void GC_write_barrier(void **slot, void *value)
+{
+	if (young_heap != nullptr)
+	{
+		young_heap->write_barrier(slot, value);
+		return;
+	}
+	gc->write_barrier(slot, value);
+}
+
 /**
  * Public interface to force early garbage collection.
  */
@@ -160,20 +209,56 @@ struct list
 	/**
 	 * Operator new implementation that returns GC'd memory.
 	 */
-	void *operator new(size_t sz)
-	{
-		void *a = GC_malloc(sz);
-		assert(a);
-		assert(cheri::length(a) == sz);
-		//fprintf(stderr, "Allocated %zu bytes: %#p\n", sz, a);
-		return a;
-	}
+	void *operator new(size_t sz);
 	void operator delete(void* ptr)
 	{
 		GC_free(ptr);
 	}
 };
 
+namespace
+{
+/**
+ * Only the `next` field of a list element holds a pointer.
+ */
+template<>
+struct gc_pointer_fields<list> : gc_pointers_at<list, offsetof(list, next)> {};
+}
+
+void *list::operator new(size_t sz)
+{
+	void *a = GC_malloc_typed(sz, gc_layout_of<list>());
+	assert(a);
+	assert(cheri::length(a) == sz);
+	//fprintf(stderr, "Allocated %zu bytes: %#p\n", sz, a);
+	return a;
+}
+
+/**
+ * A pair of lists, only one of which is visible to the collector.
+ */
+struct two_lists
+{
+	/**
+	 * A list that the collector traces.
+	 */
+	list *traced;
+	/**
+	 * A list that is omitted from the layout, so the collector never sees
+	 * this pointer.
+	 */
+	list *hidden;
+};
+
+namespace
+{
+/**
+ * Only the `traced` field of a pair of lists is a pointer to the collector.
+ */
+template<>
+struct gc_pointer_fields<two_lists> : gc_pointers_at<two_lists, offsetof(two_lists, traced)> {};
+}
+
 int main()
 {
 	// Allocate a linked list.
@@ -189,11 +274,15 @@ int main()
 	fprintf(stderr, "Allocated %d objects\n", allocated);
 	// Run the GC, should not find any garbage.
 	GC_collect();
-	fprintf(stderr, "Found %d live objects\n", (int)gc->visited);
+	fprintf(stderr, "Found %d live objects, moving between chunks %d times\n",
+	        (int)gc->visited, (int)gc->chunk_switches);
 	assert(gc->free_reachable == 0);
 	assert(gc->visited == allocated);
 	assert(gc->visited == allocated);
 	assert(val == head->val);
+	// The sweep clears the side mark bits, ready for the next collection.
+	get_heap()->finish_sweep();
+	assert(!get_heap()->is_marked(head) && !get_heap()->is_visited(head));
 	// Shorten the list
 	fprintf(stderr, "Truncating list!\n");
 	head->next->next->next->next = nullptr;
@@ -227,4 +316,73 @@ int main()
 	assert(val == head->val);
 	// Freed object should have been zeroed during GC.
 	assert(head->next->next == nullptr);
+	// Pointer-free objects are marked, but not scanned, so a list element
+	// that is only referred to by one is not reached.
+	void **blob = static_cast<void**>(GC_malloc_atomic(4 * sizeof(void*)));
+	assert(get_heap()->is_noscan(blob));
+	blob[0] = new list(42);
+	clear_regs();
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	GC_collect();
+	fprintf(stderr, "Found %d live objects\n", (int)gc->visited);
+	assert(gc->visited == 2);
+	assert(get_heap()->is_noscan(blob));
+	// Typed objects are scanned only at the offsets in their layout.
+	auto *pair = static_cast<two_lists*>(GC_malloc_typed(sizeof(two_lists), gc_layout_of<two_lists>()));
+	pair->traced = new list(1);
+	pair->hidden = new list(2);
+	clear_regs();
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	GC_collect();
+	fprintf(stderr, "Found %d live objects\n", (int)gc->visited);
+	// The head, the pointer-free object, the pair and its traced list.
+	assert(gc->visited == 4);
+	// In generational mode, the survivors of a collection stay marked, so a
+	// minor collection traces only the objects allocated since, found from
+	// the roots and from the slots recorded by the write barrier.
+	gc->set_generational(true);
+	gc->collect_full();
+	assert(gc->visited == 4);
+	list *fresh = new list(5);
+	gc->write_barrier(reinterpret_cast<void**>(&pair->traced->next), fresh);
+	fresh = nullptr;
+	clear_regs();
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	gc->collect_minor();
+	fprintf(stderr, "Minor collection found %d young objects\n", (int)gc->visited);
+	assert(gc->visited == 1);
+	get_heap()->finish_sweep();
+	assert(get_heap()->is_visited(pair->traced));
+	assert(pair->traced->next->val == 5);
+	// A full collection traces everything again.
+	gc->collect_full();
+	assert(gc->visited == 5);
+	gc->set_generational(false);
+	// A generational heap, with a separate slab heap as its old generation,
+	// promotes a nursery object that is reachable only from an old object,
+	// through the card dirtied by the write barrier.
+	auto *old_heap = new heap_type();
+	PageAllocator<gc_type> a;
+	auto *old_gc = new (a.allocate(sizeof(gc_type))) gc_type(*old_heap);
+	auto *young = young_heap_type::create(*old_heap);
+	young_heap = young;
+	auto run_major = [=]()
+		{
+			old_gc->collect();
+		};
+	young->set_gc(run_major);
+	// Objects of a page or more are allocated directly in the old generation.
+	auto **holder = static_cast<list**>(young->alloc(page_size));
+	assert(!young->in_nursery(holder));
+	list *young_list = ::new (young->alloc_typed(sizeof(list), gc_layout_of<list>())) list(7);
+	assert(young->in_nursery(young_list));
+	GC_write_barrier(reinterpret_cast<void**>(holder), young_list);
+	young_list = nullptr;
+	clear_regs();
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	young->minor_collect();
+	fprintf(stderr, "Promoted %d objects\n", (int)young->promoted);
+	assert(young->promoted == 1);
+	assert(!young->in_nursery(*holder));
+	assert((*holder)->val == 7);
 }
@@ -0,0 +1,285 @@
+/*-
+ * Copyright (c) 2017 David T Chisnall
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+#include <atomic>
+#include <stdlib.h>
+#include "utils.hh"
+#include "page.hh"
+#include "lock.hh"
+
+namespace {
+
+/**
+ * A fixed-size, page-allocated block of mark stack entries.  Segments are
+ * chained to form a `segmented_mark_stack` and are recycled through the
+ * `mark_stack_segment_pool`.
+ */
+struct mark_stack_segment
+{
+	/**
+	 * The size of each segment, in bytes.
+	 */
+	static const size_t size = 64 * 1024;
+	/**
+	 * The number of entries in each segment.  Two entries' worth of space is
+	 * reserved for the other fields.
+	 */
+	static const size_t capacity = size / sizeof(void*) - 2;
+	/**
+	 * The next segment in the stack or in the pool's free list.
+	 */
+	mark_stack_segment *next;
+	/**
+	 * The number of valid entries.
+	 */
+	size_t count;
+	/**
+	 * The entries.
+	 */
+	void *entries[capacity];
+};
+static_assert(sizeof(mark_stack_segment) <= mark_stack_segment::size,
+              "Mark stack segment is too large");
+
+/**
+ * Pool of mark stack segments.  Segments are mapped on demand, up to a limit,
+ * and are kept for reuse when they are released, so the memory used for mark
+ * stacks is bounded and steady-state collections do not map any.
+ *
+ * The limit is read from the `GC_MARK_STACK_LIMIT` environment variable (in
+ * bytes) and can be changed at run time.  When the limit is reached,
+ * `acquire` fails and the collector falls back to rescanning (see `mark`).
+ */
+class mark_stack_segment_pool
+{
+	/**
+	 * The default limit on the memory used for segments.
+	 */
+	static const size_t default_limit = 64 * 1024 * 1024;
+	/**
+	 * Lock protecting the free list and counts.
+	 */
+	UncontendedSpinlock<long> lock;
+	/**
+	 * Segments that are not in use.
+	 */
+	mark_stack_segment *free_list;
+	/**
+	 * The number of segments that have been mapped.
+	 */
+	size_t mapped;
+	/**
+	 * The maximum number of segments that may be mapped.
+	 */
+	size_t limit;
+	/**
+	 * Whether the environment has been read.  Protected by `lock`.
+	 */
+	bool initialised;
+	/**
+	 * Read the configuration from the environment, if that has not already
+	 * been done.  Must be called with `lock` held.
+	 */
+	void initialise()
+	{
+		if (initialised)
+		{
+			return;
+		}
+		const char *env = getenv("GC_MARK_STACK_LIMIT");
+		size_t bytes = env ? strtoull(env, nullptr, 0) : default_limit;
+		limit = bytes / mark_stack_segment::size;
+		initialised = true;
+	}
+	public:
+	/**
+	 * Returns an empty segment, or `nullptr` if the limit has been reached.
+	 */
+	mark_stack_segment *acquire()
+	{
+		mark_stack_segment *s = nullptr;
+		run_locked(lock, [&]()
+			{
+				initialise();
+				if (free_list != nullptr)
+				{
+					s = free_list;
+					free_list = s->next;
+					return;
+				}
+				if (mapped >= limit)
+				{
+					return;
+				}
+				s = reinterpret_cast<mark_stack_segment*>(
+					PageAllocator<char>().allocate(mark_stack_segment::size));
+				if (s != nullptr)
+				{
+					mapped++;
+				}
+			});
+		if (s != nullptr)
+		{
+			s->next = nullptr;
+			s->count = 0;
+		}
+		return s;
+	}
+	/**
+	 * Return a segment to the pool.
+	 */
+	void release(mark_stack_segment *s)
+	{
+		run_locked(lock, [&]()
+			{
+				s->next = free_list;
+				free_list = s;
+			});
+	}
+	/**
+	 * Set the limit on the memory used for segments, in bytes.  Segments that
+	 * have already been mapped are kept.
+	 */
+	void set_limit(size_t bytes)
+	{
+		run_locked(lock, [&]()
+			{
+				initialise();
+				limit = bytes / mark_stack_segment::size;
+			});
+	}
+};
+
+/**
+ * The pool shared by all mark stacks.
+ */
+mark_stack_segment_pool mark_stack_segments;
+
+/**
+ * A LIFO stack built from segments taken from `mark_stack_segments`.  Growing
+ * the stack never copies entries, and segments are returned to the pool as
+ * soon as they are empty (except for one, which is kept as a spare).  Only
+ * one thread may push or pop.
+ */
+class segmented_mark_stack
+{
+	/**
+	 * The segment containing the top of the stack, or `nullptr` if the stack
+	 * is empty.
+	 */
+	mark_stack_segment *top = nullptr;
+	/**
+	 * An empty segment kept back from the pool, so that a stack that
+	 * repeatedly crosses a segment boundary doesn't take the pool's lock each
+	 * time.
+	 */
+	mark_stack_segment *spare = nullptr;
+	/**
+	 * The number of entries.  Written only by the owner, but may be read by
+	 * other threads as a hint.
+	 */
+	std::atomic<size_t> entries;
+	public:
+	/**
+	 * Push a value.  Returns false if the stack needed a new segment and the
+	 * pool could not provide one.
+	 */
+	bool push(void *p)
+	{
+		if ((top == nullptr) || (top->count == mark_stack_segment::capacity))
+		{
+			mark_stack_segment *s = spare;
+			spare = nullptr;
+			if (s == nullptr)
+			{
+				s = mark_stack_segments.acquire();
+			}
+			if (s == nullptr)
+			{
+				return false;
+			}
+			s->count = 0;
+			s->next = top;
+			top = s;
+		}
+		top->entries[top->count++] = p;
+		entries.store(entries.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return true;
+	}
+	/**
+	 * Pop the most recently pushed value.  Returns false if the stack is
+	 * empty.
+	 */
+	bool pop(void *&p)
+	{
+		if (top == nullptr)
+		{
+			return false;
+		}
+		p = top->entries[--top->count];
+		if (top->count == 0)
+		{
+			mark_stack_segment *s = top;
+			top = s->next;
+			if (spare == nullptr)
+			{
+				spare = s;
+			}
+			else
+			{
+				mark_stack_segments.release(s);
+			}
+		}
+		entries.store(entries.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		return true;
+	}
+	/**
+	 * Return the spare segment, if any, to the pool.
+	 */
+	void release_spare()
+	{
+		if (spare != nullptr)
+		{
+			mark_stack_segments.release(spare);
+			spare = nullptr;
+		}
+	}
+	/**
+	 * Returns true if the stack appears to be empty.  This is exact when
+	 * called by the owner.
+	 */
+	bool empty_hint()
+	{
+		return entries.load(std::memory_order_relaxed) == 0;
+	}
+};
+
+} // Anonymous namespace
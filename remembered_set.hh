@@ -0,0 +1,203 @@
+/*-
+ * Copyright (c) 2017 David T Chisnall
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <pthread.h>
+#include "utils.hh"
+#include "page.hh"
+
+namespace {
+
+/**
+ * Per-thread state for the remembered set.  This is plain data so that it can
+ * live in thread-local storage without any C++ runtime support for
+ * thread-local constructors or destructors.
+ */
+struct remembered_set_thread_state
+{
+	/**
+	 * The remembered set that `buffer` belongs to, or `nullptr` if this
+	 * thread has not yet recorded a slot.
+	 */
+	const void *owner;
+	/**
+	 * This thread's store buffer in `owner`.
+	 */
+	void *buffer;
+};
+
+/**
+ * The remembered set state for the current thread.
+ */
+thread_local remembered_set_thread_state remembered_set_thread;
+
+/**
+ * A remembered set, recording the slots in old objects that may hold pointers
+ * to young objects.  The write barrier adds slots with `record` and a minor
+ * collection treats the values in the recorded slots as roots.
+ *
+ * Each thread appends to its own sequential store buffer, so recording a slot
+ * does not touch shared state in the common case.  When a thread's buffer
+ * fills, the thread moves on to another of its buffers that has space, or
+ * publishes a new one.  Every buffer is on a single list that is only walked
+ * and reset with the world stopped, so no lock is needed and no slot is seen
+ * twice.  The buffers are page allocated and never freed.  A buffer is
+ * identified by the thread that created it, so a new thread that is given the
+ * identifier of one that has exited reuses its buffers.
+ */
+class remembered_set
+{
+	/**
+	 * A sequential store buffer, filled by a single thread.
+	 */
+	struct store_buffer
+	{
+		/**
+		 * The number of slots that fit in a page with the other fields.
+		 */
+		static const size_t capacity = (page_size / sizeof(void*)) - 4;
+		/**
+		 * The next buffer in the list of all buffers.
+		 */
+		store_buffer *next;
+		/**
+		 * The thread that fills this buffer.
+		 */
+		pthread_t thread;
+		/**
+		 * The number of slots recorded in this buffer.
+		 */
+		size_t count;
+		/**
+		 * The recorded slots.
+		 */
+		std::array<void**, capacity> slots;
+	};
+	static_assert(sizeof(store_buffer) <= page_size,
+	              "Store buffer should fit in a page");
+	/**
+	 * List of every buffer that has been created.
+	 */
+	std::atomic<store_buffer*> buffers;
+	/**
+	 * Returns the store buffer for the calling thread.  This is the one that
+	 * it used last, unless that is full, in which case it is another buffer
+	 * owned by this thread that has space or, if there is none, a new one.
+	 */
+	store_buffer *thread_buffer()
+	{
+		remembered_set_thread_state &t = remembered_set_thread;
+		if (t.owner == this)
+		{
+			store_buffer *b = static_cast<store_buffer*>(t.buffer);
+			if (b->count < store_buffer::capacity)
+			{
+				return b;
+			}
+		}
+		pthread_t self = pthread_self();
+		store_buffer *b;
+		for (b = buffers.load(std::memory_order_acquire) ; b != nullptr ; b = b->next)
+		{
+			if (pthread_equal(b->thread, self) &&
+			    (b->count < store_buffer::capacity))
+			{
+				break;
+			}
+		}
+		if (b == nullptr)
+		{
+			// Page allocated, so `count` starts at zero.
+			b = PageAllocator<store_buffer>().allocate(1);
+			ASSERT(b);
+			b->thread = self;
+			store_buffer *old = buffers.load(std::memory_order_relaxed);
+			do
+			{
+				b->next = old;
+			} while (!buffers.compare_exchange_weak(old, b, std::memory_order_release));
+		}
+		t.owner = this;
+		t.buffer = b;
+		return b;
+	}
+	public:
+	/**
+	 * Constructor.
+	 */
+	remembered_set() : buffers(nullptr) {}
+	/**
+	 * Record that `slot` may hold a pointer from an old object to a young
+	 * one.
+	 */
+	void record(void **slot)
+	{
+		store_buffer *b = thread_buffer();
+		// Loops often store to the same slot repeatedly.
+		if ((b->count > 0) && (b->slots[b->count - 1] == slot))
+		{
+			return;
+		}
+		// Store the slot before publishing it, so that a thread stopped
+		// between the two never exposes a stale entry.
+		b->slots[b->count] = slot;
+		b->count++;
+	}
+	/**
+	 * Call `fn` with each recorded slot.  This must be called with the world
+	 * stopped.
+	 */
+	template<typename Fn>
+	void for_each_slot(Fn &&fn)
+	{
+		for (store_buffer *b = buffers.load(std::memory_order_acquire) ; b != nullptr ; b = b->next)
+		{
+			for (size_t i=0 ; i<b->count ; i++)
+			{
+				fn(b->slots[i]);
+			}
+		}
+	}
+	/**
+	 * Forget every recorded slot.  This must be called with the world
+	 * stopped.
+	 */
+	void clear()
+	{
+		for (store_buffer *b = buffers.load(std::memory_order_acquire) ; b != nullptr ; b = b->next)
+		{
+			b->count = 0;
+		}
+	}
+};
+
+} // Anonymous namespace
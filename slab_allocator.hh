@@ -34,6 +34,11 @@
 #include "page.hh"
 #include "BitSet.hh"
 #include "bucket_size.hh"
+#include "heap_profiler.hh"
+#include "gc_thread_pool.hh"
+#include "gc_pacer.hh"
+#include "nonstd_function.hh"
+#include "gc_layout.hh"
 #include <stdio.h>
 #include <bitset>
 #include <memory>
@@ -174,18 +179,115 @@ struct allocator_fast_iterator
 
 };
 
+/**
+ * The per-allocation bits that the collector keeps in chunk metadata.  The
+ * first two correspond to the colours in a header-based collector: an object
+ * with neither bit set is unmarked, one with only `mark_bit` set is marked
+ * (grey) and one with `visited_bit` set has been scanned.  These are cleared
+ * after each collection, unless the collector asks the sweep to keep the marks
+ * of the survivors (see `slab_allocator::begin_sweep`).
+ */
+enum side_mark_bit
+{
+	/// The object has been reached, but may not have been scanned.
+	mark_bit = 0,
+	/// The object has been scanned.
+	visited_bit = 1,
+	/// The allocation was made with `alloc_noscan` and so holds no pointers.
+	/// Its memory is not zeroed when it is freed, so this remains set on a
+	/// free slot until the slot is zeroed for an allocation that may hold
+	/// pointers.  This persists across collections.
+	noscan_bit = 2
+};
+
 /**
  * Interface for allocators.  This provides a generic interface for all allocators.
  */
 template<typename Header>
 struct Allocator
 {
+	/**
+	 * The next allocator in the list of allocators for the same bucket that
+	 * may have free space.
+	 */
 	std::atomic<Allocator<Header>*> next;
+	/**
+	 * The next allocator in the list of all fixed-size allocators.  Unlike
+	 * `next`, this link is never changed once set, so this list includes full
+	 * allocators.
+	 */
+	std::atomic<Allocator<Header>*> next_chunk;
+	/**
+	 * The most recent sweep epoch (see `Buckets::sweep_epoch`) for which this
+	 * allocator has been swept.
+	 */
+	std::atomic<unsigned int> swept_epoch;
+	/**
+	 * The most recent sweep epoch for which a thread has started sweeping
+	 * this allocator.  This is ahead of `swept_epoch` while the sweep is in
+	 * progress.
+	 */
+	std::atomic<unsigned int> sweep_started;
+	/**
+	 * Set while this allocator is in the list for its bucket.  It is removed
+	 * from that list when it is found to be full and put back when a sweep
+	 * or a free makes space in it.
+	 */
+	std::atomic<bool> linked;
+	/**
+	 * Free every allocation that the last mark did not reach and clear the
+	 * marks.  If `keep_marks` is true, the marks of the surviving allocations
+	 * are kept.  `was_full` is set to whether the allocator was full before
+	 * the sweep, so that the caller can make it available for allocation
+	 * again if it frees anything.  Returns the number of allocations freed.
+	 */
+	virtual size_t sweep(bool, bool &was_full)
+	{
+		was_full = false;
+		return 0;
+	}
+	/**
+	 * Clear the marks of every allocation.
+	 */
+	virtual void clear_marks() {}
+	/**
+	 * Sweep this allocator if it has not yet been swept for `epoch`.  If
+	 * another thread is sweeping it, wait for that thread to finish.  On
+	 * return, it is safe to allocate from this allocator.  Returns the number
+	 * of allocations that this call freed, which is zero if another thread
+	 * did the sweep, and sets `was_full` to whether the allocator was full
+	 * before this call swept it.
+	 */
+	size_t ensure_swept(unsigned int epoch, bool keep_marks, bool &was_full)
+	{
+		was_full = false;
+		if (swept_epoch.load(std::memory_order_acquire) >= epoch)
+		{
+			return 0;
+		}
+		unsigned int started = sweep_started.load(std::memory_order_relaxed);
+		if ((started < epoch) && sweep_started.compare_exchange_strong(started, epoch))
+		{
+			size_t freed = sweep(keep_marks, was_full);
+			swept_epoch.store(epoch, std::memory_order_release);
+			return freed;
+		}
+		while (swept_epoch.load(std::memory_order_acquire) < epoch)
+		{
+			sched_yield();
+		}
+		return 0;
+	}
 	/**
 	 * Allocate an object of the specified size.  For small allocations, this
 	 * will always return the fixed size that the allocator can handle.
 	 */
 	virtual void *alloc(size_t) { return nullptr; }
+	/**
+	 * Allocate an object that will never hold pointers.  The collector does
+	 * not scan these objects and their memory is not zeroed.
+	 */
+	virtual void *alloc_noscan(size_t sz) { return alloc(sz); }
 	/**
 	 * Returns the size of allocations from this pool, or zero if this is not a
 	 * fixed-size allocator.
@@ -216,11 +318,31 @@ struct Allocator
 	 * but rather the bounds of a fixed-size allocation.
 	 */
 	virtual void *allocation_for_address(vaddr_t, Header *&) { return nullptr; }
+	/**
+	 * Set the specified mark bit for the allocation containing the address
+	 * and return its previous value.
+	 */
+	virtual bool test_and_set_mark_bit(vaddr_t, side_mark_bit) { return true; }
+	/**
+	 * Returns the specified mark bit for the allocation containing the
+	 * address.
+	 */
+	virtual bool test_mark_bit(vaddr_t, side_mark_bit) { return false; }
+	/**
+	 * Prefetch the specified mark bit for the allocation containing the
+	 * address, so that a later `test_and_set_mark_bit` does not miss.
+	 */
+	virtual void prefetch_mark_bit(vaddr_t, side_mark_bit) {}
 	/**
 	 * Fill the provided fast iteration state.  The index in the state should
 	 * be updated.
 	 */
 	virtual void fill_fast_iterator(allocator_fast_iterator<Header> &) {}
+	/**
+	 * Returns the length of the address range managed by this allocator.
+	 * This is always a multiple of `chunk_size`.
+	 */
+	virtual size_t chunk_length() { return chunk_size; }
 };
 
 /**
@@ -256,6 +378,10 @@ struct HeaderList<Header, Size, typename std::enable_if<std::is_void<Header>::va
 	{
 		return nullptr;
 	}
+	/**
+	 * There are no headers to reset.
+	 */
+	void reset(size_t) {}
 };
 /**
  * Template specialisation for non-`void` header types.
@@ -276,12 +402,159 @@ struct HeaderList<Header, Size, typename std::enable_if<!std::is_void<Header>::v
 		h.set_bounds(1);
 		return h.get();
 	}
+	/**
+	 * Reset the header at the specified index to its initial state.
+	 */
+	void reset(size_t idx)
+	{
+		array[idx] = Header();
+	}
 };
 
 // Compile-time check that the header list doesn't use any space when the
 // header type is void.
 static_assert(sizeof(HeaderList<void, 100>) == 0, "Compiler has odd ABI!\n");
 
+/**
+ * Template for storing the collector's mark state for `Size` allocations, or
+ * nothing if the header type is void (and so nothing is collected).  Mark
+ * state is kept in bitmaps beside the allocation bitmaps, rather than in the
+ * object headers, so marking never writes to header or object pages and
+ * clearing the marks after a collection is a bulk zero.
+ */
+template<typename Header, size_t Size, class Enable = void>
+struct MarkBits {};
+/**
+ * Template specialisation with a void header type.  This has a size of zero,
+ * never records a mark, and reports every bit as clear.
+ */
+template<typename Header, size_t Size>
+struct MarkBits<Header, Size, typename std::enable_if<std::is_void<Header>::value>::type>
+{
+	/**
+	 * Zero-length array, so that this has a size of zero.
+	 */
+	int unused[0];
+	/**
+	 * Do nothing and report that the bit was already set, so that no object
+	 * is ever claimed.
+	 */
+	bool test_and_set(size_t, side_mark_bit)
+	{
+		return true;
+	}
+	/**
+	 * Report that the bit is clear.
+	 */
+	bool test(size_t, side_mark_bit) const
+	{
+		return false;
+	}
+	/**
+	 * Nothing to prefetch.
+	 */
+	void prefetch(size_t, side_mark_bit) const {}
+	/**
+	 * Do nothing.
+	 */
+	void assign(size_t, side_mark_bit, bool) {}
+	/**
+	 * Nothing to clear.
+	 */
+	void clear() {}
+	/**
+	 * Nothing to clear.
+	 */
+	template<typename Allocated>
+	void retain(const Allocated &) {}
+	/**
+	 * Without any mark state, nothing can be shown to be unreachable, so
+	 * treat every allocation as reached.
+	 */
+	void remove_marked(BitSet<Size> &allocated) const
+	{
+		allocated.clear_range(0, Size);
+	}
+};
+/**
+ * Template specialisation for non-`void` header types.
+ */
+template<typename Header, size_t Size>
+struct MarkBits<Header, Size, typename std::enable_if<!std::is_void<Header>::value>::type>
+{
+	/**
+	 * One bitmap for each `side_mark_bit`.  These are atomic so that the
+	 * parallel markers can claim an object with a single atomic OR.
+	 */
+	std::array<BitSet<Size, true>, 3> bits;
+	/**
+	 * Set bit `b` for allocation `idx` and return its previous value.
+	 */
+	bool test_and_set(size_t idx, side_mark_bit b)
+	{
+		return bits[b].test_and_set(idx);
+	}
+	/**
+	 * Return bit `b` for allocation `idx`.
+	 */
+	bool test(size_t idx, side_mark_bit b) const
+	{
+		return bits[b][idx];
+	}
+	/**
+	 * Prefetch the word holding bit `b` for allocation `idx`.
+	 */
+	void prefetch(size_t idx, side_mark_bit b) const
+	{
+		bits[b].prefetch(idx);
+	}
+	/**
+	 * Set bit `b` for allocation `idx` to `value`.
+	 */
+	void assign(size_t idx, side_mark_bit b, bool value)
+	{
+		if (value)
+		{
+			bits[b].set(idx);
+		}
+		else
+		{
+			bits[b].clear(idx);
+		}
+	}
+	/**
+	 * Clear every mark.  The `noscan_bit`s are not marks and are kept.
+	 */
+	void clear()
+	{
+		bits[mark_bit].clear_range(0, Size);
+		bits[visited_bit].clear_range(0, Size);
+	}
+	/**
+	 * Clear the marks of every slot that is not set in `allocated`, keeping
+	 * those of the allocated slots.  The `noscan_bit`s are kept.
+	 */
+	template<typename Allocated>
+	void retain(const Allocated &allocated)
+	{
+		bits[mark_bit] &= allocated;
+		bits[visited_bit] &= allocated;
+	}
+	/**
+	 * Clear the bits in `allocated` for every allocation that has been
+	 * reached, a word at a time, leaving the unreachable allocations.  Every
+	 * object is marked before it is visited, so this uses only `mark_bit`.
+	 */
+	void remove_marked(BitSet<Size> &allocated) const
+	{
+		allocated.and_not(bits[mark_bit]);
+	}
+};
+
+// Compile-time check that the mark bits don't use any space when the header
+// type is void.
+static_assert(sizeof(MarkBits<void, 100>) == 0, "Compiler has odd ABI!\n");
+
 /**
  * The small allocation header.  This contains all of the metadata for a small
  * allocator, but not the memory that will be allocated.
@@ -318,6 +591,10 @@ class SmallAllocationHeader
 	 * The total number of allocations per chunk.
 	 */
 	static const int allocs_per_chunk = allocs_per_folio * folios_per_chunk;
+	/**
+	 * The size of the chunk that this header manages.
+	 */
+	static const size_t chunk_bytes = ChunkSize;
 	/**
 	 * Lock protecting this allocator.
 	 */
@@ -364,6 +641,10 @@ class SmallAllocationHeader
 		 * something similar.
 		 */
 		BitSet<allocs_per_folio> free;
+		/**
+		 * The collector's mark state for the allocations in this folio.
+		 */
+		MarkBits<Header, allocs_per_folio> marks;
 	};
 	/**
 	 * All of the folio metadata.
@@ -475,12 +756,13 @@ class SmallAllocationHeader
 				// policy (note that this will also have to be done with
 				// caching)
 				insert_list_entry(folio_idx);
-				free_allocs_total--;
-				if (l.free_count == alloc_in_folio)
+				free_allocs_total++;
+				// If the folio is now empty, return its pages to the OS.
+				if (l.free_count == allocs_per_folio)
 				{
 					cheri::capability<void> folio_pages(reinterpret_cast<void*>(this));
-					folio_pages.set_offset(offset);
-					folio_pages.set_bounds(AllocSize * allocs_per_folio);
+					folio_pages.set_offset(folio_idx * folio_size);
+					folio_pages.set_bounds(folio_size);
 					zero_pages(folio_pages);
 				}
 			}));
@@ -578,6 +860,171 @@ class SmallAllocationHeader
 		}
 		free_lists[l.free_count] = folio_idx;
 	}
+	/**
+	 * Call `fn` with the index of each allocated slot at or after `first`, in
+	 * address order.  Folios with no allocations are skipped without
+	 * inspecting their bitmaps.
+	 */
+	template<typename Fn>
+	void for_each_allocated_index(size_t first, Fn &&fn)
+	{
+		for (size_t folio_idx=first/allocs_per_folio ; folio_idx<folios_per_chunk ; folio_idx++)
+		{
+			folio &f = folios[folio_idx];
+			if (f.free_count == allocs_per_folio)
+			{
+				continue;
+			}
+			size_t base = folio_idx * allocs_per_folio;
+			f.free.for_each_set_bit([&](size_t i)
+				{
+					fn(base + i);
+				}, (first > base) ? first - base : 0);
+		}
+	}
+	/**
+	 * Set mark bit `b` for the allocation at index `idx` and return its
+	 * previous value.
+	 */
+	bool test_and_set_mark_bit_at_index(size_t idx, side_mark_bit b)
+	{
+		return folios[idx / allocs_per_folio].marks.test_and_set(idx % allocs_per_folio, b);
+	}
+	/**
+	 * Returns mark bit `b` for the allocation at index `idx`.
+	 */
+	bool test_mark_bit_at_index(size_t idx, side_mark_bit b)
+	{
+		return folios[idx / allocs_per_folio].marks.test(idx % allocs_per_folio, b);
+	}
+	/**
+	 * Prefetch mark bit `b` for the allocation at index `idx`.
+	 */
+	void prefetch_mark_bit_at_index(size_t idx, side_mark_bit b)
+	{
+		folios[idx / allocs_per_folio].marks.prefetch(idx % allocs_per_folio, b);
+	}
+	/**
+	 * Set mark bit `b` for the allocation at index `idx` to `value`.
+	 */
+	void assign_mark_bit_at_index(size_t idx, side_mark_bit b, bool value)
+	{
+		folios[idx / allocs_per_folio].marks.assign(idx % allocs_per_folio, b, value);
+	}
+	/**
+	 * Call `fn` with the index of each allocated slot at or after `first`
+	 * that was not reached by the last mark, in address order, and clear all
+	 * of the marks.  Each folio's unreachable allocations are found a word at
+	 * a time as `allocated & ~marked`.  `fn` may free the allocation.
+	 */
+	template<typename Fn>
+	void for_each_unmarked_index(size_t first, Fn &&fn)
+	{
+		for (size_t folio_idx=first/allocs_per_folio ; folio_idx<folios_per_chunk ; folio_idx++)
+		{
+			folio &f = folios[folio_idx];
+			// Conservative pointers may have marked free slots, so every
+			// folio's marks are cleared, even if it has no allocations.
+			if (f.free_count == allocs_per_folio)
+			{
+				f.marks.clear();
+				continue;
+			}
+			size_t base = folio_idx * allocs_per_folio;
+			BitSet<allocs_per_folio> dead(f.free);
+			f.marks.remove_marked(dead);
+			f.marks.clear();
+			dead.for_each_set_bit([&](size_t i)
+				{
+					fn(base + i);
+				}, (first > base) ? first - base : 0);
+		}
+	}
+	/**
+	 * Clear the marks of every slot.
+	 */
+	void clear_marks()
+	{
+		for (folio &f : folios)
+		{
+			f.marks.clear();
+		}
+	}
+	/**
+	 * Free every allocated slot at or after `first` that was not reached by
+	 * the last mark, and clear the marks.  This has the same effect as
+	 * calling `free_allocation` for each unreachable slot, but takes the lock
+	 * once for the whole chunk, releases each folio's slots a word at a time
+	 * and moves each folio between free lists at most once.  If `keep_marks`
+	 * is true, the marks of the slots that remain allocated are kept.
+	 *
+	 * `scrub(idx, returned)` is called with the lock held for each slot before
+	 * it is released.  `returned` is true if the slot's folio is about to be
+	 * returned to the OS, in which case the slot's memory does not need to be
+	 * zeroed.  `was_full` is set, with the lock held, to whether the chunk
+	 * had no free slots before the sweep.  Returns the number of slots freed.
+	 */
+	template<typename Fn>
+	size_t free_unmarked(size_t first, bool keep_marks, bool &was_full, Fn &&scrub)
+	{
+		size_t freed = 0;
+		do {} while (!try_run_locked(lock, [&]()
+			{
+				was_full = (free_allocs_total == 0);
+				for (size_t folio_idx=first/allocs_per_folio ; folio_idx<folios_per_chunk ; folio_idx++)
+				{
+					folio &f = folios[folio_idx];
+					if (f.free_count == allocs_per_folio)
+					{
+						f.marks.clear();
+						continue;
+					}
+					size_t base = folio_idx * allocs_per_folio;
+					BitSet<allocs_per_folio> dead(f.free);
+					f.marks.remove_marked(dead);
+					// Conservative pointers may have marked free slots, so
+					// only the marks of allocated slots are kept.  Dead slots
+					// have no marks, so this can be done before they are
+					// released.
+					if (keep_marks)
+					{
+						f.marks.retain(f.free);
+					}
+					else
+					{
+						f.marks.clear();
+					}
+					if (first > base)
+					{
+						dead.clear_range(0, first - base);
+					}
+					if (dead.empty())
+					{
+						continue;
+					}
+					size_t count = dead.popcount();
+					bool returned = (f.free_count + count == allocs_per_folio);
+					dead.for_each_set_bit([&](size_t i)
+						{
+							scrub(base + i, returned);
+						});
+					remove_list_entry(folio_idx);
+					f.free.and_not(dead);
+					f.free_count += count;
+					insert_list_entry(folio_idx);
+					free_allocs_total += count;
+					freed += count;
+					if (returned)
+					{
+						cheri::capability<void> folio_pages(reinterpret_cast<void*>(this));
+						folio_pages.set_offset(folio_idx * folio_size);
+						folio_pages.set_bounds(folio_size);
+						zero_pages(folio_pages);
+					}
+				}
+			}));
+		return freed;
+	}
 	template<size_t sz>
 	size_t allocations(std::array<size_t, sz> &vals, size_t start)
 	{
@@ -598,16 +1045,13 @@ class SmallAllocationHeader
 				continue;
 			}
 			// Find each set bit in the bitmap
-			for (int i=start_idx ; i<allocs_per_folio ; i=f.free.one_after(i))
+			for (size_t i=f.free.first_set(start_idx) ; i<allocs_per_folio ; i=f.free.one_after(i))
 			{
 				if (written == sz)
 				{
 					return written;
 				}
-				if (f.free[i])
-				{
-					vals.at(written++) = out_idx + i;
-				}
+				vals.at(written++) = out_idx + i;
 			}
 		}
 		return written;
@@ -626,6 +1070,14 @@ class LargeAllocationHeader
 	 * The number of allocations in each folio.
 	 */
 	static const size_t allocs_per_chunk = ChunkSize / AllocSize;
+	/**
+	 * Each large allocation is a run of pages and is treated as its own folio.
+	 */
+	static const size_t folio_size = AllocSize;
+	/**
+	 * The size of the chunk that this header manages.
+	 */
+	static const size_t chunk_bytes = ChunkSize;
 	/**
 	 * Lock protecting this allocator.
 	 */
@@ -638,6 +1090,10 @@ class LargeAllocationHeader
 	 * something similar.
 	 */
 	BitSet<allocs_per_chunk> free;
+	/**
+	 * The collector's mark state for the allocations in this chunk.
+	 */
+	MarkBits<Header, allocs_per_chunk> marks;
 	/**
 	 * List of headers.
 	 */
@@ -711,21 +1167,118 @@ class LargeAllocationHeader
 			}));
 		return offset * AllocSize;
 	}
+	/**
+	 * Call `fn` with the index of each allocated slot at or after `first`, in
+	 * address order.
+	 */
+	template<typename Fn>
+	void for_each_allocated_index(size_t first, Fn &&fn)
+	{
+		free.for_each_set_bit(fn, first);
+	}
+	/**
+	 * Set mark bit `b` for the allocation at index `idx` and return its
+	 * previous value.
+	 */
+	bool test_and_set_mark_bit_at_index(size_t idx, side_mark_bit b)
+	{
+		return marks.test_and_set(idx, b);
+	}
+	/**
+	 * Returns mark bit `b` for the allocation at index `idx`.
+	 */
+	bool test_mark_bit_at_index(size_t idx, side_mark_bit b)
+	{
+		return marks.test(idx, b);
+	}
+	/**
+	 * Prefetch mark bit `b` for the allocation at index `idx`.
+	 */
+	void prefetch_mark_bit_at_index(size_t idx, side_mark_bit b)
+	{
+		marks.prefetch(idx, b);
+	}
+	/**
+	 * Set mark bit `b` for the allocation at index `idx` to `value`.
+	 */
+	void assign_mark_bit_at_index(size_t idx, side_mark_bit b, bool value)
+	{
+		marks.assign(idx, b, value);
+	}
+	/**
+	 * Call `fn` with the index of each allocated slot at or after `first`
+	 * that was not reached by the last mark, in address order, and clear all
+	 * of the marks.  `fn` may free the allocation.
+	 */
+	template<typename Fn>
+	void for_each_unmarked_index(size_t first, Fn &&fn)
+	{
+		BitSet<allocs_per_chunk> dead(free);
+		marks.remove_marked(dead);
+		marks.clear();
+		dead.for_each_set_bit(fn, first);
+	}
+	/**
+	 * Clear the marks of every slot.
+	 */
+	void clear_marks()
+	{
+		marks.clear();
+	}
+	/**
+	 * Free every allocated slot at or after `first` that was not reached by
+	 * the last mark, and clear the marks, taking the lock once for the whole
+	 * chunk.  If `keep_marks` is true, the marks of the slots that remain
+	 * allocated are kept.  `scrub(idx, true)` is called with the lock held
+	 * for each slot before it is released.  Each slot's pages are returned to
+	 * the OS, so the memory does not need to be zeroed.  `was_full` is set,
+	 * with the lock held, to whether the chunk had no free slots before the
+	 * sweep.  Returns the number of slots freed.
+	 */
+	template<typename Fn>
+	size_t free_unmarked(size_t first, bool keep_marks, bool &was_full, Fn &&scrub)
+	{
+		size_t freed = 0;
+		do {} while (!try_run_locked(lock, [&]()
+			{
+				was_full = (free_allocs_total == 0);
+				BitSet<allocs_per_chunk> dead(free);
+				marks.remove_marked(dead);
+				if (keep_marks)
+				{
+					marks.retain(free);
+				}
+				else
+				{
+					marks.clear();
+				}
+				dead.clear_range(0, first);
+				dead.for_each_set_bit([&](size_t idx)
+					{
+						scrub(idx, true);
+						cheri::capability<void> pages(reinterpret_cast<void*>(this));
+						pages.set_offset(idx * AllocSize);
+						pages.set_bounds(AllocSize);
+						zero_pages(pages);
+					});
+				free.and_not(dead);
+				freed = dead.popcount();
+				free_allocs_total += freed;
+			}));
+		return freed;
+	}
 	template<size_t sz>
 	size_t allocations(std::array<size_t, sz> &vals, size_t start)
 	{
 		size_t written = 0;
 		// Find each set bit in the bitmap
-		for (int i=start ; i<allocs_per_chunk ; i=free.one_after(i))
+		for (size_t i=free.first_set(start) ; i<allocs_per_chunk ; i=free.one_after(i))
 		{
 			if (written == sz)
 			{
 				return written;
 			}
-			if (free[i])
-			{
-				vals.at(written++) = i;
-			}
+			vals.at(written++) = i;
 		}
 		return written;
 	}
@@ -733,40 +1286,146 @@ class LargeAllocationHeader
 
 
 /**
- * Fixed-sized allocator.  This implements the methods defined in the abstract
- * allocator, but delegates most of the implementation to the AllocHeader.
+ * A reference to a single allocation, passed to the visitors used for
+ * internal iteration (`for_each_allocation`).  The handle is just the owning
+ * allocator and an index, so visiting an allocation costs nothing until the
+ * visitor asks for the header or the object.  In particular, a bounded
+ * capability to the object is only constructed by `object`.
  *
- * This class is used for small, medium, and large allocations as described in
- * the SuperMalloc paper.  The only difference between small and medium
- * allocators is the way in which their size is created, large allocators have
- * simpler metadata.  
+ * The owner must provide `header_type`, and `address_of_index`,
+ * `size_of_index`, `header_at_index`, `object_at_index` and `free_at_index`
+ * methods.
  */
-template<size_t AllocSize, typename ChunkHeader, typename Header>
-class FixedAllocator final : public Allocator<Header>,
-                             public ChunkHeader,
-                             public PageAllocated<FixedAllocator<AllocSize, ChunkHeader, Header>>
+template<typename Owner>
+class allocation_handle
 {
-	using self_type = FixedAllocator<AllocSize, ChunkHeader, Header>;
 	/**
-	 * Returns the size bucket for this allocator.
+	 * The allocator that owns this allocation.
 	 */
-	int bucket() const override
-	{
-		return bucket_for_size(AllocSize);
+	Owner &owner;
+	/**
+	 * The index of the allocation within its owner.
+	 */
+	size_t index;
+	public:
+	/**
+	 * The type of the object header.
+	 */
+	using header_type = typename Owner::header_type;
+	/**
+	 * Constructor.
+	 */
+	allocation_handle(Owner &o, size_t i) : owner(o), index(i) {}
+	/**
+	 * Returns the address of the start of the allocation.
+	 */
+	vaddr_t address() const
+	{
+		return owner.address_of_index(index);
 	}
 	/**
-	 * Returns whether the bucket is free.
+	 * Returns the size of the allocation.
 	 */
-	bool full() override
+	size_t size() const
 	{
-		return ChunkHeader::free_allocs_total == 0;
+		return owner.size_of_index(index);
 	}
 	/**
-	 * Allocate a new object.  The bounds of the returned allocation will be
-	 * constrained by the argument, but the amount of space returned is
-	 * determined by the template parameter for this allocator.
+	 * Returns the header for the allocation.
 	 */
-	void *alloc(size_t sz) override
+	header_type *header() const
+	{
+		return owner.header_at_index(index);
+	}
+	/**
+	 * Returns a capability to the whole allocation.
+	 */
+	void *object() const
+	{
+		return owner.object_at_index(index);
+	}
+	/**
+	 * Return the allocation to its allocator.  The handle must not be used
+	 * after this.
+	 */
+	void free() const
+	{
+		owner.free_at_index(index);
+	}
+};
+
+/**
+ * Fixed-sized allocator.  This implements the methods defined in the abstract
+ * allocator, but delegates most of the implementation to the AllocHeader.
+ *
+ * This class is used for small, medium, and large allocations as described in
+ * the SuperMalloc paper.  The only difference between small and medium
+ * allocators is the way in which their size is created, large allocators have
+ * simpler metadata.  
+ */
+template<size_t AllocSize, typename ChunkHeader, typename Header, int Bucket=-1>
+class FixedAllocator final : public Allocator<Header>,
+                             public ChunkHeader,
+                             public PageAllocated<FixedAllocator<AllocSize, ChunkHeader, Header, Bucket>>
+{
+	using self_type = FixedAllocator<AllocSize, ChunkHeader, Header, Bucket>;
+	/**
+	 * Handles to allocations call the `*_at_index` methods.
+	 */
+	friend class allocation_handle<self_type>;
+	/**
+	 * Returns the address of the allocation at index `idx`.
+	 */
+	vaddr_t address_of_index(size_t idx)
+	{
+		return (vaddr_t)this + (idx * AllocSize);
+	}
+	/**
+	 * Returns the size of the allocation at index `idx`.
+	 */
+	size_t size_of_index(size_t)
+	{
+		return AllocSize;
+	}
+	/**
+	 * Returns a capability to the allocation at index `idx`.
+	 */
+	void *object_at_index(size_t idx)
+	{
+		cheri::capability<char> ptr(reinterpret_cast<char*>(this) + (idx * AllocSize));
+		ptr.set_bounds(AllocSize);
+		return reinterpret_cast<void*>(ptr.get());
+	}
+	/**
+	 * Free the allocation at index `idx`.
+	 */
+	void free_at_index(size_t idx)
+	{
+		zero_unless_noscan(idx);
+		ChunkHeader::headers.reset(idx);
+		ChunkHeader::free_allocation(idx * AllocSize);
+	}
+	/**
+	 * Zero the allocation at index `idx`, which is being freed, unless it
+	 * holds no pointers.  Pointer-free allocations are left dirty and are
+	 * zeroed by `reserve` only if the slot is reused for an allocation that
+	 * may hold pointers.
+	 */
+	void zero_unless_noscan(size_t idx)
+	{
+		if (!ChunkHeader::test_mark_bit_at_index(idx, noscan_bit))
+		{
+			memset(reinterpret_cast<char*>(this) + (idx * AllocSize), 0, AllocSize);
+		}
+	}
+	/**
+	 * Reserve an allocation of `sz` bytes, which will be scanned by the
+	 * collector if `scan` is true.  Free slots are zeroed unless they were
+	 * last used for a pointer-free allocation, so such a slot is zeroed here
+	 * if the new allocation may hold pointers.  Pointer-free allocations are
+	 * never zeroed.
+	 */
+	void *reserve(size_t sz, bool scan)
 	{
 		ASSERT(sz <= AllocSize);
 		size_t offset = ChunkHeader::reserve_allocation();
@@ -774,9 +1433,57 @@ class FixedAllocator final : public Allocator<Header>,
 		{
 			return nullptr;
 		}
+		size_t idx = offset / AllocSize;
+		bool dirty = ChunkHeader::test_mark_bit_at_index(idx, noscan_bit);
+		if (scan && dirty)
+		{
+			memset(reinterpret_cast<char*>(this) + offset, 0, AllocSize);
+		}
+		if (scan == dirty)
+		{
+			ChunkHeader::assign_mark_bit_at_index(idx, noscan_bit, !scan);
+		}
 		cheri::capability<char> ptr(reinterpret_cast<char*>(this) + (offset));
 		ptr.set_bounds(sz);
 		return reinterpret_cast<void*>(ptr.get());
+	}
+	/**
+	 * Returns the size bucket for this allocator.
+	 */
+	int bucket() const override
+	{
+		return Bucket;
+	}
+	/**
+	 * Returns the size of the chunk that this allocator manages.
+	 */
+	size_t chunk_length() override
+	{
+		return ChunkHeader::chunk_bytes;
+	}
+	/**
+	 * Returns whether the bucket is free.
+	 */
+	bool full() override
+	{
+		return ChunkHeader::free_allocs_total == 0;
+	}
+	/**
+	 * Allocate a new object.  The bounds of the returned allocation will be
+	 * constrained by the argument, but the amount of space returned is
+	 * determined by the template parameter for this allocator.
+	 */
+	void *alloc(size_t sz) override
+	{
+		return reserve(sz, true);
+	};
+	/**
+	 * Allocate a new object that will not hold pointers.  This is not
+	 * zeroed.
+	 */
+	void *alloc_noscan(size_t sz) override
+	{
+		return reserve(sz, false);
 	};
 	/**
 	 * The size of all objects in this allocator is fixed.
@@ -799,6 +1506,28 @@ class FixedAllocator final : public Allocator<Header>,
 		ptr.set_bounds(AllocSize);
 		return reinterpret_cast<void*>(ptr.get());
 	}
+	/**
+	 * Set mark bit `b` for the allocation containing `addr` and return its
+	 * previous value.
+	 */
+	bool test_and_set_mark_bit(vaddr_t addr, side_mark_bit b) override
+	{
+		return ChunkHeader::test_and_set_mark_bit_at_index((addr - (vaddr_t)this) / AllocSize, b);
+	}
+	/**
+	 * Returns mark bit `b` for the allocation containing `addr`.
+	 */
+	bool test_mark_bit(vaddr_t addr, side_mark_bit b) override
+	{
+		return ChunkHeader::test_mark_bit_at_index((addr - (vaddr_t)this) / AllocSize, b);
+	}
+	/**
+	 * Prefetch mark bit `b` for the allocation containing `addr`.
+	 */
+	void prefetch_mark_bit(vaddr_t addr, side_mark_bit b) override
+	{
+		ChunkHeader::prefetch_mark_bit_at_index((addr - (vaddr_t)this) / AllocSize, b);
+	}
 	/**
 	 * Collect the objects and headers for iteration.
 	 */
@@ -825,8 +1554,9 @@ class FixedAllocator final : public Allocator<Header>,
 	bool free(void *ptr) override
 	{
 		size_t offset = reinterpret_cast<char*>(ptr) - reinterpret_cast<char*>(this);
-		ASSERT(offset < chunk_size);
-		memset(reinterpret_cast<char*>(this)+offset, 0, AllocSize);
+		ASSERT(offset < ChunkHeader::chunk_bytes);
+		zero_unless_noscan(offset / AllocSize);
+		ChunkHeader::headers.reset(offset / AllocSize);
 		ChunkHeader::free_allocation(offset);
 		return false;
 	};
@@ -844,11 +1574,71 @@ class FixedAllocator final : public Allocator<Header>,
 	 */
 	static self_type *create()
 	{
-		static_assert(chunk_size > sizeof(self_type),
+		static_assert(ChunkHeader::chunk_bytes > sizeof(self_type),
 		              "Metadata is bigger than chunk!");
-		char *p = PageAllocator<char>().allocate(chunk_size);
+		static_assert(ChunkHeader::chunk_bytes % chunk_size == 0,
+		              "Chunks must be a multiple of the chunk size");
+		char *p = PageAllocator<char>().allocate(ChunkHeader::chunk_bytes);
 		return ::new (p) self_type();
 	}
+	/**
+	 * The type of the object header.
+	 */
+	using header_type = Header;
+	/**
+	 * Call `v` with an `allocation_handle` for each allocation in this chunk,
+	 * in address order.  The visitor may free the allocation that it is
+	 * given.
+	 */
+	template<typename Visitor>
+	void for_each_allocation(Visitor &&v)
+	{
+		// Slots that overlap this object hold metadata, not allocations.
+		size_t first_index = (sizeof(*this) + AllocSize - 1) / AllocSize;
+		ChunkHeader::for_each_allocated_index(first_index, [&](size_t idx)
+			{
+				v(allocation_handle<self_type>(*this, idx));
+			});
+	}
+	/**
+	 * Call `v` with an `allocation_handle` for each allocation in this chunk
+	 * that was not reached by the last mark, in address order, and clear the
+	 * marks.  The visitor may free the allocation that it is given.
+	 */
+	template<typename Visitor>
+	void sweep_unmarked(Visitor &&v)
+	{
+		size_t first_index = (sizeof(*this) + AllocSize - 1) / AllocSize;
+		ChunkHeader::for_each_unmarked_index(first_index, [&](size_t idx)
+			{
+				v(allocation_handle<self_type>(*this, idx));
+			});
+	}
+	/**
+	 * Free every allocation in this chunk that the last mark did not reach
+	 * and clear the marks, or keep those of the survivors if `keep_marks` is
+	 * true.  `was_full` is set to whether the chunk was full before the
+	 * sweep.  Returns the number of allocations freed.
+	 */
+	size_t sweep(bool keep_marks, bool &was_full) override
+	{
+		size_t first_index = (sizeof(*this) + AllocSize - 1) / AllocSize;
+		return ChunkHeader::free_unmarked(first_index, keep_marks, was_full, [&](size_t idx, bool returned)
+			{
+				if (!returned)
+				{
+					zero_unless_noscan(idx);
+				}
+				ChunkHeader::headers.reset(idx);
+			});
+	}
+	/**
+	 * Clear the marks of every allocation in this chunk.
+	 */
+	void clear_marks() override
+	{
+		ChunkHeader::clear_marks();
+	}
 };
 
 /**
@@ -856,22 +1646,66 @@ class FixedAllocator final : public Allocator<Header>,
  * page or a few pages.  These are arranged in folios, and when an entire folio
  * is freed the underlying pages can be returned to the OS.
  */
-template<size_t AllocSize, typename Header>
+template<size_t AllocSize, typename Header, int Bucket=-1, size_t ChunkSize=chunk_size>
 using SmallAllocator = FixedAllocator<AllocSize,
-                                      SmallAllocationHeader<AllocSize, chunk_size, Header>,
-                                      Header>;
+                                      SmallAllocationHeader<AllocSize, ChunkSize, Header>,
+                                      Header,
+                                      Bucket>;
 
 /**
  * Large allocator.  Handles objects that are from 32KB to half of the size of
  * a chunk.  Objects are allocated as a range of pages and are returned to the
  * OS as soon as they're no longer needed.
  */
-template<size_t AllocSize, typename Header>
+template<size_t AllocSize, typename Header, int Bucket=-1, size_t ChunkSize=chunk_size>
 using LargeAllocator = FixedAllocator<AllocSize,
-                                      LargeAllocationHeader<AllocSize, chunk_size, Header>,
-                                      Header>;
+                                      LargeAllocationHeader<AllocSize, ChunkSize, Header>,
+                                      Header,
+                                      Bucket>;
 
-template<typename Header>
+/**
+ * The properties of a single bucket, derived from a size-class policy (see
+ * `bucket_size.hh`).  This selects the allocator type for the bucket and
+ * exposes the folio size, chunk size, and metadata overhead, so that policies
+ * can be compared at compile time.
+ */
+template<typename SizeClasses, int Bucket, typename Header>
+struct size_class
+{
+	/**
+	 * The size of each allocation in this bucket.
+	 */
+	static const size_t size = SizeClasses::template size<Bucket>();
+	/**
+	 * Is this bucket managed as runs of pages, rather than as folios?
+	 */
+	static const bool is_large = Bucket > SizeClasses::largest_medium_bucket();
+	/**
+	 * The size of the chunk that each allocator for this bucket manages.
+	 */
+	static const size_t chunk_bytes = SizeClasses::chunk_size_for_size(size);
+	/**
+	 * The type of the allocator for this bucket.
+	 */
+	using allocator = typename std::conditional<is_large,
+	                                            LargeAllocator<size, Header, Bucket, chunk_bytes>,
+	                                            SmallAllocator<size, Header, Bucket, chunk_bytes>>::type;
+	/**
+	 * The size of the folio used for this bucket.
+	 */
+	static const size_t folio_size = allocator::folio_size;
+	/**
+	 * The number of bytes at the start of each chunk that are used for
+	 * metadata.
+	 */
+	static const size_t header_overhead = sizeof(allocator);
+	static_assert(!is_large || (size % page_size == 0),
+	              "Large buckets must be a multiple of the page size");
+	static_assert(size % sizeof(void*) == 0,
+	              "Buckets must be a multiple of the pointer size");
+};
+
+template<typename Header, typename SizeClasses>
 struct Buckets;
 
 /**
@@ -879,7 +1713,7 @@ struct Buckets;
  * allocator is responsible for objects that are more than half the size of a
  * chunk.  These are allocated directly by mapping new pages from the OS.
  */
-template<typename Header>
+template<typename Header, typename SizeClasses>
 struct HugeAllocator final : public Allocator<Header>
 {
 	/**
@@ -905,12 +1739,16 @@ struct HugeAllocator final : public Allocator<Header>
 	/**
 	 * The owner for this allocator.
 	 */
-	Buckets<Header> &owner;
+	Buckets<Header, SizeClasses> &owner;
 	/**
 	 * Either the header, or a zero-sized allocation, depending on whether we
 	 * have a header type.
 	 */
 	typename std::conditional<std::is_void<Header>::value, char[0], Header>::type header;
+	/**
+	 * The collector's mark state for the allocation.
+	 */
+	MarkBits<Header, 1> marks;
 	/**
 	 * Allocate a huge object.  Rounds up to a multiple of page size.
 	 */
@@ -928,11 +1766,26 @@ struct HugeAllocator final : public Allocator<Header>
 				metadata_array.set_allocator_for_address(this, addr + i);
 			}
 			size = sz;
+			marks.assign(0, noscan_bit, false);
 			return a;
 		}
 		PageAllocator<char>().deallocate(reinterpret_cast<char*>(a), sz);
 		return nullptr;
 	}
+	/**
+	 * Allocate a huge object that will not hold pointers.  Fresh pages are
+	 * zero, so this differs from `alloc` only in recording that the object
+	 * should not be scanned.
+	 */
+	void *alloc_noscan(size_t sz) override
+	{
+		void *a = alloc(sz);
+		if (a)
+		{
+			marks.assign(0, noscan_bit, true);
+		}
+		return a;
+	}
 	/**
 	 * Returns the object size.
 	 */
@@ -1007,6 +1860,34 @@ struct HugeAllocator final : public Allocator<Header>
 		}
 		return nullptr;
 	}
+	/**
+	 * Set mark bit `b` for the allocation and return its previous value.
+	 */
+	bool test_and_set_mark_bit(vaddr_t, side_mark_bit b) override
+	{
+		return marks.test_and_set(0, b);
+	}
+	/**
+	 * Returns mark bit `b` for the allocation.
+	 */
+	bool test_mark_bit(vaddr_t, side_mark_bit b) override
+	{
+		return marks.test(0, b);
+	}
+	/**
+	 * Prefetch mark bit `b` for the allocation.
+	 */
+	void prefetch_mark_bit(vaddr_t, side_mark_bit b) override
+	{
+		marks.prefetch(0, b);
+	}
+	/**
+	 * Clear the marks of the allocation.
+	 */
+	void clear_marks() override
+	{
+		marks.clear();
+	}
 	/**
 	 * Fill the provided fast iteration state.  This allocator is responsible
 	 * for a single allocation.
@@ -1027,108 +1908,189 @@ struct HugeAllocator final : public Allocator<Header>
 	 * refers to it and then deleting it.
 	 */
 	bool delete_self();
+	/**
+	 * Handles to allocations call the `*_at_index` methods.
+	 */
+	friend class allocation_handle<HugeAllocator>;
+	/**
+	 * Returns the address of the allocation.  Huge allocators have a single
+	 * allocation, so the index is always zero.
+	 */
+	vaddr_t address_of_index(size_t)
+	{
+		return (vaddr_t)allocation.load();
+	}
+	/**
+	 * Returns the size of the allocation.
+	 */
+	size_t size_of_index(size_t)
+	{
+		return size;
+	}
+	/**
+	 * Returns the header for the allocation.
+	 */
+	Header *header_at_index(size_t)
+	{
+		return &header;
+	}
+	/**
+	 * Returns the allocation.
+	 */
+	void *object_at_index(size_t)
+	{
+		return allocation;
+	}
+	/**
+	 * Free the allocation.  This deletes the allocator.
+	 */
+	void free_at_index(size_t)
+	{
+		free(allocation);
+	}
 	public:
+	/**
+	 * The type of the object header.
+	 */
+	using header_type = Header;
+	/**
+	 * Call `v` with an `allocation_handle` for the allocation, if there is
+	 * one.
+	 */
+	template<typename Visitor>
+	void for_each_allocation(Visitor &&v)
+	{
+		if (allocation != nullptr)
+		{
+			v(allocation_handle<HugeAllocator>(*this, 0));
+		}
+	}
+	/**
+	 * Clear the marks and call `v` with an `allocation_handle` for the
+	 * allocation if the last mark did not reach it.  If `keep_marks` is true
+	 * and the allocation was reached, its marks are kept.
+	 */
+	template<typename Visitor>
+	void sweep_unmarked(Visitor &&v, bool keep_marks=false)
+	{
+		bool live = marks.test(0, mark_bit);
+		if (!keep_marks || !live || (allocation == nullptr))
+		{
+			marks.clear();
+		}
+		if (!live && (allocation != nullptr))
+		{
+			v(allocation_handle<HugeAllocator>(*this, 0));
+		}
+	}
 	/**
 	 * Constructor.  Takes the metadata array as an argument.
 	 */
-	HugeAllocator(PageMetadataArray &p, Buckets<Header> &b) : metadata_array(p), owner(b) {}
+	HugeAllocator(PageMetadataArray &p, Buckets<Header, SizeClasses> &b) : metadata_array(p), owner(b) {}
 };
 
 /**
- * Factory template class for creating small allocators.  This is designed
+ * Factory template class for creating fixed-size allocators.  This is designed
  * assuming that the compiler does good optimisation for large switch
- * statements.  This template instantiates itself recursively to construct a
- * `SmallAllocator` template instantiated with the correct size.
+ * statements.  This template instantiates itself recursively to construct the
+ * allocator that `size_class` selects for the requested bucket.
  *
  * Note: This must be a class template and not a function template, because C++
  * doesn't allow partial function template specialisations and we need to have
- * a base case of 0 for the second template parameter (the bucket), for any
+ * a base case of -1 for the last template parameter (the bucket), for any
  * given `Header` value.
  */
-template<typename Header, size_t Bucket = largest_medium_bucket()>
-struct small_allocator_factory
+template<typename SizeClasses, typename Header, int Bucket = SizeClasses::bucket_count() - 1>
+struct allocator_factory
 {
 	/**
 	 * Create an allocator in the specified `bucket`.  The value of `bucket`
-	 * must be lower than the `Bucket` template value.
+	 * must not be greater than the `Bucket` template value.
 	 */
 	__attribute__((always_inline))
 	static Allocator<Header>* create(int bucket)
 	{
 		if (bucket == Bucket)
 		{
-			const size_t size = BucketSize<Bucket>::value;
-			//ASSERT(bucket_for_size(size) == bucket);
-			return SmallAllocator<size, Header>::create();
+			return size_class<SizeClasses, Bucket, Header>::allocator::create();
 		}
-		return small_allocator_factory<Header, Bucket-1>::create(bucket);
+		return allocator_factory<SizeClasses, Header, Bucket-1>::create(bucket);
 	}
-};
-
-/**
- * Base case to terminate recursive `small_allocator_factory` instantiations.
- */
-template<typename Header>
-struct small_allocator_factory<Header, 0>
-{
 	/**
-	 * Base case for `create` function.  Either creates an allocator with
-	 * bucket 0, or returns a null pointer.
+	 * Call `v` with each allocation in `a`, which must be the allocator for
+	 * `bucket`.  This dispatches to the concrete allocator type so that the
+	 * walk over the chunk's bitmap and the visitor can be inlined together.
 	 */
-	static Allocator<Header>* create(int bucket)
+	template<typename Visitor>
+	__attribute__((always_inline))
+	static void for_each_allocation(int bucket, Allocator<Header> *a, Visitor &v)
 	{
-		if (bucket == 0)
+		if (bucket == Bucket)
 		{
-			return SmallAllocator<BucketSize<0>::value, Header>::create();
+			using allocator = typename size_class<SizeClasses, Bucket, Header>::allocator;
+			static_cast<allocator*>(a)->for_each_allocation(v);
+			return;
 		}
-		ASSERT(0);
-		return nullptr;
+		allocator_factory<SizeClasses, Header, Bucket-1>::for_each_allocation(bucket, a, v);
 	}
-};
-
-template<typename Header, size_t Bucket = largest_large_bucket()>
-struct large_allocator_factory
-{
 	/**
-	 * Create an allocator in the specified `bucket`.  The value of `bucket`
-	 * must be lower than the `Bucket` template value.
+	 * Call `v` with each allocation in `a`, which must be the allocator for
+	 * `bucket`, that the last mark did not reach, and clear the marks.
 	 */
+	template<typename Visitor>
 	__attribute__((always_inline))
-	static Allocator<Header>* create(int bucket)
+	static void sweep_unmarked(int bucket, Allocator<Header> *a, Visitor &v)
 	{
 		if (bucket == Bucket)
 		{
-			const size_t size = BucketSize<Bucket>::value;
-			//ASSERT(bucket_for_size(size) == bucket);
-			return LargeAllocator<size, Header>::create();
+			using allocator = typename size_class<SizeClasses, Bucket, Header>::allocator;
+			static_cast<allocator*>(a)->sweep_unmarked(v);
+			return;
 		}
-		return large_allocator_factory<Header, Bucket-1>::create(bucket);
+		allocator_factory<SizeClasses, Header, Bucket-1>::sweep_unmarked(bucket, a, v);
 	}
 };
 
-template<typename Header>
-struct large_allocator_factory<Header, 0>
+/**
+ * Base case to terminate recursive `allocator_factory` instantiations.
+ */
+template<typename SizeClasses, typename Header>
+struct allocator_factory<SizeClasses, Header, -1>
 {
 	/**
-	 * Base case for `create` function.  Either creates an allocator with
-	 * bucket 0, or returns a null pointer.
+	 * Base case for `create` function.  Reaching this means that the bucket
+	 * was out of range.
 	 */
 	static Allocator<Header>* create(int bucket)
 	{
-		if (bucket == 0)
-		{
-			return LargeAllocator<BucketSize<0>::value, Header>::create();
-		}
 		ASSERT(0);
 		return nullptr;
 	}
+	/**
+	 * Base case for `for_each_allocation`.  Reaching this means that the
+	 * bucket was out of range.
+	 */
+	template<typename Visitor>
+	static void for_each_allocation(int bucket, Allocator<Header> *a, Visitor &v)
+	{
+		ASSERT(0);
+	}
+	/**
+	 * Base case for `sweep_unmarked`.  Reaching this means that the bucket
+	 * was out of range.
+	 */
+	template<typename Visitor>
+	static void sweep_unmarked(int bucket, Allocator<Header> *a, Visitor &v)
+	{
+		ASSERT(0);
+	}
 };
 
 /**
  * Manager for allocators.  Constructs new allocators on demand.
  */
-template<typename Header>
-struct Buckets : public PageAllocated<Buckets<Header>>
+template<typename Header, typename SizeClasses>
+struct Buckets : public PageAllocated<Buckets<Header, SizeClasses>>
 {
 	/**
 	 * Convenience name for the metadata array template.
@@ -1138,17 +2100,37 @@ struct Buckets : public PageAllocated<Buckets<Header>>
 	 * Array of allocators for fixed-size buckets.  The allocators form a
 	 * linked list within each bucket.
 	 */
-	std::array<std::atomic<Allocator<Header>*>, fixed_buckets> fixed_buckets;
+	std::array<std::atomic<Allocator<Header>*>, SizeClasses::bucket_count()> fixed_buckets;
+	/**
+	 * List of every fixed-size allocator that has been created, linked via
+	 * `next_chunk`.  Allocators are removed from the `fixed_buckets` lists
+	 * when they become full, and returned to them by `relink` when space is
+	 * freed, but they are never removed from this one.
+	 */
+	std::atomic<Allocator<Header>*> all_chunks;
 	/**
 	 * Pointer to the index that stores the map from address to allocator.
 	 */
 	PageMetadataArray &p;
+	/**
+	 * The current sweep epoch.  This is incremented when a collector has
+	 * finished marking and leaves the sweep to be done lazily.  Any allocator
+	 * whose `swept_epoch` is older than this still holds unreachable
+	 * allocations and must be swept before it is allocated from.
+	 */
+	std::atomic<unsigned int> sweep_epoch;
+	/**
+	 * Set if the sweep for the current epoch keeps the marks of the
+	 * allocations that survive it.  This is written before `sweep_epoch` is
+	 * incremented, so it must be read after the epoch.
+	 */
+	std::atomic<bool> sweep_keeps_marks;
 	/**
 	 * Allocator type used to allocate huge allocators.  This allocator doesn't
 	 * need to store per-object headers, even if the huge allocators that it
 	 * allocates do.
 	 */
-	using HugeAllocatorAllocator = SmallAllocator<sizeof(HugeAllocator<Header>), void>;
+	using HugeAllocatorAllocator = SmallAllocator<sizeof(HugeAllocator<Header, SizeClasses>), void>;
 	/**
 	 * Allocator used to allocate huge allocators.  Huge allocation metadata is
 	 * stored out of line from the rest of the allocation, and is quite small.
@@ -1176,7 +2158,7 @@ struct Buckets : public PageAllocated<Buckets<Header>>
 		// be better to maintain two lists, protected by a lock: whenever we
 		// create or destroy a huge allocator, we're calling m[un]map, so an
 		// extra lock and unlock on this path is unlikely to be significant.
-		void *buffer = static_cast<Allocator<void>*>(aa)->alloc(sizeof(HugeAllocator<Header>));
+		void *buffer = static_cast<Allocator<void>*>(aa)->alloc(sizeof(HugeAllocator<Header, SizeClasses>));
 		// The buffer will be null if the allocator became full (possibly as a
 		// result of allocations in another thread).
 		if (buffer == nullptr)
@@ -1194,7 +2176,7 @@ struct Buckets : public PageAllocated<Buckets<Header>>
 			}
 			return huge_allocator();
 		}
-		auto *a = new (buffer) HugeAllocator<Header>(p, *this);
+		auto *a = new (buffer) HugeAllocator<Header, SizeClasses>(p, *this);
 		ASSERT(a);
 		return a;
 	}
@@ -1202,7 +2184,7 @@ struct Buckets : public PageAllocated<Buckets<Header>>
 	/**
 	 * Constructor. 
 	 */
-	Buckets(PageMetadataArray &metadata) : p(metadata) {}
+	Buckets(PageMetadataArray &metadata) : p(metadata), sweep_epoch(0), sweep_keeps_marks(false) {}
 	/**
 	 * Returns an allocator for a specific bucket.  If there is no existing
 	 * bucket, then one is created.
@@ -1219,43 +2201,83 @@ struct Buckets : public PageAllocated<Buckets<Header>>
 		// FIXME: Handle creating huge allocators for things that want to just be mmap'd.
 		if (a == nullptr)
 		{
-			if (bucket <= largest_medium_bucket())
-			{
-				a = small_allocator_factory<Header>::create(bucket);
-			}
-			else if (bucket <= largest_large_bucket())
-			{
-				a = large_allocator_factory<Header>::create(bucket);
-			}
-			else
-			{
-				ASSERT(0);
-			}
+			ASSERT(bucket < SizeClasses::bucket_count());
+			a = allocator_factory<SizeClasses, Header>::create(bucket);
 			ASSERT(a);
 			ASSERT(a->bucket() == bucket);
 			ASSERT(!a->full());
-			p.set_allocator_for_address(a, (vaddr_t)a);
-			Allocator<Header> *old = nullptr;
+			// A new allocator holds no unreachable allocations.
+			unsigned int epoch = sweep_epoch.load(std::memory_order_relaxed);
+			a->swept_epoch.store(epoch, std::memory_order_relaxed);
+			a->sweep_started.store(epoch, std::memory_order_relaxed);
+			// Allocators for some size classes manage more than one chunk.
+			for (vaddr_t i=0 ; i<a->chunk_length() ; i+=chunk_size)
+			{
+				p.set_allocator_for_address(a, (vaddr_t)a + i);
+			}
+			Allocator<Header> *old = all_chunks.load(std::memory_order_relaxed);
+			do
+			{
+				a->next_chunk = old;
+			} while (!all_chunks.compare_exchange_weak(old, a, std::memory_order_release));
+			a->linked = true;
+			old = nullptr;
 			while (!fixed_buckets[bucket].compare_exchange_weak(old, a, std::memory_order_relaxed))
 			{
 				a->next = old;
 			}
 		}
+		// Free the unreachable allocations from the last collection before
+		// deciding whether this allocator is full.
+		unsigned int epoch = sweep_epoch.load(std::memory_order_acquire);
+		bool was_full;
+		a->ensure_swept(epoch, sweep_keeps_marks.load(std::memory_order_relaxed), was_full);
 		// If this allocator is full
 		if (a->full())
 		{
 			// FIXME: This is racy.  An allocator can transition from full to
 			// non-full in parallel with this.  
 			Allocator<Header> *next = a->next.exchange(nullptr);
-			fixed_buckets[bucket].compare_exchange_strong(a, next, std::memory_order_relaxed);
+			Allocator<Header> *expected = a;
+			if (fixed_buckets[bucket].compare_exchange_strong(expected, next, std::memory_order_relaxed))
+			{
+				a->linked = false;
+				// A sweep or free may have made space in the allocator
+				// before it was marked as unlinked.
+				relink(a);
+			}
 			return allocator_for_bucket(bucket);
 		}
 		return a;
 	}
+	/**
+	 * Put `a` back in the list for its bucket if it has been removed from it
+	 * and now has space.  Called after sweeps and frees that may have made
+	 * space in a full allocator, so that the space can be allocated again.
+	 */
+	void relink(Allocator<Header> *a)
+	{
+		int bucket = a->bucket();
+		if ((bucket < 0) || a->linked.load(std::memory_order_relaxed) || a->full())
+		{
+			return;
+		}
+		// Only one thread may put the allocator back.
+		if (a->linked.exchange(true))
+		{
+			return;
+		}
+		Allocator<Header> *old = nullptr;
+		a->next = nullptr;
+		while (!fixed_buckets[bucket].compare_exchange_weak(old, a, std::memory_order_relaxed))
+		{
+			a->next = old;
+		}
+	}
 	/**
 	 * Delete a huge allocator.
 	 */
-	bool delete_huge_allocator(HugeAllocator<Header> *a)
+	bool delete_huge_allocator(HugeAllocator<Header, SizeClasses> *a)
 	{
 		for (Allocator<void> *allocator = huge_allocator_allocator.load() ;
 		     allocator ;
@@ -1273,8 +2295,8 @@ struct Buckets : public PageAllocated<Buckets<Header>>
 	}
 };
 
-template<typename Header>
-bool HugeAllocator<Header>::delete_self()
+template<typename Header, typename SizeClasses>
+bool HugeAllocator<Header, SizeClasses>::delete_self()
 {
 	return owner.delete_huge_allocator(this);
 }
@@ -1282,10 +2304,11 @@ bool HugeAllocator<Header>::delete_self()
 
 /**
  * External interface for this allocator.  This manages a set of fixed-size
- * allocators.
+ * allocators.  The mapping from sizes to fixed-size allocators is defined by
+ * the `SizeClasses` policy (see `bucket_size.hh`).
  */
-template<typename Header>
-class slab_allocator : public PageAllocated<slab_allocator<Header>>
+template<typename Header, typename SizeClasses=prime_or_power_of_two_size_classes>
+class slab_allocator : public PageAllocated<slab_allocator<Header, SizeClasses>>
 {
 	/**
 	 * Convenience name for the metadata array.
@@ -1298,7 +2321,68 @@ class slab_allocator : public PageAllocated<slab_allocator<Header>>
 	/**
 	 * Fixed-size allocator manager.
 	 */
-	Buckets<Header> global_buckets = { *p };
+	Buckets<Header, SizeClasses> global_buckets = { *p };
+	/**
+	 * Callback for invoking the GC.  This is called when the pacer decides
+	 * that enough memory has been allocated since the last collection.  If it
+	 * is not set, the allocator never triggers collection itself.
+	 */
+	Function *gc = nullptr;
+	/**
+	 * The space used to store the object that `gc` points to.
+	 */
+	char callback_buffer[128];
+	/**
+	 * The thread that finishes each lazy sweep in the background.
+	 */
+	pthread_t sweeper;
+	/**
+	 * Has the background sweeper been started?
+	 */
+	bool sweeper_started = false;
+	/**
+	 * Entry point for the background sweeper.  This sleeps on the sweep epoch
+	 * and sweeps every chunk that the mutators have not already swept each
+	 * time that a collection starts a new lazy sweep.
+	 */
+	static void *sweeper_main(void *arg)
+	{
+		slab_allocator &heap = *static_cast<slab_allocator*>(arg);
+		std::atomic<unsigned int> &epoch = heap.global_buckets.sweep_epoch;
+		unsigned int seen = 0;
+		while (true)
+		{
+			unsigned int e = epoch.load(std::memory_order_acquire);
+			if (e == seen)
+			{
+				_umtx_op(static_cast<void*>(&epoch),
+				         UMTX_OP_WAIT_UINT_PRIVATE, e, nullptr, nullptr);
+				continue;
+			}
+			seen = e;
+			heap.sweep_remaining();
+		}
+		return nullptr;
+	}
+	/**
+	 * Sweep, on the calling thread, every chunk that has not been swept since
+	 * the last call to `begin_sweep`.
+	 */
+	void sweep_remaining()
+	{
+		unsigned int epoch = global_buckets.sweep_epoch.load(std::memory_order_acquire);
+		bool keep_marks = global_buckets.sweep_keeps_marks.load(std::memory_order_relaxed);
+		for (Allocator<Header> *a = global_buckets.all_chunks.load(std::memory_order_acquire) ;
+		     a != nullptr ;
+		     a = a->next_chunk)
+		{
+			bool was_full;
+			if ((a->ensure_swept(epoch, keep_marks, was_full) != 0) && was_full)
+			{
+				global_buckets.relink(a);
+			}
+		}
+	}
 	class huge_allocator_iterator
 	{
 		using alloc = typename allocator_fast_iterator<Header>::alloc;
@@ -1360,7 +2444,7 @@ class slab_allocator : public PageAllocated<slab_allocator<Header>>
 			allocator_count = 0;
 			for (int i=0 ; i<iter.buffer_length ; i++)
 			{
-				auto *ha = reinterpret_cast<HugeAllocator<Header>*>(iter.buffer[i].first);
+				auto *ha = reinterpret_cast<HugeAllocator<Header, SizeClasses>*>(iter.buffer[i].first);
 				if (ha->allocation != nullptr)
 				{
 					allocators[allocator_count++] = { ha->allocation, &ha->header };
@@ -1440,7 +2524,7 @@ class slab_allocator : public PageAllocated<slab_allocator<Header>>
 		 * The container that lets us find the heads of all of the linked
 		 * lists.
 		 */
-		Buckets<Header> &buckets;
+		Buckets<Header, SizeClasses> &buckets;
 		/**
 		 * The iteration state for the current allocator.
 		 */
@@ -1459,7 +2543,7 @@ class slab_allocator : public PageAllocated<slab_allocator<Header>>
 		 */
 		Allocator<Header> *allocator_from_bucket(int idx)
 		{
-			while (idx < fixed_buckets)
+			while (idx < SizeClasses::bucket_count())
 			{
 				Allocator<Header> *allocator = buckets.fixed_buckets[idx++];
 				if (allocator)
@@ -1523,7 +2607,7 @@ class slab_allocator : public PageAllocated<slab_allocator<Header>>
 		/**
 		 * Constructor.
 		 */
-		fixed_allocator_iterator(Buckets<Header> &b, bool e=false) : buckets(b), end(e) {}
+		fixed_allocator_iterator(Buckets<Header, SizeClasses> &b, bool e=false) : buckets(b), end(e) {}
 		alloc &operator*()
 		{
 			if (unlikely(iter.buffer_length == 0))
@@ -1562,29 +2646,175 @@ class slab_allocator : public PageAllocated<slab_allocator<Header>>
 			return (&buckets != &other.buckets) || (iter != other.iter);
 		}
 	};
+	/**
+	 * Call `fn` with each huge allocator that currently owns an allocation.
+	 */
+	template<typename Fn>
+	void for_each_huge_allocator(Fn &&fn)
+	{
+		for (Allocator<void> *aa = global_buckets.huge_allocator_allocator ;
+		     aa != nullptr ;
+		     aa = aa->next)
+		{
+			allocator_fast_iterator<void> iter;
+			do
+			{
+				aa->fill_fast_iterator(iter);
+				for (size_t i=0 ; i<iter.buffer_length ; i++)
+				{
+					auto *ha = reinterpret_cast<HugeAllocator<Header, SizeClasses>*>(iter.buffer[i].first);
+					if (ha->allocation != nullptr)
+					{
+						fn(ha);
+					}
+				}
+			} while (iter.buffer_length == iter.buffer_size);
+		}
+	}
 	public:
 	using object_header = Header;
+	/**
+	 * The size-class policy used by this allocator.
+	 */
+	using size_classes = SizeClasses;
+	/**
+	 * Set the callback for invoking the garbage collector.
+	 */
+	template<typename T>
+	void set_gc(T &fn)
+	{
+		static_assert(sizeof(T) <= sizeof(callback_buffer),
+		              "Callback buffer too small for callback");
+		gc = (new (callback_buffer) ConcreteFunction<T>(fn));
+		// Once there is a collector, there will be sweeps to finish.  If the
+		// thread can't be created, chunks are still swept on demand.
+		if (!sweeper_started)
+		{
+			sweeper_started = (pthread_create(&sweeper, nullptr, sweeper_main, this) == 0);
+		}
+	}
 	/**
 	 * Allocate `size` bytes.
 	 */
 	void *alloc(size_t size)
+	{
+		return allocate(size, true);
+	}
+	/**
+	 * Allocate `size` bytes for an object that will never hold pointers,
+	 * such as a string or other byte buffer.  The collector marks these
+	 * objects without scanning them and the memory is not zeroed.
+	 */
+	void *alloc_noscan(size_t size)
+	{
+		return allocate(size, false);
+	}
+	/**
+	 * Allocate `size` bytes for an object whose pointer fields are described
+	 * by `layout` (see `gc_layout_of`).  The collector scans only those
+	 * fields of the object.
+	 */
+	void *alloc_typed(size_t size, gc_layout layout)
+	{
+		void *obj = alloc(size);
+		Header *header;
+		if (obj && object_for_allocation(obj, header))
+		{
+			header->set_layout(layout);
+		}
+		return obj;
+	}
+	/**
+	 * Allocate `size` bytes for an object with layout `layout` that a
+	 * collector is moving into this heap.  The object was counted by the
+	 * pacer and, if sampled, recorded by the heap profiler when it was first
+	 * allocated, so this allocation is not reported to either and never
+	 * triggers a collection.
+	 */
+	void *alloc_moved(size_t size, gc_layout layout)
+	{
+		ASSERT(p);
+		if (unlikely(size == 0))
+		{
+			return nullptr;
+		}
+		void *obj = allocate_from_bucket(size, true);
+		Header *header;
+		if (object_for_allocation(obj, header))
+		{
+			header->set_layout(layout);
+		}
+		return obj;
+	}
+	/**
+	 * Allocate `size` bytes, using `alloc` if `scan` is true and
+	 * `alloc_noscan` otherwise.
+	 */
+	void *allocate(size_t size, bool scan)
 	{
 		ASSERT(p);
 		if (unlikely(size == 0))
 		{
 			return nullptr;
 		}
-		int bucket = bucket_for_size(size);
+		if ((gc != nullptr) && gc_pacing.record_allocation(size))
+		{
+			(*gc)();
+		}
+		void *allocation = allocate_from_bucket(size, scan);
+		sampling_heap_profiler.sample(allocation, size);
+		return allocation;
+	}
+	/**
+	 * Allocate `size` bytes from the bucket for that size, without reporting
+	 * the allocation to the pacer or the heap profiler.
+	 */
+	void *allocate_from_bucket(size_t size, bool scan)
+	{
+		int bucket = SizeClasses::bucket_for_size(size);
 		while (true)
 		{
 			auto *a = global_buckets.allocator_for_bucket(bucket);
-			void *allocation = a->alloc(size);
+			void *allocation = try_allocate_from(a, size, scan);
 			if (allocation)
 			{
 				return allocation;
 			}
 		}
 	}
+	/**
+	 * Reserve `size` bytes from `a`, which `allocator_for_bucket` returned.
+	 * Returns `nullptr` if `a` is full, or if a collection began a new sweep
+	 * epoch between `a` being swept and the allocation being reserved, in
+	 * which case the caller should choose an allocator again.
+	 *
+	 * In the second case, the new allocation has no mark bit in a chunk that
+	 * is still waiting to be swept, so the lazy sweep would free it while it
+	 * is in use.  The chunk is swept here instead, which frees the
+	 * allocation if the mark did not reach it.  If the mark did reach it,
+	 * because it was reserved before the world stopped, it is left for the
+	 * next collection to reclaim.
+	 */
+	void *try_allocate_from(Allocator<Header> *a, size_t size, bool scan)
+	{
+		void *allocation = scan ? a->alloc(size) : a->alloc_noscan(size);
+		if ((allocation == nullptr) || (a->bucket() < 0))
+		{
+			return allocation;
+		}
+		unsigned int epoch = global_buckets.sweep_epoch.load(std::memory_order_acquire);
+		if (a->swept_epoch.load(std::memory_order_acquire) >= epoch)
+		{
+			return allocation;
+		}
+		bool was_full;
+		bool keep_marks = global_buckets.sweep_keeps_marks.load(std::memory_order_relaxed);
+		if ((a->ensure_swept(epoch, keep_marks, was_full) != 0) && was_full)
+		{
+			global_buckets.relink(a);
+		}
+		return nullptr;
+	}
 	/**
 	 * Free the specified pointer.
 	 */
@@ -1597,7 +2827,14 @@ class slab_allocator : public PageAllocated<slab_allocator<Header>>
 			fprintf(stderr, "Failed to find allocator for %#p\n", ptr);
 		}
 		ASSERT(a);
+		sampling_heap_profiler.forget(ptr);
+		// Freeing a huge allocation may delete its allocator.
+		bool fixed = (a->bucket() >= 0);
 		a->free(ptr);
+		if (fixed)
+		{
+			global_buckets.relink(a);
+		}
 	}
 	/**
 	 * Returns the underlying allocation and the header for a given pointer.
@@ -1615,6 +2852,207 @@ class slab_allocator : public PageAllocated<slab_allocator<Header>>
 		}
 		return a->allocation_for_address(addr, header);
 	}
+	/**
+	 * This heap keeps the collector's mark state in bitmaps in the chunk
+	 * metadata, next to the allocation bitmaps, rather than in the object
+	 * headers.  Collectors access it through `try_mark`, `try_visit`,
+	 * `is_marked`, `is_visited` and `is_noscan`, and free the unreachable
+	 * allocations with `sweep_unmarked` or, lazily, with `begin_sweep` and
+	 * `finish_sweep`.
+	 */
+	static const bool has_side_mark_bits = true;
+	/**
+	 * Mark the object containing `ptr` as reached.  Returns true if this call
+	 * set the mark, false if it was already marked or is not in this heap.
+	 */
+	bool try_mark(void *ptr)
+	{
+		vaddr_t addr = (vaddr_t)ptr;
+		Allocator<Header> *a = p->allocator_for_address(addr);
+		return a && !a->test_and_set_mark_bit(addr, mark_bit);
+	}
+	/**
+	 * Mark the object containing `ptr` as scanned.  Returns true if this call
+	 * set the mark, so that only one marker scans each object.
+	 */
+	bool try_visit(void *ptr)
+	{
+		vaddr_t addr = (vaddr_t)ptr;
+		Allocator<Header> *a = p->allocator_for_address(addr);
+		return a && !a->test_and_set_mark_bit(addr, visited_bit);
+	}
+	/**
+	 * Returns whether the object containing `ptr` has been reached but not
+	 * yet scanned.
+	 */
+	bool is_marked(void *ptr)
+	{
+		vaddr_t addr = (vaddr_t)ptr;
+		Allocator<Header> *a = p->allocator_for_address(addr);
+		return a && a->test_mark_bit(addr, mark_bit) &&
+		       !a->test_mark_bit(addr, visited_bit);
+	}
+	/**
+	 * Returns whether the object containing `ptr` has been scanned.
+	 */
+	bool is_visited(void *ptr)
+	{
+		vaddr_t addr = (vaddr_t)ptr;
+		Allocator<Header> *a = p->allocator_for_address(addr);
+		return a && a->test_mark_bit(addr, visited_bit);
+	}
+	/**
+	 * Prefetch the mark state that scanning the object containing `ptr` reads
+	 * and updates, for `try_visit` and `is_noscan`.
+	 */
+	void prefetch_mark_state(void *ptr)
+	{
+		vaddr_t addr = (vaddr_t)ptr;
+		Allocator<Header> *a = p->allocator_for_address(addr);
+		if (a)
+		{
+			a->prefetch_mark_bit(addr, visited_bit);
+			a->prefetch_mark_bit(addr, noscan_bit);
+		}
+	}
+	/**
+	 * Returns whether the object containing `ptr` was allocated with
+	 * `alloc_noscan`, and so does not need to be scanned.
+	 */
+	bool is_noscan(void *ptr)
+	{
+		vaddr_t addr = (vaddr_t)ptr;
+		Allocator<Header> *a = p->allocator_for_address(addr);
+		return a && a->test_mark_bit(addr, noscan_bit);
+	}
+	/**
+	 * Call `v` with an `allocation_handle` for every allocation in the heap
+	 * that the last mark did not reach, and clear all of the marks.  The
+	 * visitor may free the allocation that it is given.
+	 */
+	template<typename Visitor>
+	void sweep_unmarked(Visitor &&v)
+	{
+		for (Allocator<Header> *a = global_buckets.all_chunks.load(std::memory_order_acquire) ;
+		     a != nullptr ;
+		     a = a->next_chunk)
+		{
+			allocator_factory<SizeClasses, Header>::sweep_unmarked(a->bucket(), a, v);
+		}
+		for_each_huge_allocator([&](HugeAllocator<Header, SizeClasses> *ha)
+			{
+				ha->sweep_unmarked(v);
+			});
+	}
+	/**
+	 * Start a lazy sweep.  This must be called with the world stopped, once
+	 * the collector has finished marking.  Huge allocations are swept
+	 * immediately.  Each chunk is swept when it is next allocated from, or by
+	 * the background sweeper, whichever comes first, so the pause does not
+	 * depend on the size of the heap.  The marks must not be used after this
+	 * returns.
+	 *
+	 * If `keep_marks` is true, the sweep leaves the surviving allocations
+	 * marked (sticky mark bits), so that a later mark does not trace them
+	 * again.  The collector must then call `clear_marks` before a full mark.
+	 */
+	void begin_sweep(bool keep_marks=false)
+	{
+		for_each_huge_allocator([&](HugeAllocator<Header, SizeClasses> *ha)
+			{
+				ha->sweep_unmarked([](const allocation_handle<HugeAllocator<Header, SizeClasses>> &alloc)
+					{
+						alloc.free();
+					}, keep_marks);
+			});
+		global_buckets.sweep_keeps_marks.store(keep_marks, std::memory_order_relaxed);
+		std::atomic<unsigned int> &epoch = global_buckets.sweep_epoch;
+		epoch.fetch_add(1, std::memory_order_release);
+		_umtx_op(static_cast<void*>(&epoch), UMTX_OP_WAKE_PRIVATE, INT_MAX,
+		         nullptr, nullptr);
+	}
+	/**
+	 * Sweep every chunk that has not been swept since the last call to
+	 * `begin_sweep`, waiting for any that other threads are sweeping.  A
+	 * collector must call this before it starts marking, because the sweep
+	 * consumes the previous cycle's marks.
+	 *
+	 * The chunks are swept in parallel on the threads in `pool`.  Each thread
+	 * claims one chunk at a time and all of the updates to a chunk's folios
+	 * are made by the thread that claimed it, under the chunk's lock.  Each
+	 * thread counts the allocations that it frees locally and the counts are
+	 * merged once it runs out of chunks.  Only one thread may use `pool` at a
+	 * time, so this should be called only by the collector.  Returns the
+	 * number of allocations freed by this call.
+	 */
+	size_t finish_sweep(gc_thread_pool &pool=gc_workers)
+	{
+		unsigned int epoch = global_buckets.sweep_epoch.load(std::memory_order_acquire);
+		bool keep_marks = global_buckets.sweep_keeps_marks.load(std::memory_order_relaxed);
+		work_unit_vector units;
+		for (Allocator<Header> *a = global_buckets.all_chunks.load(std::memory_order_acquire) ;
+		     a != nullptr ;
+		     a = a->next_chunk)
+		{
+			if (a->swept_epoch.load(std::memory_order_relaxed) < epoch)
+			{
+				units.push_back(a);
+			}
+		}
+		std::atomic<size_t> next_unit(0);
+		std::atomic<size_t> freed(0);
+		size_t sweepers = std::min(static_cast<size_t>(pool.concurrency()), units.size());
+		pool.parallel_for(sweepers, [&](size_t)
+			{
+				size_t local_freed = 0;
+				size_t i;
+				while ((i = next_unit.fetch_add(1, std::memory_order_relaxed)) < units.size())
+				{
+					bool was_full;
+					size_t swept = units[i]->ensure_swept(epoch, keep_marks, was_full);
+					if ((swept != 0) && was_full)
+					{
+						global_buckets.relink(units[i]);
+					}
+					local_freed += swept;
+				}
+				freed.fetch_add(local_freed, std::memory_order_relaxed);
+			});
+		return freed;
+	}
+	/**
+	 * Returns the number of fixed-size allocators that have been created.
+	 * Each manages one or more chunks.
+	 */
+	size_t fixed_allocator_count()
+	{
+		size_t count = 0;
+		for (Allocator<Header> *a = global_buckets.all_chunks.load(std::memory_order_acquire) ;
+		     a != nullptr ;
+		     a = a->next_chunk)
+		{
+			count++;
+		}
+		return count;
+	}
+	/**
+	 * Clear the marks of every allocation.  A collector that keeps marks
+	 * across sweeps (see `begin_sweep`) must call this before a full mark.
+	 * This must be called with the world stopped, after `finish_sweep`.
+	 */
+	void clear_marks()
+	{
+		for (Allocator<Header> *a = global_buckets.all_chunks.load(std::memory_order_acquire) ;
+		     a != nullptr ;
+		     a = a->next_chunk)
+		{
+			a->clear_marks();
+		}
+		for_each_huge_allocator([&](HugeAllocator<Header, SizeClasses> *ha)
+			{
+				ha->clear_marks();
+			});
+	}
 	using iterator = SplicedForwardIterator<fixed_allocator_iterator, huge_allocator_iterator>;
 	/**
 	 * Returns a start iterator for all allocations.
@@ -1634,6 +3072,94 @@ class slab_allocator : public PageAllocated<slab_allocator<Header>>
 		                std::move(fixed_allocator_iterator(global_buckets, true)),
 		                std::move(huge_allocator_iterator()));
 	}
+	/**
+	 * Call `v` with an `allocation_handle` for every allocation in the heap.
+	 * This is the preferred way of walking the heap: each chunk's bitmap is
+	 * walked directly, with the visitor inlined into the loop, and no
+	 * capabilities are constructed unless the visitor asks for them.  The
+	 * visitor may free the allocation that it is given.
+	 */
+	template<typename Visitor>
+	void for_each_allocation(Visitor &&v)
+	{
+		for (Allocator<Header> *a = global_buckets.all_chunks.load(std::memory_order_acquire) ;
+		     a != nullptr ;
+		     a = a->next_chunk)
+		{
+			allocator_factory<SizeClasses, Header>::for_each_allocation(a->bucket(), a, v);
+		}
+		for_each_huge_allocator([&](HugeAllocator<Header, SizeClasses> *ha)
+			{
+				ha->for_each_allocation(v);
+			});
+	}
+	/**
+	 * A unit of work for parallel heap walks.  Each fixed-size allocator (one
+	 * chunk, or a few for the largest size classes) and each huge allocation
+	 * is a separate work unit.
+	 */
+	using work_unit = Allocator<Header>*;
+	/**
+	 * Container for work units.
+	 */
+	using work_unit_vector = std::vector<work_unit, PageAllocator<work_unit>>;
+	/**
+	 * Collect all of the work units in the heap into `units`.  Chunks that are
+	 * created after this returns will not be included.
+	 */
+	void work_units(work_unit_vector &units)
+	{
+		units.clear();
+		for (Allocator<Header> *a = global_buckets.all_chunks.load(std::memory_order_acquire) ;
+		     a != nullptr ;
+		     a = a->next_chunk)
+		{
+			units.push_back(a);
+		}
+		for_each_huge_allocator([&](HugeAllocator<Header, SizeClasses> *ha)
+			{
+				units.push_back(ha);
+			});
+	}
+	/**
+	 * Call `fn` with each allocation in a work unit.  The argument is the same
+	 * (object, header) pair that the serial iterator returns.  Like
+	 * `for_each_allocation`, this walks the chunk's bitmaps in the concrete
+	 * allocator type, rather than copying batches of allocations out through
+	 * `fill_fast_iterator`.
+	 */
+	template<typename Fn>
+	void for_each_in_work_unit(work_unit a, Fn &&fn)
+	{
+		auto visit = [&](const auto &alloc)
+			{
+				typename allocator_fast_iterator<Header>::alloc pair(alloc.object(), alloc.header());
+				fn(pair);
+			};
+		int bucket = a->bucket();
+		if (bucket < 0)
+		{
+			static_cast<HugeAllocator<Header, SizeClasses>*>(a)->for_each_allocation(visit);
+			return;
+		}
+		allocator_factory<SizeClasses, Header>::for_each_allocation(bucket, a, visit);
+	}
+	/**
+	 * Call `fn` with every allocation in the heap, visiting work units in
+	 * parallel on the threads in `pool`.  `fn` may be called concurrently
+	 * from multiple threads, but is called for all of the allocations in a
+	 * given chunk from the same thread.
+	 */
+	template<typename Fn>
+	void parallel_for_each(Fn &&fn, gc_thread_pool &pool=gc_workers)
+	{
+		work_unit_vector units;
+		work_units(units);
+		pool.parallel_for(units.size(), [&](size_t i)
+			{
+				for_each_in_work_unit(units[i], fn);
+			});
+	}
 };
 
 
@@ -3,6 +3,37 @@
 struct header { int x; };
 slab_allocator<header> a;
 slab_allocator<void> b;
+slab_allocator<void, jemalloc_size_classes<>> c;
+using service_size_classes = table_size_classes<32_KiB, 16, 32, 64, 96, 128, 256, 4_KiB, 64_KiB>;
+slab_allocator<void, service_size_classes> d;
+
+// A table maps each size to the smallest entry that can hold it, and sizes
+// of the medium limit and above to large buckets.
+static_assert(service_size_classes::bucket_count() == 8, "Wrong bucket count");
+static_assert(service_size_classes::bucket_for_size(1) == 0, "Wrong bucket");
+static_assert(service_size_classes::bucket_for_size(16) == 0, "Wrong bucket");
+static_assert(service_size_classes::bucket_for_size(17) == 1, "Wrong bucket");
+static_assert(service_size_classes::bucket_for_size(100) == 4, "Wrong bucket");
+static_assert(service_size_classes::bucket_for_size(64_KiB) == 7, "Wrong bucket");
+static_assert(service_size_classes::bucket_for_size(64_KiB + 1) == -1,
+              "Sizes above the table should be huge");
+static_assert(service_size_classes::size<6>() == 4_KiB, "Wrong bucket size");
+static_assert(service_size_classes::largest_medium_bucket() == 6,
+              "Wrong medium limit");
+
+// The default policy's buckets are ascending, and each bucket is the one
+// that a request for exactly its size maps to.
+using default_size_classes = prime_or_power_of_two_size_classes;
+static_assert(default_size_classes::size<0>() == sizeof(void*), "Wrong first bucket");
+static_assert(default_size_classes::size<0>() < default_size_classes::size<1>(),
+              "Buckets must ascend");
+static_assert(default_size_classes::bucket_for_size(default_size_classes::size<5>()) == 5,
+              "Wrong bucket");
+static_assert(default_size_classes::bucket_for_size(default_size_classes::size<5>() + 1) == 6,
+              "Wrong bucket");
+static_assert(default_size_classes::bucket_for_size(32_KiB) ==
+              default_size_classes::largest_medium_bucket() + 1,
+              "32KiB should be the first large bucket");
 
 int main(void)
 {
@@ -53,5 +84,99 @@ int main(void)
 		idx++;
 	}
 	assert(idx == allocs.size() - 1);
+	// A parallel heap walk should visit the same allocations.
+	std::atomic<int> parallel_idx(0);
+	b.parallel_for_each([&](std::pair<void*, void*> &) { parallel_idx++; });
+	assert(parallel_idx == idx);
+	// So should internal iteration, which constructs capabilities lazily.
+	int visited = 0;
+	b.for_each_allocation([&](const auto &alloc)
+		{
+			assert(cheri::base(alloc.object()) == alloc.address());
+			assert(cheri::length(alloc.object()) == alloc.size());
+			visited++;
+		});
+	assert(visited == idx);
+	// Allocators with a different size-class policy should round up to the
+	// buckets defined by that policy.
+	using jemalloc = jemalloc_size_classes<>;
+	x = c.alloc(1040);
+	assert(cheri::length(x) == 1040);
+	y = c.object_for_allocation(x, p);
+	assert(cheri::base(y) == cheri::base(x));
+	assert(cheri::length(y) == jemalloc::size_for_bucket(jemalloc::bucket_for_size(1040)));
+	x = c.alloc(40_KiB);
+	y = c.object_for_allocation(x, p);
+	assert(cheri::length(y) == 40_KiB);
+	// Every bucket of a table policy should be usable, and allocations should
+	// be rounded up to the next entry.
+	x = d.alloc(100);
+	y = d.object_for_allocation(x, p);
+	assert(cheri::length(x) == 100);
+	assert(cheri::length(y) == 128);
+	x = d.alloc(5_KiB);
+	y = d.object_for_allocation(x, p);
+	assert(cheri::length(y) == 64_KiB);
+	for (size_t sz = 1 ; sz <= 64_KiB ; sz *= 2)
+	{
+		x = d.alloc(sz);
+		y = d.object_for_allocation(x, p);
+		size_t rounded = service_size_classes::size_for_bucket(
+				service_size_classes::bucket_for_size(sz));
+		assert(cheri::length(y) == rounded);
+		y = b.object_for_allocation(b.alloc(sz), p);
+		assert(cheri::length(y) >= sz);
+		assert(cheri::length(y) < 2 * sz + sizeof(void*));
+	}
+	// Fill several chunks of one bucket and drop everything.  Chunks that
+	// were full must be reused once they have been swept, so allocating the
+	// same amount again must not create any more.
+	const int fill = 3 * (chunk_size / 4_KiB);
+	for (int i=0 ; i<fill ; i++)
+	{
+		a.alloc(4_KiB);
+	}
+	size_t chunks = a.fixed_allocator_count();
+	a.begin_sweep();
+	a.finish_sweep();
+	for (int i=0 ; i<fill ; i++)
+	{
+		a.alloc(4_KiB);
+	}
+	assert(a.fixed_allocator_count() == chunks);
+	// A mutator may choose a chunk, be stopped while a collection marks and
+	// begins a lazy sweep, and then reserve from the chunk before it has
+	// been swept for the new epoch.  The allocation that it is given must
+	// not be freed by that chunk's sweep.
+	void *before = a.alloc(48);
+	decltype(a)::work_unit_vector units;
+	a.work_units(units);
+	decltype(a)::work_unit chunk = nullptr;
+	for (auto *u : units)
+	{
+		if ((u->bucket() >= 0) &&
+		    ((vaddr_t)before >= (vaddr_t)u) &&
+		    ((vaddr_t)before < (vaddr_t)u + u->chunk_length()))
+		{
+			chunk = u;
+		}
+	}
+	assert(chunk != nullptr);
+	a.begin_sweep();
+	x = a.try_allocate_from(chunk, 48, true);
+	if (x == nullptr)
+	{
+		x = a.alloc(48);
+	}
+	a.finish_sweep();
+	bool still_allocated = false;
+	a.for_each_allocation([&](const auto &alloc)
+		{
+			if (alloc.address() == (vaddr_t)x)
+			{
+				still_allocated = true;
+			}
+		});
+	assert(still_allocated);
 	return 0;
 }
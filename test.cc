@@ -165,9 +165,59 @@ int main()
 		l->next = head;
 		head = l;
 	}
+	// Objects allocated from thread-local allocation buffers should be found
+	// from pointers to them.
+	for (list *l = head ; l != nullptr ; l = l->next)
+	{
+		mark_and_compact_object_header *header;
+		void *obj = get_heap()->object_for_allocation(l, header);
+		assert(cheri::base(obj) == cheri::base(l));
+	}
+	// Large objects should be found from pointers into them, whatever order
+	// they were allocated in.
+	char *large[8];
+	for (int i=0 ; i<8 ; i++)
+	{
+		large[i] = static_cast<char*>(GC_malloc(page_size * (i + 1)));
+	}
+	for (int i=0 ; i<8 ; i++)
+	{
+		mark_and_compact_object_header *header;
+		void *obj = get_heap()->object_for_allocation(large[i] + page_size * i, header);
+		assert(cheri::base(obj) == cheri::base(large[i]));
+	}
+	// A parallel heap walk should find the same objects as a serial one.
+	std::atomic<int> parallel_objects(0);
+	get_heap()->parallel_for_each([&](std::pair<mark_and_compact_object_header*, void*>)
+		{
+			parallel_objects++;
+		});
+	int serial_objects = 0;
+	for (auto alloc : *get_heap())
+	{
+		serial_objects++;
+	}
+	assert(parallel_objects == serial_objects);
+	int visited_objects = 0;
+	get_heap()->for_each_allocation([&](const auto &alloc)
+		{
+			assert(cheri::base(alloc.object()) == alloc.address());
+			visited_objects++;
+		});
+	assert(visited_objects == serial_objects);
 	// Run the GC, should not find any garbage.
 	GC_collect();
 	fprintf(stderr, "Head: %#p\n", head);
+	// Keep an untagged copy of a pointer to an object in the middle of the
+	// list.  The collector ignores it, so it becomes a stale pointer into
+	// whatever reuses the space once the list is truncated.
+	list *middle = head;
+	for (int i=0 ; i<50 ; i++)
+	{
+		middle = middle->next;
+	}
+	void *stale = __builtin_cheri_tag_clear(static_cast<void*>(middle));
+	middle = nullptr;
 	// Clear the next element of the head.  Should now have 99 dead objects.
 	fprintf(stderr, "Truncating list!\n");
 	head->next = nullptr;
@@ -182,4 +232,18 @@ int main()
 	// Head value should be the same, but head object should be moved.
 	fprintf(stderr, "Head: %#p\n", head);
 	fprintf(stderr, "Head val: %d\n", head->val);
+	// The collection invalidates allocation buffers, so new objects must not
+	// overlap the compacted survivor.
+	list *fresh = new list(100);
+	assert(cheri::base(fresh) >= cheri::base(head) + cheri::length(head));
+	assert(head->val == 0);
+	// The rest of the new allocation buffer is a filler object, which now
+	// covers the space where the dead part of the list was.  A stale pointer
+	// into it must resolve to the filler, not to an object that used to be
+	// there.
+	vaddr_t filler = cheri::base(fresh) + cheri::length(fresh);
+	assert(cheri::base(stale) > filler);
+	mark_and_compact_object_header *filler_header;
+	get_heap()->object_for_allocation(stale, filler_header);
+	assert(cheri::base(filler_header) == filler);
 }
@@ -244,6 +244,39 @@ class SplicedForwardIterator<It1, It2> make_spliced_forward_iterator(It1 &&start
 	return SplicedForwardIterator<It1, It2>(std::move(start1), std::move(end1), std::move(start2));
 }
 
+/**
+ * Capture the return addresses of the current call stack into `buffer`,
+ * skipping the innermost `skip` frames.  Returns the number of frames that
+ * were recorded, which is at most `max_depth`.
+ */
+int capture_backtrace(size_t *buffer, int max_depth, int skip=0)
+{
+	struct state
+	{
+		size_t *buffer;
+		int max_depth;
+		int skip;
+		int depth;
+	} s = { buffer, max_depth, skip, 0 };
+	_Unwind_Backtrace([](struct _Unwind_Context *context, void *arg)
+		{
+			state &s = *static_cast<state*>(arg);
+			if (s.skip > 0)
+			{
+				s.skip--;
+				return _URC_NO_REASON;
+			}
+			size_t ip = (size_t)_Unwind_GetIP(context);
+			if ((ip == 0) || (s.depth >= s.max_depth))
+			{
+				return _URC_END_OF_STACK;
+			}
+			s.buffer[s.depth++] = ip;
+			return _URC_NO_REASON;
+		}, static_cast<void*>(&s));
+	return s.depth;
+}
+
 /**
  * External function that clears all callee-save capability registers.
  */
@@ -0,0 +1,179 @@
+/*-
+ * Copyright (c) 2017 David T Chisnall
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include "utils.hh"
+#include "page.hh"
+
+namespace {
+
+/**
+ * A Chase-Lev work-stealing deque.  One thread (the owner) pushes and takes
+ * values at the bottom.  Any thread may steal values from the top.  This
+ * follows the C11 formulation in "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Lê et al., PPoPP 2013), but with a fixed capacity: `push`
+ * fails when the deque is full rather than growing it, so that the owner can
+ * decide where the value goes instead.
+ *
+ * The storage is a power-of-two ring buffer that is page allocated on the
+ * first push and reused after `reset`, so it is invisible to the collector.
+ */
+template<typename T, size_t Capacity=4096>
+class work_stealing_deque
+{
+	static_assert((Capacity & (Capacity - 1)) == 0,
+	              "Capacity must be a power of two");
+	/**
+	 * The index one past the most recently pushed value.  Written only by the
+	 * owner.
+	 */
+	std::atomic<ptrdiff_t> bottom;
+	/**
+	 * The index of the oldest value.  Advanced by stealers and by the owner
+	 * when it takes the last value.
+	 */
+	std::atomic<ptrdiff_t> top;
+	/**
+	 * The ring buffer.  Allocated on the first push.
+	 */
+	std::atomic<T> *ring;
+	/**
+	 * Returns the slot for index `i`.
+	 */
+	std::atomic<T> &slot(ptrdiff_t i)
+	{
+		return ring[i & (Capacity - 1)];
+	}
+	public:
+	/**
+	 * The number of values that the deque can hold.
+	 */
+	static const size_t capacity = Capacity;
+	/**
+	 * The result of a steal.
+	 */
+	enum steal_result
+	{
+		/// A value was stolen.
+		stolen,
+		/// The deque was empty.
+		empty,
+		/// Another thread took the value first.  The caller may retry.
+		lost_race
+	};
+	/**
+	 * Push a value.  Returns false if the deque is full.  May only be called
+	 * by the owner.
+	 */
+	bool push(T v)
+	{
+		ptrdiff_t b = bottom.load(std::memory_order_relaxed);
+		ptrdiff_t t = top.load(std::memory_order_acquire);
+		if (b - t >= static_cast<ptrdiff_t>(Capacity))
+		{
+			return false;
+		}
+		if (ring == nullptr)
+		{
+			ring = PageAllocator<std::atomic<T>>().allocate(Capacity);
+		}
+		slot(b).store(v, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return true;
+	}
+	/**
+	 * Take the most recently pushed value.  Returns false if the deque is
+	 * empty.  May only be called by the owner.
+	 */
+	bool take(T &v)
+	{
+		ptrdiff_t b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		ptrdiff_t t = top.load(std::memory_order_relaxed);
+		if (t > b)
+		{
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+		v = slot(b).load(std::memory_order_relaxed);
+		if (t == b)
+		{
+			// Last value: race against stealers for it.
+			bool won = top.compare_exchange_strong(t, t + 1,
+				std::memory_order_seq_cst, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return won;
+		}
+		return true;
+	}
+	/**
+	 * Steal the oldest value.  May be called by any thread.
+	 */
+	steal_result steal(T &v)
+	{
+		ptrdiff_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		ptrdiff_t b = bottom.load(std::memory_order_acquire);
+		if (t >= b)
+		{
+			return empty;
+		}
+		v = slot(t).load(std::memory_order_relaxed);
+		if (!top.compare_exchange_strong(t, t + 1,
+			std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			return lost_race;
+		}
+		return stolen;
+	}
+	/**
+	 * Returns true if the deque appears to be empty.  This is exact only when
+	 * no other thread is using the deque.
+	 */
+	bool empty_hint()
+	{
+		return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+	}
+	/**
+	 * Empty the deque.  Must not be called concurrently with any other
+	 * method.
+	 */
+	void reset()
+	{
+		top.store(0, std::memory_order_relaxed);
+		bottom.store(0, std::memory_order_relaxed);
+	}
+};
+
+} // Anonymous namespace